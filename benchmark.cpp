@@ -0,0 +1,913 @@
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <filesystem>
+#include <new>
+
+#include "image2palette.hpp"
+#include "stb_image.h"
+
+//Microbenchmarks of the hot functions over synthetic images and the imgs/ corpus.
+//With --compare, the results are checked against a previous --json run: a benchmark regresses when its
+//median slowed down by more than the threshold and a Mann-Whitney U test over the samples agrees,
+//and any palette differing from the stored ones fails the comparison.
+//  g++ -O2 -std=c++17 benchmark.cpp image2palette.cpp -o palette-benchmark -lpthread
+
+static long long allocationCount = 0;
+
+//Every replaceable form of new and delete goes through these two, so no pointer is ever freed by a mismatched function
+void* CountedAllocate(size_t size, size_t alignment) {
+    ++allocationCount;
+    if (alignment <= alignof(std::max_align_t))
+        return malloc(size ? size : 1);
+    //aligned_alloc wants a multiple of the alignment
+    return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment + (size ? 0 : alignment));
+}
+
+void CountedFree(void* pointer) noexcept {
+    free(pointer);
+}
+
+void* CountedAllocateOrThrow(size_t size, size_t alignment) {
+    if (void* pointer = CountedAllocate(size, alignment))
+        return pointer;
+    throw std::bad_alloc{};
+}
+
+void* operator new(size_t size) {
+    return CountedAllocateOrThrow(size, 0);
+}
+
+void* operator new[](size_t size) {
+    return CountedAllocateOrThrow(size, 0);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    return CountedAllocateOrThrow(size, (size_t)alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return CountedAllocateOrThrow(size, (size_t)alignment);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return CountedAllocate(size, 0);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return CountedAllocate(size, 0);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return CountedAllocate(size, (size_t)alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return CountedAllocate(size, (size_t)alignment);
+}
+
+void operator delete(void* pointer) noexcept {
+    CountedFree(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+    CountedFree(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    CountedFree(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept {
+    CountedFree(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept {
+    CountedFree(pointer);
+}
+
+void operator delete[](void* pointer, std::align_val_t) noexcept {
+    CountedFree(pointer);
+}
+
+void operator delete(void* pointer, size_t, std::align_val_t) noexcept {
+    CountedFree(pointer);
+}
+
+void operator delete[](void* pointer, size_t, std::align_val_t) noexcept {
+    CountedFree(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept {
+    CountedFree(pointer);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept {
+    CountedFree(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t, const std::nothrow_t&) noexcept {
+    CountedFree(pointer);
+}
+
+void operator delete[](void* pointer, std::align_val_t, const std::nothrow_t&) noexcept {
+    CountedFree(pointer);
+}
+
+struct BenchmarkOptions {
+    const char* corpus{ "imgs" };
+    const char* outputJson{ nullptr };
+    const char* filter{ nullptr };
+    const char* baselineJson{ nullptr };
+    int size{ 512 };
+    int sampleCount{ 10 };
+    double minSeconds{ 0.2 };
+    double thresholdPercent{ 5.0 };
+    double alpha{ 0.01 };
+};
+
+struct BenchmarkImage {
+    std::string name{};
+    int width{};
+    int height{};
+    std::vector<unsigned char> rgb{};
+    std::vector<float> samples{}; //rgb / 255, what the pixel walk hands to the color functions
+    std::vector<ColorHSL> hslColors{};
+};
+
+struct BenchmarkResult {
+    std::string name{};
+    std::string input{};
+    const char* unit{ nullptr };
+    double nsPerItem{}; //Median of the samples
+    std::vector<double> samples{};
+    double allocationsPerCall{};
+    long long calls{};
+};
+
+//What the default settings of every engine pick for an input, the reference for later changes
+struct GoldenPalette {
+    std::string input{};
+    std::string engine{};
+    std::string colors[16]{};
+};
+
+struct JsonValue {
+    enum class Type { Null, Boolean, Number, String, Array, Object } type{ Type::Null };
+    double number{};
+    std::string string{};
+    std::vector<JsonValue> items{};
+    std::vector<std::pair<std::string, JsonValue>> members{};
+};
+
+struct JsonParser {
+    const char* cursor{ nullptr };
+    const char* end{ nullptr };
+    int depth{};
+};
+
+//Keeps the compiler from dropping the benchmarked work
+static volatile float sink = 0.0f;
+
+void FinishImage(BenchmarkImage& image) {
+    size_t pixelCount = (size_t)image.width * image.height;
+    image.samples.resize(pixelCount * 3);
+    image.hslColors.resize(pixelCount);
+    for (size_t i = 0; i < pixelCount * 3; ++i)
+        image.samples[i] = image.rgb[i] / 255.0f;
+    for (size_t i = 0; i < pixelCount; ++i) {
+        const float* pixel = &image.samples[i * 3];
+        image.hslColors[i].hue = (unsigned int)GetColorHUE(pixel[0], pixel[1], pixel[2]);
+        image.hslColors[i].saturation = (unsigned int)(GetColorSaturation(pixel[0], pixel[1], pixel[2]) * SATURATION_VALUE_COUNT);
+        image.hslColors[i].brightness = (unsigned int)(GetColorBrightness(pixel[0], pixel[1], pixel[2]) * BRIGHTNESS_VALUE_COUNT);
+    }
+}
+
+//Deterministic inputs covering the cheap and the expensive ends of the key extraction
+void BuildSyntheticImages(int size, std::vector<BenchmarkImage>& images) {
+    const char* names[] = { "solid", "gradient", "noise", "many-hue" };
+    std::mt19937 random{ 1 };
+
+    for (const char* name : names) {
+        BenchmarkImage image{};
+        image.name = name;
+        image.width = size;
+        image.height = size;
+        image.rgb.resize((size_t)size * size * 3);
+
+        for (int y = 0; y < size; ++y) {
+            for (int x = 0; x < size; ++x) {
+                unsigned char* pixel = &image.rgb[((size_t)y * size + x) * 3];
+                if (strcmp(name, "solid") == 0) {
+                    pixel[0] = 40;
+                    pixel[1] = 90;
+                    pixel[2] = 160;
+                } else if (strcmp(name, "gradient") == 0) {
+                    pixel[0] = x * 255 / size;
+                    pixel[1] = y * 255 / size;
+                    pixel[2] = 128;
+                } else if (strcmp(name, "noise") == 0) {
+                    pixel[0] = random() & 0xff;
+                    pixel[1] = random() & 0xff;
+                    pixel[2] = random() & 0xff;
+                } else {
+                    ColorHSL hslColor{};
+                    hslColor.hue = x * HUE_VALUE_COUNT / size;
+                    hslColor.saturation = 40 + (y * 7) % 60;
+                    hslColor.brightness = 10 + y * 80 / size;
+                    Color color = Hsl2Rgb(hslColor);
+                    pixel[0] = color.r;
+                    pixel[1] = color.g;
+                    pixel[2] = color.b;
+                }
+            }
+        }
+
+        FinishImage(image);
+        images.push_back(std::move(image));
+    }
+}
+
+void LoadCorpusImages(const char* directory, std::vector<BenchmarkImage>& images) {
+    std::error_code error{};
+    std::vector<std::filesystem::path> paths{};
+    for (const auto& entry : std::filesystem::directory_iterator{ directory, error }) {
+        if (entry.is_regular_file())
+            paths.push_back(entry.path());
+    }
+    std::sort(paths.begin(), paths.end());
+
+    for (const auto& path : paths) {
+        BenchmarkImage image{};
+        int channels{};
+        unsigned char* data = stbi_load(path.string().c_str(), &image.width, &image.height, &channels, 3);
+        if (!data) {
+            std::cerr << "Skipping \"" << path.string() << "\", couldn't load it." << std::endl;
+            continue;
+        }
+        image.name = path.filename().string();
+        image.rgb.assign(data, data + (size_t)image.width * image.height * 3);
+        stbi_image_free(data);
+
+        FinishImage(image);
+        images.push_back(std::move(image));
+    }
+}
+
+//Warms up once, so growing scratch buffers don't count, then takes sampleCount samples over at least minSeconds
+template<typename Function>
+void Measure(const BenchmarkOptions& options, const char* name, const BenchmarkImage& image, const char* unit, long long itemsPerCall,
+    std::vector<BenchmarkResult>& results, Function&& function) {
+    if (options.filter && !strstr(name, options.filter))
+        return;
+
+    function();
+
+    BenchmarkResult result{};
+    result.samples.reserve(options.sampleCount);
+    long long allocationsBefore = allocationCount;
+    for (int i = 0; i < options.sampleCount; ++i) {
+        long long calls = 0;
+        auto start = std::chrono::steady_clock::now();
+        double seconds = 0.0;
+        do {
+            function();
+            ++calls;
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while (seconds < options.minSeconds / options.sampleCount);
+        result.samples.push_back(seconds * 1e9 / ((double)calls * itemsPerCall));
+        result.calls += calls;
+    }
+    long long allocations = allocationCount - allocationsBefore;
+
+    std::vector<double> sorted = result.samples;
+    std::sort(sorted.begin(), sorted.end());
+    size_t middle = sorted.size() / 2;
+    result.nsPerItem = sorted.size() % 2 ? sorted[middle] : (sorted[middle - 1] + sorted[middle]) / 2.0;
+    result.name = name;
+    result.input = image.name;
+    result.unit = unit;
+    result.allocationsPerCall = (double)allocations / result.calls;
+    printf("%-24s %-16s %12.3f ns/%-5s %8.2f allocs/call\n", name, image.name.c_str(), result.nsPerItem, unit, result.allocationsPerCall);
+    results.push_back(result);
+}
+
+void RunImageBenchmarks(const BenchmarkOptions& options, const BenchmarkImage& image, std::vector<BenchmarkResult>& results) {
+    long long pixelCount = (long long)image.width * image.height;
+    const float* samples = image.samples.data();
+    ImageView view{ image.rgb.data(), SampleType::UInt8, image.width, image.height, PixelFormat::RGB };
+
+    Measure(options, "GetColorHUE", image, "pixel", pixelCount, results, [&]() {
+        float sum = 0.0f;
+        for (long long i = 0; i < pixelCount; ++i)
+            sum += GetColorHUE(samples[i * 3], samples[i * 3 + 1], samples[i * 3 + 2]);
+        sink = sum;
+    });
+    Measure(options, "GetColorSaturation", image, "pixel", pixelCount, results, [&]() {
+        float sum = 0.0f;
+        for (long long i = 0; i < pixelCount; ++i)
+            sum += GetColorSaturation(samples[i * 3], samples[i * 3 + 1], samples[i * 3 + 2]);
+        sink = sum;
+    });
+    Measure(options, "GetColorBrightness", image, "pixel", pixelCount, results, [&]() {
+        float sum = 0.0f;
+        for (long long i = 0; i < pixelCount; ++i)
+            sum += GetColorBrightness(samples[i * 3], samples[i * 3 + 1], samples[i * 3 + 2]);
+        sink = sum;
+    });
+    Measure(options, "Hsl2Rgb", image, "pixel", pixelCount, results, [&]() {
+        int sum = 0;
+        for (const auto& hslColor : image.hslColors)
+            sum += Hsl2Rgb(hslColor).g;
+        sink = sum;
+    });
+
+    //The single pass binning every pixel by brightness row and hue, with its saturation sum
+    ColorHistogram histogram{};
+    Measure(options, "AccumulateHistogram", image, "pixel", pixelCount, results, [&]() {
+        ClearHistogram(histogram, BinResolution::Quality);
+        AccumulateHistogram(view, histogram);
+    });
+    Measure(options, "AccumulateHistogramFast", image, "pixel", pixelCount, results, [&]() {
+        ClearHistogram(histogram, BinResolution::Fast);
+        AccumulateHistogram(view, histogram);
+    });
+
+    //KeyL rows, their merges, then the KeyHS of every KeyL and their merges
+    ClearHistogram(histogram, BinResolution::Quality);
+    AccumulateHistogram(view, histogram);
+    PaletteKeys keys{};
+    Measure(options, "ExtractKeysFromHistogram", image, "call", 1, results, [&]() {
+        ExtractKeysFromHistogram(histogram, keys);
+    });
+
+    ExtractKeysFromHistogram(histogram, keys);
+    std::vector<Scored<ColorHSL>> scoredColors{};
+    ColorHSL refColor{ 200, 30, 20 };
+    Measure(options, "GetMatchingColor", image, "call", 1, results, [&]() {
+        GetMatchingColor(keys, scoredColors, 0, 50, 70, 0.0f, 1.0f, 1.0f, 0.0f);
+        sink = scoredColors.empty() ? 0.0f : scoredColors[0].score;
+    });
+    Measure(options, "GetMatchingDiffColor", image, "call", 1, results, [&]() {
+        GetMatchingDiffColor(keys, scoredColors, refColor, 10, 0, 8, 0.0f, 0.0f, 1.0f, 0.0f, true);
+        sink = scoredColors.empty() ? 0.0f : scoredColors[0].score;
+    });
+
+    //The whole default plan, every step scoring all the keys again
+    Base16Palette palette{};
+    Measure(options, "SelectBase16Palette", image, "call", 1, results, [&]() {
+        SelectBase16Palette(keys, GetDefaultSelectionPlan(), scoredColors, palette);
+        sink = palette.primary[0].r;
+    });
+}
+
+//Whole extraction of every engine, with and without the selection, and the palettes they end up with
+void RunExtractionBenchmarks(const BenchmarkOptions& options, const BenchmarkImage& image, std::vector<BenchmarkResult>& results,
+    std::vector<GoldenPalette>& palettes) {
+    long long pixelCount = (long long)image.width * image.height;
+    ImageView view{ image.rgb.data(), SampleType::UInt8, image.width, image.height, PixelFormat::RGB };
+    const Engine engines[] = { Engine::Histogram, Engine::Octree, Engine::KMeans };
+    const char* names[] = { "ExtractKeysHistogram", "ExtractKeysOctree", "ExtractKeysKMeans" };
+    const char* extractNames[] = { "ExtractHistogram", "ExtractOctree", "ExtractKMeans" };
+
+    for (int i = 0; i < 3; ++i) {
+        ExtractionSettings settings{};
+        settings.engine = engines[i];
+        PaletteExtractor extractor{ settings };
+        Measure(options, names[i], image, "pixel", pixelCount, results, [&]() {
+            extractor.extractKeys(view);
+        });
+
+        Base16Palette palette{};
+        Measure(options, extractNames[i], image, "pixel", pixelCount, results, [&]() {
+            extractor.extract(view, palette);
+        });
+        //Measure may be filtered out, the golden palette is always extracted
+        extractor.extract(view, palette);
+        GoldenPalette golden{};
+        golden.input = image.name;
+        golden.engine = GetEngineName(engines[i]);
+        for (int j = 0; j < 16; ++j) {
+            const Color& color = j < 8 ? palette.primary[j] : palette.accents[j - 8];
+            char hex[7];
+            snprintf(hex, sizeof(hex), "%02x%02x%02x", color.r, color.g, color.b);
+            golden.colors[j] = hex;
+        }
+        palettes.push_back(golden);
+    }
+}
+
+//A weighted image shorter than the thread count, so some workers get no rows and merge empty bands.
+//Palettes and populations must not depend on the thread count
+bool CheckThreadInvariance() {
+    const int width = 131072;
+    const int height = 4;
+    std::vector<unsigned char> rgb((size_t)width * height * 3);
+    std::vector<unsigned char> weights((size_t)width * height);
+    for (size_t i = 0; i < weights.size(); ++i) {
+        rgb[i * 3] = (unsigned char)(i * 7);
+        rgb[i * 3 + 1] = (unsigned char)(i / 512);
+        rgb[i * 3 + 2] = (unsigned char)(255 - i % 200);
+        weights[i] = (unsigned char)(i % 5 ? i % 256 : 0);
+    }
+    ImageView view{ rgb.data(), SampleType::UInt8, width, height, PixelFormat::RGB };
+    view.weights = weights.data();
+
+    const int threadCounts[] = { 1, 3, 8 };
+    Base16Palette palettes[3]{};
+    long long populations[3]{};
+    for (int i = 0; i < 3; ++i) {
+        ExtractionSettings settings{};
+        settings.threadCount = threadCounts[i];
+        PaletteExtractor extractor{ settings };
+        populations[i] = extractor.extract(view, palettes[i]).population;
+    }
+
+    bool identical = true;
+    for (int i = 1; i < 3; ++i) {
+        if (populations[i] != populations[0] || memcmp(&palettes[i], &palettes[0], sizeof(Base16Palette)) != 0) {
+            std::cerr << "Weighted extraction with " << threadCounts[i] << " threads differs from 1 thread (population "
+                << populations[i] << " instead of " << populations[0] << ")." << std::endl;
+            identical = false;
+        }
+    }
+    return identical;
+}
+
+void RunOutputBenchmarks(const BenchmarkOptions& options, std::vector<BenchmarkResult>& results) {
+    Base16Palette palette{};
+    for (int i = 0; i < 8; ++i) {
+        palette.primary[i] = Color{ (unsigned char)(i * 32), (unsigned char)(i * 16), (unsigned char)(255 - i * 32) };
+        palette.accents[i] = Color{ (unsigned char)(255 - i * 16), (unsigned char)(i * 32), (unsigned char)(i * 8) };
+    }
+
+    BenchmarkImage none{};
+    none.name = "palette";
+    std::string jsonPath = (std::filesystem::temp_directory_path() / "palette-benchmark.json").string();
+    std::string htmlPath = (std::filesystem::temp_directory_path() / "palette-benchmark.html").string();
+    Measure(options, "WriteJsonPalette", none, "call", 1, results, [&]() {
+        WriteJsonPalette(palette, jsonPath.c_str());
+    });
+    Measure(options, "WriteHtmlPalette", none, "call", 1, results, [&]() {
+        WriteHtmlPalette(palette, htmlPath.c_str());
+    });
+
+    //Every format from one formatting pass, in memory
+    PaletteRenderer renderer{};
+    Measure(options, "RenderPalette", none, "call", 1, results, [&]() {
+        SetRendererPalette(renderer, palette);
+        for (int i = 0; i < PALETTE_FORMAT_COUNT; ++i) {
+            size_t size = 0;
+            RenderPalette(renderer, (PaletteFormat)i, size);
+        }
+    });
+
+    //The batch sink, a flush every few thousand lines
+    std::string linesPath = (std::filesystem::temp_directory_path() / "palette-benchmark.jsonl").string();
+    PaletteSink sink{};
+    ExtractionStats stats{ 2359296, 581760 };
+    if (OpenPaletteSink(sink, linesPath.c_str())) {
+        Measure(options, "AppendPaletteLine", none, "call", 1, results, [&]() {
+            AppendPaletteLine(sink, "imgs/eldenring.jpg", palette, &stats);
+        });
+        ClosePaletteSink(sink);
+    }
+    std::filesystem::remove(jsonPath);
+    std::filesystem::remove(htmlPath);
+    std::filesystem::remove(linesPath);
+}
+
+bool WriteBenchmarkJson(const std::vector<BenchmarkResult>& results, const std::vector<GoldenPalette>& palettes, const BenchmarkOptions& options,
+    const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "{\n    \"size\": %d,\n    \"min_seconds\": %.3f,\n    \"benchmarks\": [\n", options.size, options.minSeconds);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult& result = results[i];
+        fprintf(file, "        { \"name\": \"%s\", \"input\": \"%s\", \"unit\": \"%s\", \"ns_per_item\": %.4f, \"allocations_per_call\": %.3f, \"calls\": %lld, \"samples\": [",
+            result.name.c_str(), result.input.c_str(), result.unit, result.nsPerItem, result.allocationsPerCall, result.calls);
+        for (size_t j = 0; j < result.samples.size(); ++j)
+            fprintf(file, "%s%.4f", j ? ", " : "", result.samples[j]);
+        fprintf(file, "] }%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "    ],\n    \"palettes\": [\n");
+    for (size_t i = 0; i < palettes.size(); ++i) {
+        fprintf(file, "        { \"input\": \"%s\", \"engine\": \"%s\", \"colors\": [", palettes[i].input.c_str(), palettes[i].engine.c_str());
+        for (int j = 0; j < 16; ++j)
+            fprintf(file, "%s\"%s\"", j ? ", " : "", palettes[i].colors[j].c_str());
+        fprintf(file, "] }%s\n", i + 1 < palettes.size() ? "," : "");
+    }
+    fprintf(file, "    ]\n}\n");
+    fclose(file);
+    return true;
+}
+
+void SkipJsonWhitespace(JsonParser& parser) {
+    while (parser.cursor < parser.end && strchr(" \t\r\n", *parser.cursor))
+        ++parser.cursor;
+}
+
+bool ParseJsonString(JsonParser& parser, std::string& string) {
+    if (parser.cursor >= parser.end || *parser.cursor != '"')
+        return false;
+    ++parser.cursor;
+    string.clear();
+    while (parser.cursor < parser.end && *parser.cursor != '"') {
+        char c = *parser.cursor++;
+        if (c == '\\') {
+            if (parser.cursor >= parser.end)
+                return false;
+            c = *parser.cursor++;
+            switch (c) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'u': {
+                    //Only what the benchmark writes matters, non ASCII escapes become '?'
+                    if (parser.end - parser.cursor < 4)
+                        return false;
+                    long code = strtol(std::string(parser.cursor, 4).c_str(), nullptr, 16);
+                    c = code < 0x80 ? (char)code : '?';
+                    parser.cursor += 4;
+                    break;
+                }
+                default: break; //'"', '\\' and '/' stand for themselves
+            }
+        }
+        string += c;
+    }
+    if (parser.cursor >= parser.end)
+        return false;
+    ++parser.cursor;
+    return true;
+}
+
+//Just enough JSON for the files written by WriteBenchmarkJson
+bool ParseJsonValue(JsonParser& parser, JsonValue& value) {
+    SkipJsonWhitespace(parser);
+    if (parser.cursor >= parser.end || parser.depth > 64)
+        return false;
+
+    char c = *parser.cursor;
+    if (c == '{' || c == '[') {
+        bool object = c == '{';
+        value.type = object ? JsonValue::Type::Object : JsonValue::Type::Array;
+        ++parser.cursor;
+        ++parser.depth;
+        SkipJsonWhitespace(parser);
+        if (parser.cursor < parser.end && *parser.cursor == (object ? '}' : ']')) {
+            ++parser.cursor;
+            --parser.depth;
+            return true;
+        }
+        while (true) {
+            JsonValue item{};
+            std::string name{};
+            if (object) {
+                SkipJsonWhitespace(parser);
+                if (!ParseJsonString(parser, name))
+                    return false;
+                SkipJsonWhitespace(parser);
+                if (parser.cursor >= parser.end || *parser.cursor++ != ':')
+                    return false;
+            }
+            if (!ParseJsonValue(parser, item))
+                return false;
+            if (object)
+                value.members.emplace_back(name, std::move(item));
+            else
+                value.items.push_back(std::move(item));
+
+            SkipJsonWhitespace(parser);
+            if (parser.cursor >= parser.end)
+                return false;
+            char separator = *parser.cursor++;
+            if (separator == (object ? '}' : ']'))
+                break;
+            if (separator != ',')
+                return false;
+        }
+        --parser.depth;
+        return true;
+    }
+    if (c == '"') {
+        value.type = JsonValue::Type::String;
+        return ParseJsonString(parser, value.string);
+    }
+
+    const char* literals[] = { "true", "false", "null" };
+    for (const char* literal : literals) {
+        size_t length = strlen(literal);
+        if ((size_t)(parser.end - parser.cursor) >= length && strncmp(parser.cursor, literal, length) == 0) {
+            value.type = literal[0] == 'n' ? JsonValue::Type::Null : JsonValue::Type::Boolean;
+            value.number = literal[0] == 't' ? 1.0 : 0.0;
+            parser.cursor += length;
+            return true;
+        }
+    }
+
+    char* numberEnd = nullptr;
+    value.type = JsonValue::Type::Number;
+    value.number = strtod(parser.cursor, &numberEnd);
+    if (numberEnd == parser.cursor || numberEnd > parser.end)
+        return false;
+    parser.cursor = numberEnd;
+    return true;
+}
+
+const JsonValue* FindJsonMember(const JsonValue& object, const char* name, JsonValue::Type type) {
+    for (const auto& member : object.members) {
+        if (member.first == name)
+            return member.second.type == type ? &member.second : nullptr;
+    }
+    return nullptr;
+}
+
+bool LoadBaseline(const char* path, std::vector<BenchmarkResult>& results, std::vector<GoldenPalette>& palettes) {
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+    std::string text{};
+    char buff[65536];
+    size_t size{};
+    while ((size = fread(buff, 1, sizeof(buff), file)) > 0)
+        text.append(buff, size);
+    fclose(file);
+
+    JsonValue root{};
+    JsonParser parser{ text.c_str(), text.c_str() + text.size() };
+    if (!ParseJsonValue(parser, root) || root.type != JsonValue::Type::Object)
+        return false;
+
+    const JsonValue* benchmarks = FindJsonMember(root, "benchmarks", JsonValue::Type::Array);
+    if (!benchmarks)
+        return false;
+    for (const auto& item : benchmarks->items) {
+        const JsonValue* name = FindJsonMember(item, "name", JsonValue::Type::String);
+        const JsonValue* input = FindJsonMember(item, "input", JsonValue::Type::String);
+        const JsonValue* nsPerItem = FindJsonMember(item, "ns_per_item", JsonValue::Type::Number);
+        if (!name || !input || !nsPerItem)
+            return false;
+
+        BenchmarkResult result{};
+        result.name = name->string;
+        result.input = input->string;
+        result.nsPerItem = nsPerItem->number;
+        //Files written before samples were recorded only have the mean, which can't be tested
+        if (const JsonValue* samples = FindJsonMember(item, "samples", JsonValue::Type::Array)) {
+            for (const auto& sample : samples->items) {
+                if (sample.type == JsonValue::Type::Number)
+                    result.samples.push_back(sample.number);
+            }
+        }
+        results.push_back(result);
+    }
+
+    if (const JsonValue* goldens = FindJsonMember(root, "palettes", JsonValue::Type::Array)) {
+        for (const auto& item : goldens->items) {
+            const JsonValue* input = FindJsonMember(item, "input", JsonValue::Type::String);
+            const JsonValue* engine = FindJsonMember(item, "engine", JsonValue::Type::String);
+            const JsonValue* colors = FindJsonMember(item, "colors", JsonValue::Type::Array);
+            if (!input || !engine || !colors || colors->items.size() != 16)
+                return false;
+
+            GoldenPalette golden{};
+            golden.input = input->string;
+            golden.engine = engine->string;
+            for (int i = 0; i < 16; ++i)
+                golden.colors[i] = colors->items[i].string;
+            palettes.push_back(golden);
+        }
+    }
+    return true;
+}
+
+//One sided Mann-Whitney U test, the probability of the current samples being this much slower by chance.
+//Normal approximation with tie and continuity corrections, fine from about 8 samples per side
+double GetSlowdownPValue(const std::vector<double>& baseline, const std::vector<double>& current) {
+    std::vector<std::pair<double, int>> values{};
+    for (double value : baseline)
+        values.emplace_back(value, 0);
+    for (double value : current)
+        values.emplace_back(value, 1);
+    std::sort(values.begin(), values.end());
+
+    double n1 = (double)current.size();
+    double n2 = (double)baseline.size();
+    double n = n1 + n2;
+    double rankSum = 0.0;
+    double tieSum = 0.0;
+    for (size_t i = 0; i < values.size();) {
+        size_t j = i;
+        while (j < values.size() && values[j].first == values[i].first)
+            ++j;
+        double rank = (i + 1 + j) / 2.0;
+        for (size_t k = i; k < j; ++k) {
+            if (values[k].second == 1)
+                rankSum += rank;
+        }
+        double ties = (double)(j - i);
+        tieSum += ties * ties * ties - ties;
+        i = j;
+    }
+
+    double u = rankSum - n1 * (n1 + 1.0) / 2.0;
+    double variance = n1 * n2 / 12.0 * ((n + 1.0) - tieSum / (n * (n - 1.0)));
+    if (variance <= 0.0)
+        return 1.0;
+    double z = (u - n1 * n2 / 2.0 - 0.5) / std::sqrt(variance);
+    return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
+
+//A warmed up extractor must not allocate, Measure's first call is the warm-up. Returns the number of offenders
+int CheckSteadyStateAllocations(const std::vector<BenchmarkResult>& results) {
+    int failures = 0;
+    for (const auto& result : results) {
+        if (result.name.compare(0, 7, "Extract") != 0 || result.allocationsPerCall == 0.0)
+            continue;
+        std::cerr << result.name << " on " << result.input << " allocates " << result.allocationsPerCall << " times per call once warmed up." << std::endl;
+        ++failures;
+    }
+    return failures;
+}
+
+//Returns the number of regressions and palette changes
+int CompareWithBaseline(const BenchmarkOptions& options, const std::vector<BenchmarkResult>& results, const std::vector<GoldenPalette>& palettes,
+    const std::vector<BenchmarkResult>& baselineResults, const std::vector<GoldenPalette>& baselinePalettes) {
+    int failures = 0;
+    printf("\n%-24s %-16s %12s %12s %8s %10s  %s\n", "benchmark", "input", "baseline ns", "current ns", "change", "p-value", "verdict");
+    for (const auto& result : results) {
+        auto baseline = std::find_if(baselineResults.begin(), baselineResults.end(), [&](const BenchmarkResult& other) {
+            return other.name == result.name && other.input == result.input;
+        });
+        if (baseline == baselineResults.end()) {
+            printf("%-24s %-16s %12s %12.3f %8s %10s  new\n", result.name.c_str(), result.input.c_str(), "-", result.nsPerItem, "-", "-");
+            continue;
+        }
+
+        double change = (result.nsPerItem / baseline->nsPerItem - 1.0) * 100.0;
+        const char* verdict = "ok";
+        double pValue = 1.0;
+        if (baseline->samples.size() < 2 || result.samples.size() < 2) {
+            verdict = "untested";
+        } else {
+            pValue = GetSlowdownPValue(baseline->samples, result.samples);
+            if (change > options.thresholdPercent && pValue < options.alpha) {
+                verdict = "REGRESSED";
+                ++failures;
+            } else if (change < -options.thresholdPercent && GetSlowdownPValue(result.samples, baseline->samples) < options.alpha) {
+                verdict = "improved";
+            }
+        }
+        printf("%-24s %-16s %12.3f %12.3f %+7.1f%% %10.4f  %s\n", result.name.c_str(), result.input.c_str(), baseline->nsPerItem, result.nsPerItem,
+            change, pValue, verdict);
+    }
+
+    if (baselinePalettes.empty())
+        std::cerr << "The baseline has no golden palettes, colors aren't compared." << std::endl;
+    for (const auto& palette : palettes) {
+        auto golden = std::find_if(baselinePalettes.begin(), baselinePalettes.end(), [&](const GoldenPalette& other) {
+            return other.input == palette.input && other.engine == palette.engine;
+        });
+        if (golden == baselinePalettes.end())
+            continue;
+        for (int i = 0; i < 16; ++i) {
+            if (golden->colors[i] != palette.colors[i]) {
+                printf("Palette of %s with %s changed: base%02X was %s, is now %s\n", palette.input.c_str(), palette.engine.c_str(), i,
+                    golden->colors[i].c_str(), palette.colors[i].c_str());
+                ++failures;
+            }
+        }
+    }
+    return failures;
+}
+
+void GetOptions(int argc, char* argv[], BenchmarkOptions& options) {
+    int i = 1;
+    while (i < argc) {
+        if (strcmp(argv[i], "--corpus") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.corpus = argv[i];
+        }
+        if (strcmp(argv[i], "--json") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.outputJson = argv[i];
+        }
+        if (strcmp(argv[i], "--filter") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.filter = argv[i];
+        }
+        if (strcmp(argv[i], "--size") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.size = atoi(argv[i]);
+        }
+        if (strcmp(argv[i], "--min-time") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.minSeconds = atof(argv[i]);
+        }
+        if (strcmp(argv[i], "--compare") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.baselineJson = argv[i];
+        }
+        if (strcmp(argv[i], "--samples") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.sampleCount = atoi(argv[i]);
+        }
+        if (strcmp(argv[i], "--threshold") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.thresholdPercent = atof(argv[i]);
+        }
+        if (strcmp(argv[i], "--alpha") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.alpha = atof(argv[i]);
+        }
+        ++i;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    BenchmarkOptions options{};
+    GetOptions(argc, argv, options);
+
+    if (options.size < 1 || options.size > 16384) {
+        std::cerr << "Synthetic image size must be between 1 and 16384." << std::endl;
+        return -1;
+    }
+    if (options.minSeconds <= 0.0) {
+        std::cerr << "Minimum time must be positive." << std::endl;
+        return -1;
+    }
+    if (options.sampleCount < 1 || options.thresholdPercent < 0.0 || options.alpha <= 0.0 || options.alpha >= 1.0) {
+        std::cerr << "Invalid comparison settings, use --samples <count> --threshold <percent> --alpha <0..1>." << std::endl;
+        return -1;
+    }
+
+    std::vector<BenchmarkResult> baselineResults{};
+    std::vector<GoldenPalette> baselinePalettes{};
+    if (options.baselineJson && !LoadBaseline(options.baselineJson, baselineResults, baselinePalettes)) {
+        std::cerr << "Couldn't read the baseline \"" << options.baselineJson << "\"." << std::endl;
+        return -1;
+    }
+
+    if (!CheckThreadInvariance())
+        return 1;
+
+    std::vector<BenchmarkImage> images{};
+    BuildSyntheticImages(options.size, images);
+    LoadCorpusImages(options.corpus, images);
+
+    std::vector<BenchmarkResult> results{};
+    std::vector<GoldenPalette> palettes{};
+    for (const auto& image : images) {
+        RunImageBenchmarks(options, image, results);
+        RunExtractionBenchmarks(options, image, results, palettes);
+    }
+    RunOutputBenchmarks(options, results);
+
+    if (options.outputJson) {
+        if (!WriteBenchmarkJson(results, palettes, options, options.outputJson)) {
+            std::cerr << "Couldn't write \"" << options.outputJson << "\"." << std::endl;
+            return -1;
+        }
+        std::cout << "Writing benchmark results to \"" << options.outputJson << "\"." << std::endl;
+    }
+
+    int failures = CheckSteadyStateAllocations(results);
+    if (options.baselineJson) {
+        int regressions = CompareWithBaseline(options, results, palettes, baselineResults, baselinePalettes);
+        if (regressions)
+            std::cerr << regressions << " regression(s) against \"" << options.baselineJson << "\"." << std::endl;
+        failures += regressions;
+    }
+
+    return failures ? 1 : 0;
+}
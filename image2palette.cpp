@@ -0,0 +1,3317 @@
+#include "image2palette.hpp"
+#include "image2palette.h"
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <random>
+#include <cfloat>
+#include <climits>
+#include <fstream>
+#include <sstream>
+#include <cerrno>
+#include <atomic>
+#include <new>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PALETTE_FILE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#define TRACE_MAIN_THREAD 1
+
+#define HISTOGRAM_PARALLEL_MIN_PIXELS 262144
+
+#define KMEANS_SAMPLE_COUNT 65536
+#define KMEANS_BATCH_SIZE 4096
+#define KMEANS_BLOCK_SIZE 256
+#define KMEANS_MAX_ITERATIONS 200
+#define KMEANS_TOLERANCE 1e-8f
+#define KMEANS_DRAW_FACTOR 4
+
+struct TraceEvent {
+    const char* name{ nullptr }; //Static strings only
+    const char* category{ nullptr };
+    int image{};
+    long long startNs{};
+    long long durationNs{};
+};
+
+//Only its own thread appends to a buffer, the registry lock is taken once per thread
+struct TraceBuffer {
+    int threadId{};
+    std::vector<TraceEvent> events{};
+};
+
+static std::atomic<bool> tracing{ false };
+static std::atomic<int> traceGeneration{ 0 }; //Bumped by StartTracing, buffers of an earlier generation are gone
+static std::chrono::steady_clock::time_point traceOrigin{};
+static std::mutex traceMutex{};
+static std::deque<TraceBuffer> traceBuffers{}; //A deque keeps the buffers in place as threads register
+static std::vector<std::string> traceImageNames{};
+static thread_local TraceBuffer* traceBuffer = nullptr;
+static thread_local int traceBufferGeneration = -1;
+static thread_local int traceImage = -1;
+
+struct ColorLab {
+    float l{};
+    float a{};
+    float b{};
+};
+
+struct Base16HSLPalette {
+    ColorHSL primary[8]{};
+    ColorHSL accents[8]{};
+};
+
+//Histogram bin counts as constants, the histogram kernels are instantiated once per layout.
+//Keys are always scaled back to HUE/SATURATION/BRIGHTNESS_VALUE_COUNT
+template<int Hues, int Saturations, int Brightnesses>
+struct BinLayout {
+    static constexpr int hueCount = Hues;
+    static constexpr int saturationCount = Saturations;
+    static constexpr int brightnessCount = Brightnesses;
+    static constexpr int rowCount = Brightnesses + 1; //A brightness of exactly 1 gets its own row
+};
+
+using QualityBins = BinLayout<HUE_VALUE_COUNT, SATURATION_VALUE_COUNT, BRIGHTNESS_VALUE_COUNT>;
+using FastBins = BinLayout<72, 32, 32>;
+
+const char* GetEngineName(Engine engine) {
+    switch (engine) {
+        case Engine::Octree:
+            return "octree";
+        case Engine::KMeans:
+            return "kmeans";
+        default:
+            return "histogram";
+    }
+}
+
+bool ParseEngine(const char* name, Engine& engine) {
+    if (strcmp(name, "histogram") == 0) {
+        engine = Engine::Histogram;
+        return true;
+    }
+    if (strcmp(name, "octree") == 0) {
+        engine = Engine::Octree;
+        return true;
+    }
+    if (strcmp(name, "kmeans") == 0) {
+        engine = Engine::KMeans;
+        return true;
+    }
+    return false;
+}
+
+bool ParseBinResolution(const char* name, BinResolution& resolution) {
+    if (strcmp(name, "quality") == 0) {
+        resolution = BinResolution::Quality;
+        return true;
+    }
+    if (strcmp(name, "fast") == 0) {
+        resolution = BinResolution::Fast;
+        return true;
+    }
+    return false;
+}
+
+const char* GetPhaseName(Phase phase) {
+    switch (phase) {
+        case Phase::Decode:
+            return "decode";
+        case Phase::Accumulate:
+            return "accumulate";
+        case Phase::Keys:
+            return "keys";
+        case Phase::Selection:
+            return "selection";
+        default:
+            return "output";
+    }
+}
+
+bool OpenPerfCounters(PerfCounters& counters) {
+#ifdef __linux__
+    const unsigned int types[PERF_COUNTER_COUNT] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE };
+    const unsigned long long configs[PERF_COUNTER_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+        PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16
+    };
+
+    bool opened = false;
+    int error = 0;
+    for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.exclude_kernel = 1; //Allowed up to perf_event_paranoid 2
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters.fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters.fds[i] >= 0)
+            opened = true;
+        else
+            error = errno;
+    }
+    errno = error;
+    return opened;
+#else
+    errno = ENOSYS;
+    return false;
+#endif
+}
+
+void ClosePerfCounters(PerfCounters& counters) {
+#ifdef __linux__
+    for (int& fd : counters.fds) {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+#endif
+}
+
+const char* GetPerfCounterName(PerfCounter counter) {
+    switch (counter) {
+        case PerfCounter::Cycles:
+            return "cycles";
+        case PerfCounter::Instructions:
+            return "instructions";
+        case PerfCounter::BranchMisses:
+            return "branch-misses";
+        case PerfCounter::L1DMisses:
+            return "L1D-misses";
+        default:
+            return "LLC-misses";
+    }
+}
+
+void ReadPerfCounters(const PerfCounters& counters, double (&values)[PERF_COUNTER_COUNT]) {
+    for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        values[i] = 0.0;
+#ifdef __linux__
+        unsigned long long data[3]{}; //Value, time enabled, time running
+        if (counters.fds[i] < 0 || read(counters.fds[i], data, sizeof(data)) != sizeof(data) || !data[2])
+            continue;
+        values[i] = (double)data[0] * ((double)data[1] / (double)data[2]);
+#endif
+    }
+}
+
+void StartTracing() {
+    std::lock_guard<std::mutex> lock{ traceMutex };
+    traceBuffers.clear();
+    traceImageNames.clear();
+    traceBuffers.emplace_back();
+    traceBuffers.back().threadId = TRACE_MAIN_THREAD;
+    traceBuffer = &traceBuffers.back();
+    traceBufferGeneration = ++traceGeneration;
+    traceOrigin = std::chrono::steady_clock::now();
+    tracing = true;
+}
+
+bool IsTracing() {
+    return tracing.load(std::memory_order_relaxed);
+}
+
+void SetTraceImage(int image, const char* name) {
+    if (!IsTracing())
+        return;
+    if (name) {
+        std::lock_guard<std::mutex> lock{ traceMutex };
+        if (traceImageNames.size() <= image)
+            traceImageNames.resize(image + 1);
+        traceImageNames[image] = name;
+    }
+    traceImage = image;
+}
+
+void TraceSpan(const char* name, const char* category, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    if (!IsTracing())
+        return;
+    if (!traceBuffer || traceBufferGeneration != traceGeneration.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock{ traceMutex };
+        traceBuffers.emplace_back();
+        traceBuffers.back().threadId = traceBuffers.size();
+        traceBuffer = &traceBuffers.back();
+        traceBufferGeneration = traceGeneration;
+    }
+
+    TraceEvent event{};
+    event.name = name;
+    event.category = category;
+    event.image = traceImage;
+    event.startNs = std::chrono::duration_cast<std::chrono::nanoseconds>(start - traceOrigin).count();
+    event.durationNs = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    traceBuffer->events.push_back(event);
+}
+
+void WriteJsonString(FILE* file, const std::string& string) {
+    fputc('"', file);
+    for (unsigned char c : string) {
+        if (c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(file, "\\u%04x", c);
+        else
+            fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+bool WriteTrace(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    std::lock_guard<std::mutex> lock{ traceMutex };
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (const auto& buffer : traceBuffers) {
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}", first ? "" : ",\n",
+            buffer.threadId, buffer.threadId == TRACE_MAIN_THREAD ? "main" : "worker", buffer.threadId);
+        first = false;
+
+        for (const auto& event : buffer.events) {
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"image\":%d",
+                event.name, event.category, buffer.threadId, event.startNs / 1000.0, event.durationNs / 1000.0, event.image);
+            if (event.image >= 0 && event.image < traceImageNames.size() && !traceImageNames[event.image].empty()) {
+                fprintf(file, ",\"path\":");
+                WriteJsonString(file, traceImageNames[event.image]);
+            }
+            fprintf(file, "}}");
+        }
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
+
+void StartPhase(PhaseTimer& timer, const PhaseTimings* timings) {
+    if (!timings && !IsTracing())
+        return;
+    timer.wallStart = std::chrono::steady_clock::now();
+    if (!timings)
+        return;
+    timer.cpuStart = std::clock();
+    if (timings->counters)
+        ReadPerfCounters(*timings->counters, timer.counterStart);
+}
+
+void StopPhase(PhaseTimer& timer, PhaseTimings* timings, Phase phase) {
+    if (!timings && !IsTracing())
+        return;
+    auto wallEnd = std::chrono::steady_clock::now();
+    TraceSpan(GetPhaseName(phase), "phase", timer.wallStart, wallEnd);
+    if (!timings) {
+        timer.wallStart = wallEnd;
+        return;
+    }
+
+    std::clock_t cpuEnd = std::clock();
+    timings->wallSeconds[(int)phase] += std::chrono::duration<double>(wallEnd - timer.wallStart).count();
+    timings->cpuSeconds[(int)phase] += (double)(cpuEnd - timer.cpuStart) / CLOCKS_PER_SEC;
+    timer.wallStart = wallEnd;
+    timer.cpuStart = cpuEnd;
+
+    if (timings->counters) {
+        double counterEnd[PERF_COUNTER_COUNT];
+        ReadPerfCounters(*timings->counters, counterEnd);
+        for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            timings->counterValues[(int)phase][i] += counterEnd[i] - timer.counterStart[i];
+            timer.counterStart[i] = counterEnd[i];
+        }
+    }
+}
+
+bool ParseFrameMode(const char* name, FrameMode& mode) {
+    if (strcmp(name, "first") == 0) {
+        mode = FrameMode::First;
+        return true;
+    }
+    if (strcmp(name, "aggregate") == 0) {
+        mode = FrameMode::Aggregate;
+        return true;
+    }
+    if (strcmp(name, "each") == 0) {
+        mode = FrameMode::Each;
+        return true;
+    }
+    return false;
+}
+
+float GetMinChannelValue(float r, float g, float b) {
+    r = r < g ? r : g;
+    return r < b ? r : b;
+}
+
+float GetMaxChannelValue(float r, float g, float b) {
+    r = r > g ? r : g;
+    return r > b ? r : b;
+}
+
+float GetColorBrightness(float r, float g, float b) {
+    return std::clamp((r * 0.299f) + (g * 0.587f) + (b * 0.114f), 0.0f, 1.0f);
+}
+
+float GetColorSaturation(float r, float g, float b) {
+    float min = GetMinChannelValue(r, g, b) / 255.0;
+    float max = GetMaxChannelValue(r, g, b) / 255.0;
+
+    if (!max) //Color is black so saturation is 0
+        return 0;
+
+    float l = max - min;
+
+    if (l <= 0.5)
+        return l / (max + min);
+    return std::clamp(l / (2 - max - min), 0.0f, 1.0f);
+}
+
+float GetColorHUE(float r, float g, float b) {
+    r /= 255.0;
+    g /= 255.0;
+    b /= 255.0;
+    
+    float min = GetMinChannelValue(r, g, b);
+    float max = GetMaxChannelValue(r, g, b);
+
+    if (max == 0 || max == min)
+        return 0;
+    
+    float v = 0;
+
+    if (b == max)
+        v = 4.0 + (r - g) / (max - min);
+    if (g == max)
+        v = 2.0 + (b - r) / (max - min);
+    if (r == max)
+        v = (g - b) / (max - min);
+    
+    v *= 60;
+    v = v < 0 ? v + 360 : v;
+
+    return std::clamp(v, 0.0f, 360.0f);
+}
+
+float SrgbToLinear(float c) {
+    return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+float LinearToSrgb(float c) {
+    c = std::clamp(c, 0.0f, 1.0f);
+    return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+}
+
+float HueToRgb(float p, float q, float t) {
+    if (t < 0.0f) t += 1;
+    if (t > 1.0f) t -= 1;
+    if (t < 1.0f/6.0f) return p + (q - p) * 6.0f * t;
+    if (t < 1.0f/2.0f) return q;
+    if (t < 2.0f/3.0f) return p + (q - p) * (2.0f/3.0f - t) * 6.0f;
+    return p;
+}
+
+Color Hsl2Rgb(const ColorHSL& hslColor) {
+    float h = (float)hslColor.hue / (float)HUE_VALUE_COUNT;
+    float s = (float)hslColor.saturation / (float)SATURATION_VALUE_COUNT;
+    float l = (float)hslColor.brightness / (float)BRIGHTNESS_VALUE_COUNT;
+
+    Color color{};
+    if (s == 0) {
+        color.r = l * 255;
+        color.g = l * 255;
+        color.b = l * 255;
+    } else {
+        float q = l < 0.5f ? l * (1.0f + s) : l + s - l * s;
+        float p = 2.0f * l - q;
+        color.r = HueToRgb(p, q, h + 1.0f / 3.0f) * 255;
+        color.g = HueToRgb(p, q, h) * 255;
+        color.b = HueToRgb(p, q, h - 1.0f / 3.0f) * 255;
+    }
+    
+    return color;
+}
+
+Base16Palette PaletteHSLtoRGB(const Base16HSLPalette& palette) {
+    Base16Palette paletteRGB{};
+    
+    for (int i = 0; i < 8; ++i) {
+        paletteRGB.primary[i] = Hsl2Rgb(palette.primary[i]);
+        paletteRGB.accents[i] = Hsl2Rgb(palette.accents[i]);
+    }
+
+    return paletteRGB;
+}
+
+int CalculateDifferenceMatchingScore(int a, int b, int target) {
+    return abs(abs(a - b) - target);
+}
+
+float Lerp(float a, float b, float t) {
+    return a + (b - a) * t;
+}
+
+void GetMatchingDiffColor(const PaletteKeys& keys, std::vector<Scored<ColorHSL>>& scoredColors, 
+    ColorHSL refColor, int t0 /*HUE*/, int t1 /*Saturation*/, int t2 /*Brightness*/, float w0, float w1, float w2, float w3, bool signedBrightness) {
+    scoredColors.clear();
+    for (const auto& keyL : keys.keyLs) {
+        int brightnessMatchingScore{};
+        if (signedBrightness) {
+            brightnessMatchingScore = abs(keyL.brightness - refColor.brightness - t2);
+        }else {
+            brightnessMatchingScore = CalculateDifferenceMatchingScore(keyL.brightness, refColor.brightness, t2);
+        }
+
+        for (int i = keyL.keyHSBegin; i < keyL.keyHSEnd; ++i) {
+            const KeyHS& keyHS = keys.keyHSs[i];
+            int popularityScore = 100.0f - std::clamp(((float)keyHS.population / 10000.0f), 0.0f, 100.0f);
+            int hueMatchingScore = CalculateDifferenceMatchingScore(keyHS.hue, refColor.hue, t0);
+            int saturationMatchingScore = CalculateDifferenceMatchingScore(keyHS.saturation, refColor.saturation, t1);
+            
+            Scored<ColorHSL> scoredColor{};
+            scoredColor.score = brightnessMatchingScore * w2 + hueMatchingScore * w0 + saturationMatchingScore * w1 + popularityScore * w3;
+            scoredColor.data.hue = keyHS.hue;
+            scoredColor.data.saturation = keyHS.saturation;
+            scoredColor.data.brightness = keyL.brightness;
+            scoredColors.push_back(scoredColor);
+        }
+    }
+
+    std::sort(scoredColors.begin(), scoredColors.end(), [](const Scored<ColorHSL>& a, const Scored<ColorHSL>& b){
+        return a.score < b.score;
+    });
+}
+
+void GetMatchingColor(const PaletteKeys& keys, std::vector<Scored<ColorHSL>>& scoredColors, 
+    int t0 /*HUE*/, int t1 /*Saturation*/, int t2 /*Brightness*/, float w0, float w1, float w2, float w3) {
+    scoredColors.clear();
+    for (const auto& keyL : keys.keyLs) {
+        int brightnessMatchingScore = abs(keyL.brightness - t2);
+        for (int i = keyL.keyHSBegin; i < keyL.keyHSEnd; ++i) {
+            const KeyHS& keyHS = keys.keyHSs[i];
+            int popularityScore = 100.0f - std::clamp(((float)keyHS.population / 10000.0f), 0.0f, 100.0f);
+            int hueMatchingScore = abs(keyHS.hue - t0);
+            int saturationMatchingScore = abs(keyHS.saturation - t1);
+            
+            Scored<ColorHSL> scoredColor{};
+            scoredColor.score = brightnessMatchingScore * w2 + hueMatchingScore * w0 + saturationMatchingScore * w1 + popularityScore * w3;
+            scoredColor.data.hue = keyHS.hue;
+            scoredColor.data.saturation = keyHS.saturation;
+            scoredColor.data.brightness = keyL.brightness;
+            scoredColors.push_back(scoredColor);
+        }
+    }
+
+    std::sort(scoredColors.begin(), scoredColors.end(), [](const Scored<ColorHSL>& a, const Scored<ColorHSL>& b){
+        return a.score < b.score;
+    });
+}
+
+float ToneMapSample(float value, const HdrToneMap& toneMap) {
+    value *= toneMap.exposure;
+    if (toneMap.reinhard)
+        value = value / (1.0f + value);
+    return LinearToSrgb(value);
+}
+
+float DecodeAlpha(unsigned char value) {
+    return value * (1.0f / 255.0f);
+}
+
+float DecodeAlpha(unsigned short value) {
+    return value * (1.0f / 65535.0f);
+}
+
+float DecodeAlpha(float value) {
+    return std::clamp(value, 0.0f, 1.0f);
+}
+
+int GetSampleSize(SampleType type) {
+    switch (type) {
+        case SampleType::UInt16:
+            return sizeof(unsigned short);
+        case SampleType::Float32:
+            return sizeof(float);
+        default:
+            return sizeof(unsigned char);
+    }
+}
+
+int GetChannelCount(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::Grey:
+            return 1;
+        case PixelFormat::GreyAlpha:
+            return 2;
+        case PixelFormat::RGBA:
+        case PixelFormat::BGRA:
+            return 4;
+        default:
+            return 3;
+    }
+}
+
+PixelFormat GetPixelFormat(int channels) {
+    switch (channels) {
+        case 1:
+            return PixelFormat::Grey;
+        case 2:
+            return PixelFormat::GreyAlpha;
+        case 4:
+            return PixelFormat::RGBA;
+        default:
+            return PixelFormat::RGB;
+    }
+}
+
+ImageRect GetImageRegion(const ImageView& image) {
+    ImageRect region{};
+    region.x = std::clamp(image.roi.x, 0, image.width);
+    region.y = std::clamp(image.roi.y, 0, image.height);
+    int right = image.roi.width > 0 ? std::min(image.roi.x + image.roi.width, image.width) : image.width;
+    int bottom = image.roi.height > 0 ? std::min(image.roi.y + image.roi.height, image.height) : image.height;
+    region.width = std::max(right - region.x, 0);
+    region.height = std::max(bottom - region.y, 0);
+    return region;
+}
+
+size_t GetImageStride(const ImageView& image) {
+    if (image.stride)
+        return image.stride;
+    return (size_t)image.width * GetChannelCount(image.format) * GetSampleSize(image.type);
+}
+
+template<bool WithPosition, int Channels, bool Bgr, typename Sample, typename Decoder, typename Visitor>
+long long ForEachPixelChannels(const Sample* data, const ImageView& image, Decoder decode, Visitor& visit) {
+    ImageRect region = GetImageRegion(image);
+    size_t stride = GetImageStride(image);
+    long long count = 0;
+    for (int y = 0; y < region.height; ++y) {
+        const Sample* row = (const Sample*)((const unsigned char*)data + (size_t)(region.y + y) * stride) + (size_t)region.x * Channels;
+        for (int x = 0; x < region.width; ++x) {
+            const Sample* pixel = row + (size_t)x * Channels;
+            if constexpr (Channels == 2 || Channels == 4) {
+                if (DecodeAlpha(pixel[Channels - 1]) <= image.alphaThreshold)
+                    continue;
+            }
+            if constexpr (WithPosition) {
+                if constexpr (Channels <= 2) {
+                    auto value = decode(pixel[0]);
+                    visit(value, value, value, region.x + x, region.y + y);
+                } else if constexpr (Bgr) {
+                    visit(decode(pixel[2]), decode(pixel[1]), decode(pixel[0]), region.x + x, region.y + y);
+                } else {
+                    visit(decode(pixel[0]), decode(pixel[1]), decode(pixel[2]), region.x + x, region.y + y);
+                }
+            } else if constexpr (Channels <= 2) {
+                auto value = decode(pixel[0]);
+                visit(value, value, value);
+            } else if constexpr (Bgr) {
+                visit(decode(pixel[2]), decode(pixel[1]), decode(pixel[0]));
+            } else {
+                visit(decode(pixel[0]), decode(pixel[1]), decode(pixel[2]));
+            }
+            ++count;
+        }
+    }
+    return count;
+}
+
+template<bool WithPosition, typename Sample, typename Decoder, typename Visitor>
+long long ForEachPixelSample(const Sample* data, const ImageView& image, Decoder decode, Visitor& visit) {
+    switch (image.format) {
+        case PixelFormat::Grey:
+            return ForEachPixelChannels<WithPosition, 1, false>(data, image, decode, visit);
+        case PixelFormat::GreyAlpha:
+            return ForEachPixelChannels<WithPosition, 2, false>(data, image, decode, visit);
+        case PixelFormat::RGBA:
+            return ForEachPixelChannels<WithPosition, 4, false>(data, image, decode, visit);
+        case PixelFormat::BGR:
+            return ForEachPixelChannels<WithPosition, 3, true>(data, image, decode, visit);
+        case PixelFormat::BGRA:
+            return ForEachPixelChannels<WithPosition, 4, true>(data, image, decode, visit);
+        default:
+            return ForEachPixelChannels<WithPosition, 3, false>(data, image, decode, visit);
+    }
+}
+
+//Calls visit(r, g, b) with channels normalized to [0, 1] for every pixel above the alpha threshold
+//and returns how many were visited, the decode step is resolved once per image.
+//WithPosition adds the pixel's image coordinates, visit(r, g, b, x, y)
+template<bool WithPosition = false, typename Visitor>
+long long ForEachPixel(const ImageView& image, Visitor visit) {
+    switch (image.type) {
+        case SampleType::UInt16:
+            return ForEachPixelSample<WithPosition>((const unsigned short*)image.data, image, [](unsigned short value){ return value / 65535.0f; }, visit);
+        case SampleType::Float32: {
+            HdrToneMap toneMap = image.toneMap;
+            return ForEachPixelSample<WithPosition>((const float*)image.data, image, [toneMap](float value){ return ToneMapSample(value, toneMap); }, visit);
+        }
+        default:
+            return ForEachPixelSample<WithPosition>((const unsigned char*)image.data, image, [](unsigned char value){ return (float)(value / 255.0); }, visit);
+    }
+}
+
+//Same walk with channels quantized to 8 bits, 8-bit images are passed through untouched
+template<typename Visitor>
+long long ForEachPixelQuantized(const ImageView& image, Visitor visit) {
+    switch (image.type) {
+        case SampleType::UInt16:
+            return ForEachPixelSample<false>((const unsigned short*)image.data, image, [](unsigned short value){ return (unsigned char)(value >> 8); }, visit);
+        case SampleType::Float32: {
+            HdrToneMap toneMap = image.toneMap;
+            return ForEachPixelSample<false>((const float*)image.data, image, [toneMap](float value){ return (unsigned char)(ToneMapSample(value, toneMap) * 255.0f + 0.5f); }, visit);
+        }
+        default:
+            return ForEachPixelSample<false>((const unsigned char*)image.data, image, [](unsigned char value){ return value; }, visit);
+    }
+}
+
+//idx counts pixels inside the region of interest, returns false for pixels under the alpha threshold
+bool ReadPixel(const ImageView& image, int idx, float& r, float& g, float& b) {
+    ImageRect region = GetImageRegion(image);
+    int x = region.x + idx % region.width;
+    int y = region.y + idx / region.width;
+
+    ImageView pixel = image;
+    pixel.data = (const unsigned char*)image.data + (size_t)y * GetImageStride(image) + (size_t)x * GetChannelCount(image.format) * GetSampleSize(image.type);
+    pixel.width = 1;
+    pixel.height = 1;
+    pixel.roi = ImageRect{};
+    return ForEachPixel(pixel, [&](float pixelR, float pixelG, float pixelB){
+        r = pixelR;
+        g = pixelG;
+        b = pixelB;
+    });
+}
+
+int GetHueBinCount(BinResolution resolution) {
+    return resolution == BinResolution::Fast ? FastBins::hueCount : QualityBins::hueCount;
+}
+
+int GetBrightnessRowCount(BinResolution resolution) {
+    return resolution == BinResolution::Fast ? FastBins::rowCount : QualityBins::rowCount;
+}
+
+void ResetHistogram(ColorHistogram& histogram, BinResolution resolution) {
+    histogram.population = 0;
+    histogram.resolution = resolution;
+    histogram.bins.assign(GetBrightnessRowCount(resolution) * GetHueBinCount(resolution), HistogramBin{});
+    histogram.dirtyBegin = GetBrightnessRowCount(resolution);
+    histogram.dirtyEnd = 0;
+    histogram.unit = 1;
+}
+
+//Only zeroes the rows touched since the last clear
+void ClearHistogram(ColorHistogram& histogram, BinResolution resolution) {
+    if (histogram.bins.empty() || histogram.resolution != resolution) {
+        ResetHistogram(histogram, resolution);
+        return;
+    }
+
+    int hueCount = GetHueBinCount(resolution);
+    if (histogram.dirtyBegin < histogram.dirtyEnd)
+        std::fill(histogram.bins.begin() + histogram.dirtyBegin * hueCount, histogram.bins.begin() + histogram.dirtyEnd * hueCount, HistogramBin{});
+    histogram.population = 0;
+    histogram.dirtyBegin = GetBrightnessRowCount(resolution);
+    histogram.dirtyEnd = 0;
+    histogram.unit = 1;
+}
+
+template<typename Bins>
+void GetBinCoordinates(float r, float g, float b, int& hueIdx, int& saturationIdx, int& brightnessIdx) {
+    hueIdx = std::min((int)(GetColorHUE(r, g, b) * ((float)Bins::hueCount / HUE_VALUE_COUNT)), Bins::hueCount - 1);
+    saturationIdx = (int)(GetColorSaturation(r, g, b) * Bins::saturationCount);
+    brightnessIdx = (int)(GetColorBrightness(r, g, b) * Bins::brightnessCount);
+}
+
+template<typename Bins>
+void AccumulateHistogram(const ImageView& image, ColorHistogram& histogram) {
+    HistogramBin* bins = histogram.bins.data();
+    int minBrightnessIdx = Bins::brightnessCount;
+    int maxBrightnessIdx = 0;
+    long long population = ForEachPixel(image, [bins, &minBrightnessIdx, &maxBrightnessIdx](float r, float g, float b){
+        int hueIdx, saturationIdx, brightnessIdx;
+        GetBinCoordinates<Bins>(r, g, b, hueIdx, saturationIdx, brightnessIdx);
+        HistogramBin& bin = bins[brightnessIdx * Bins::hueCount + hueIdx];
+        bin.population += 1;
+        bin.saturation += saturationIdx;
+        minBrightnessIdx = std::min(minBrightnessIdx, brightnessIdx);
+        maxBrightnessIdx = std::max(maxBrightnessIdx, brightnessIdx);
+    });
+
+    if (!population)
+        return;
+    histogram.population += population;
+    histogram.dirtyBegin = std::min(histogram.dirtyBegin, minBrightnessIdx);
+    histogram.dirtyEnd = std::max(histogram.dirtyEnd, maxBrightnessIdx + 1);
+}
+
+void AccumulateHistogram(const ImageView& image, ColorHistogram& histogram) {
+    if (image.weights) {
+        AccumulateRegionHistograms(image, &image.roi, 1, &histogram);
+        return;
+    }
+
+    switch (histogram.resolution) {
+        case BinResolution::Fast:
+            AccumulateHistogram<FastBins>(image, histogram);
+            break;
+        default:
+            AccumulateHistogram<QualityBins>(image, histogram);
+            break;
+    }
+}
+
+template<typename Bins>
+void AccumulateRegionHistograms(const ImageView& image, const ImageRect* regions, int regionCount, ColorHistogram* histograms) {
+    ImageRect clipped[MAX_REGION_COUNT];
+    int minBrightnessIdx[MAX_REGION_COUNT];
+    int maxBrightnessIdx[MAX_REGION_COUNT];
+    int left = image.width;
+    int top = image.height;
+    int right = 0;
+    int bottom = 0;
+
+    for (int i = 0; i < regionCount; ++i) {
+        ImageView regionView = image;
+        regionView.roi = regions[i];
+        clipped[i] = GetImageRegion(regionView);
+        minBrightnessIdx[i] = Bins::brightnessCount;
+        maxBrightnessIdx[i] = 0;
+        histograms[i].unit = image.weights ? WEIGHT_UNIT : 1;
+        if (!clipped[i].width || !clipped[i].height)
+            continue;
+        left = std::min(left, clipped[i].x);
+        top = std::min(top, clipped[i].y);
+        right = std::max(right, clipped[i].x + clipped[i].width);
+        bottom = std::max(bottom, clipped[i].y + clipped[i].height);
+    }
+    if (left >= right || top >= bottom)
+        return;
+
+    ImageView bounds = image;
+    bounds.roi = ImageRect{ left, top, right - left, bottom - top };
+    size_t weightStride = image.weightStride ? image.weightStride : image.width;
+
+    ForEachPixel<true>(bounds, [&](float r, float g, float b, int x, int y){
+        int weight = image.weights ? image.weights[(size_t)y * weightStride + x] : 1;
+        if (!weight)
+            return;
+
+        int hueIdx, saturationIdx, brightnessIdx;
+        GetBinCoordinates<Bins>(r, g, b, hueIdx, saturationIdx, brightnessIdx);
+        int binIdx = brightnessIdx * Bins::hueCount + hueIdx;
+
+        for (int i = 0; i < regionCount; ++i) {
+            const ImageRect& region = clipped[i];
+            if (x < region.x || y < region.y || x >= region.x + region.width || y >= region.y + region.height)
+                continue;
+            HistogramBin& bin = histograms[i].bins[binIdx];
+            bin.population += weight;
+            bin.saturation += saturationIdx * weight;
+            histograms[i].population += weight;
+            minBrightnessIdx[i] = std::min(minBrightnessIdx[i], brightnessIdx);
+            maxBrightnessIdx[i] = std::max(maxBrightnessIdx[i], brightnessIdx);
+        }
+    });
+
+    for (int i = 0; i < regionCount; ++i) {
+        if (minBrightnessIdx[i] > maxBrightnessIdx[i])
+            continue;
+        histograms[i].dirtyBegin = std::min(histograms[i].dirtyBegin, minBrightnessIdx[i]);
+        histograms[i].dirtyEnd = std::max(histograms[i].dirtyEnd, maxBrightnessIdx[i] + 1);
+    }
+}
+
+//Walks the bounding box of the regions once, each pixel is binned once and added to every region holding it.
+//With weights, populations count in WEIGHT_UNIT per pixel of full weight. The histograms share the resolution of the first
+void AccumulateRegionHistograms(const ImageView& image, const ImageRect* regions, int regionCount, ColorHistogram* histograms) {
+    regionCount = std::min(regionCount, MAX_REGION_COUNT);
+    if (regionCount < 1)
+        return;
+
+    switch (histograms[0].resolution) {
+        case BinResolution::Fast:
+            AccumulateRegionHistograms<FastBins>(image, regions, regionCount, histograms);
+            break;
+        default:
+            AccumulateRegionHistograms<QualityBins>(image, regions, regionCount, histograms);
+            break;
+    }
+}
+
+int FindKeyLIndex(const std::vector<KeyL>& keyLs, float brightness) {
+    int lastDiff{ BRIGHTNESS_VALUE_COUNT };
+    for (int i = 0; i < keyLs.size(); ++i) {
+        int currentDiff = abs(brightness - keyLs[i].brightness);
+        if (currentDiff > lastDiff)
+            return i - 1;
+        lastDiff = currentDiff;
+    }
+    return keyLs.size() - 1;
+}
+
+//Bin indices are scaled to the key units here, the rest works in degrees and percents whatever the layout
+template<typename Bins>
+void ExtractKeysFromHistogram(const ColorHistogram& histogram, PaletteKeys& keys) {
+    constexpr float brightnessScale = (float)BRIGHTNESS_VALUE_COUNT / Bins::brightnessCount;
+    constexpr float hueScale = (float)HUE_VALUE_COUNT / Bins::hueCount;
+    constexpr float saturationScale = (float)SATURATION_VALUE_COUNT / Bins::saturationCount;
+
+    long long totalPopulation = histogram.population;
+    long long populationBrightness[Bins::rowCount]{};
+
+    for (int i = histogram.dirtyBegin; i < histogram.dirtyEnd; ++i) {
+        for (int j = 0; j < Bins::hueCount; ++j)
+            populationBrightness[i] += histogram.bins[i * Bins::hueCount + j].population;
+    }
+
+    std::vector<KeyL>& keyLs = keys.keyLs;
+    std::vector<KeyHS>& keyHSs = keys.keyHSs;
+    keyLs.clear();
+    keyHSs.clear();
+
+    for (int i = 0; i < Bins::brightnessCount; ++i) {
+        if (populationBrightness[i] > totalPopulation / 1000) {
+            KeyL keyL{};
+            keyL.population = populationBrightness[i] / histogram.unit;
+            keyL.brightness = i * brightnessScale;
+            keyLs.push_back(keyL);
+        }
+    }
+
+    for (int i = 0; i + 1 < keyLs.size();) {
+        KeyL keyA = keyLs[i];
+        KeyL keyB = keyLs[i + 1];
+
+        if (keyB.brightness - keyA.brightness < 3.0f) {
+            KeyL newKey{};
+            newKey.population = keyA.population + keyB.population;
+            newKey.brightness = (keyA.brightness * keyA.population + keyB.brightness * keyB.population) / newKey.population;
+            keyLs.erase(keyLs.begin() + i);
+            keyLs.erase(keyLs.begin() + i);
+            keyLs.insert(keyLs.begin() + i, newKey);
+        } else {
+            ++i;
+        }
+    }
+
+    //Every brightness row, key or not, is folded into its closest KeyL
+    int keyLIndices[Bins::rowCount]{};
+    for (int i = 0; i < Bins::rowCount; ++i)
+        keyLIndices[i] = FindKeyLIndex(keyLs, i * brightnessScale);
+
+    for (int i = 0; i < keyLs.size(); ++i) {
+        HistogramBin keyLBins[Bins::hueCount]{};
+
+        for (int j = histogram.dirtyBegin; j < histogram.dirtyEnd; ++j) {
+            if (keyLIndices[j] != i)
+                continue;
+            const HistogramBin* row = &histogram.bins[j * Bins::hueCount];
+            for (int k = 0; k < Bins::hueCount; ++k) {
+                keyLBins[k].population += row[k].population;
+                keyLBins[k].saturation += row[k].saturation;
+            }
+        }
+
+        //This key's KeyHS are built at the tail of the shared vector
+        int begin = keyHSs.size();
+
+        long long threshold = (long long)keyLs[i].population * histogram.unit / 500;
+        for (int j = 0; j < Bins::hueCount; ++j) {
+            if (keyLBins[j].population > threshold) {
+                KeyHS keyHS{};
+                keyHS.population = keyLBins[j].population / histogram.unit;
+                keyHS.hue = j * hueScale;
+                keyHS.saturation = (float)keyLBins[j].saturation / keyLBins[j].population * saturationScale;
+                keyHSs.push_back(keyHS);
+            }
+        }
+
+        //Positions are relative to begin, iterators don't survive the erases and inserts
+        for (int j = 0; j < keyHSs.size() - begin && keyHSs.size() - begin >= 2;) {
+            int count = keyHSs.size() - begin;
+            KeyHS keyA = keyHSs[begin + j];
+            KeyHS keyB = keyHSs[begin + (j + 1) % count];
+
+            float rawDiff = abs(keyA.hue - keyB.hue);
+            float currentDiff = abs(abs(fmod(rawDiff * 2 / 360, 2) - 1) - 1) * 180;
+
+            if (currentDiff < 20.0f) {
+                KeyHS newKey{};
+                newKey.population = keyA.population + keyB.population;
+                newKey.saturation = (keyA.saturation * keyA.population + keyB.saturation * keyB.population) / newKey.population;
+                if (rawDiff <= 180) {
+                    newKey.hue = (keyA.hue * keyA.population + keyB.hue * keyB.population) / newKey.population;
+                    keyHSs.erase(keyHSs.begin() + begin + j);
+                    keyHSs.erase(keyHSs.begin() + begin + j % (count - 1));
+                    keyHSs.insert(keyHSs.begin() + begin + std::min(j, count - 2), newKey);
+                } else {
+                    newKey.hue = fmod((keyA.hue + 360.0) * keyA.population + keyB.hue * keyB.population, 360) / newKey.population;
+                    keyHSs.erase(keyHSs.begin() + begin + j);
+                    keyHSs.erase(keyHSs.begin() + begin + j % (count - 1));
+                    //The key's KeyHSs are the tail of keyHSs, a hue past the others goes last
+                    int k = 0;
+                    while (k < count - 2 && keyHSs[begin + k].hue <= newKey.hue)
+                        ++k;
+                    keyHSs.insert(keyHSs.begin() + begin + k, newKey);
+                }
+            } else {
+                ++j;
+            }
+        }
+
+        std::sort(keyHSs.begin() + begin, keyHSs.end(), [](const KeyHS& a, const KeyHS& b){
+            return a.population > b.population;
+        });
+        keyLs[i].keyHSBegin = begin;
+        keyLs[i].keyHSEnd = keyHSs.size();
+    }
+
+    std::sort(keyLs.begin(), keyLs.end(), [](const KeyL& a, const KeyL& b){
+        return a.population > b.population;
+    });
+
+}
+
+void ExtractKeysFromHistogram(const ColorHistogram& histogram, PaletteKeys& keys) {
+    switch (histogram.resolution) {
+        case BinResolution::Fast:
+            ExtractKeysFromHistogram<FastBins>(histogram, keys);
+            break;
+        default:
+            ExtractKeysFromHistogram<QualityBins>(histogram, keys);
+            break;
+    }
+}
+
+void MergeHistogram(ColorHistogram& histogram, const ColorHistogram& other) {
+    //Empty histograms, like bands past the last row, were never accumulated and keep the default unit
+    if (other.population > 0)
+        histogram.unit = other.unit;
+    histogram.population += other.population;
+    int hueCount = GetHueBinCount(other.resolution);
+    for (int i = other.dirtyBegin * hueCount; i < other.dirtyEnd * hueCount; ++i) {
+        histogram.bins[i].population += other.bins[i].population;
+        histogram.bins[i].saturation += other.bins[i].saturation;
+    }
+    if (other.dirtyBegin < other.dirtyEnd) {
+        histogram.dirtyBegin = std::min(histogram.dirtyBegin, other.dirtyBegin);
+        histogram.dirtyEnd = std::max(histogram.dirtyEnd, other.dirtyEnd);
+    }
+}
+
+//The dirty range is left as is, rows emptied by the subtraction are still cleared later
+void SubtractHistogram(ColorHistogram& histogram, const ColorHistogram& other) {
+    histogram.population -= other.population;
+    int hueCount = GetHueBinCount(other.resolution);
+    for (int i = other.dirtyBegin * hueCount; i < other.dirtyEnd * hueCount; ++i) {
+        histogram.bins[i].population -= other.bins[i].population;
+        histogram.bins[i].saturation -= other.bins[i].saturation;
+    }
+}
+
+struct AccumulateBandsJob {
+    const ImageView* image{ nullptr };
+    ImageRect region{};
+    int rowsPerBand{};
+    ColorHistogram* histogram{ nullptr }; //Filled by worker 0
+    ColorHistogram* bandHistograms{ nullptr }; //One per other worker
+};
+
+void RunAccumulateBandsJob(void* context, int workerIdx) {
+    const AccumulateBandsJob& job = *(const AccumulateBandsJob*)context;
+    int begin = workerIdx * job.rowsPerBand;
+    if (begin >= job.region.height)
+        return;
+
+    ImageView band = *job.image;
+    band.roi = ImageRect{ job.region.x, job.region.y + begin, job.region.width, std::min(job.rowsPerBand, job.region.height - begin) };
+    AccumulateHistogram(band, workerIdx == 0 ? *job.histogram : job.bandHistograms[workerIdx - 1]);
+}
+
+//Each worker bins a band of rows into its own histogram, the bands are merged after.
+//Counts are integers so the result is identical for any thread count
+void ParallelAccumulateHistogram(const ImageView& image, WorkerPool& pool, std::vector<ColorHistogram>& bandHistograms, ColorHistogram& histogram) {
+    int threadCount = GetWorkerCount(pool);
+    ImageRect region = GetImageRegion(image);
+    if (threadCount < 2 || (long long)region.width * region.height < HISTOGRAM_PARALLEL_MIN_PIXELS) {
+        AccumulateHistogram(image, histogram);
+        return;
+    }
+
+    if (bandHistograms.size() < threadCount - 1)
+        bandHistograms.resize(threadCount - 1);
+    for (int i = 0; i < threadCount - 1; ++i)
+        ClearHistogram(bandHistograms[i], histogram.resolution);
+
+    AccumulateBandsJob job{ &image, region, (region.height + threadCount - 1) / threadCount, &histogram, bandHistograms.data() };
+    RunWorkerPool(pool, RunAccumulateBandsJob, &job);
+    for (int i = 0; i < threadCount - 1; ++i)
+        MergeHistogram(histogram, bandHistograms[i]);
+}
+
+ExtractionStats ExtractKeysHistogram(const ImageView& image, BinResolution resolution, WorkerPool& pool, std::vector<ColorHistogram>& bandHistograms,
+    ColorHistogram& histogram, PaletteKeys& keys, PhaseTimings* timings) {
+    PhaseTimer timer{};
+    StartPhase(timer, timings);
+    ClearHistogram(histogram, resolution);
+    ParallelAccumulateHistogram(image, pool, bandHistograms, histogram);
+    StopPhase(timer, timings, Phase::Accumulate);
+    ExtractKeysFromHistogram(histogram, keys);
+    StopPhase(timer, timings, Phase::Keys);
+
+    ExtractionStats stats{};
+    stats.population = histogram.population / histogram.unit;
+    stats.scratchBytes = histogram.bins.size() * sizeof(HistogramBin);
+    for (const auto& bandHistogram : bandHistograms)
+        stats.scratchBytes += bandHistogram.bins.size() * sizeof(HistogramBin);
+    return stats;
+}
+
+void AppendColorKey(std::vector<ColorKey>& colorKeys, float r, float g, float b, int population) {
+    ColorKey colorKey{};
+    colorKey.keyHS.population = population;
+    colorKey.keyHS.hue = (int)GetColorHUE(r, g, b);
+    colorKey.keyHS.saturation = (int)(GetColorSaturation(r, g, b) * SATURATION_VALUE_COUNT);
+    colorKey.brightness = (int)(GetColorBrightness(r, g, b) * BRIGHTNESS_VALUE_COUNT);
+    colorKeys.push_back(colorKey);
+}
+
+//Groups the color keys by brightness, KeyL in order of first appearance, then sorts by population
+void BuildColorKeys(std::vector<ColorKey>& colorKeys, PaletteKeys& keys) {
+    std::vector<KeyL>& keyLs = keys.keyLs;
+    keyLs.clear();
+
+    for (auto& colorKey : colorKeys) {
+        colorKey.keyLIdx = -1;
+        for (int i = 0; i < keyLs.size(); ++i) {
+            if (keyLs[i].brightness == colorKey.brightness) {
+                colorKey.keyLIdx = i;
+                break;
+            }
+        }
+
+        if (colorKey.keyLIdx < 0) {
+            colorKey.keyLIdx = keyLs.size();
+            KeyL keyL{};
+            keyL.brightness = colorKey.brightness;
+            keyLs.push_back(keyL);
+        }
+
+        //keyHSEnd counts the KeyHS until the ranges are laid out
+        keyLs[colorKey.keyLIdx].population += colorKey.keyHS.population;
+        keyLs[colorKey.keyLIdx].keyHSEnd += 1;
+    }
+
+    int offset = 0;
+    for (auto& keyL : keyLs) {
+        keyL.keyHSBegin = offset;
+        offset += keyL.keyHSEnd;
+        keyL.keyHSEnd = keyL.keyHSBegin;
+    }
+
+    keys.keyHSs.resize(colorKeys.size());
+    for (const auto& colorKey : colorKeys)
+        keys.keyHSs[keyLs[colorKey.keyLIdx].keyHSEnd++] = colorKey.keyHS;
+
+    for (const auto& keyL : keyLs) {
+        std::sort(keys.keyHSs.begin() + keyL.keyHSBegin, keys.keyHSs.begin() + keyL.keyHSEnd, [](const KeyHS& a, const KeyHS& b){
+            return a.population > b.population;
+        });
+    }
+
+    std::sort(keyLs.begin(), keyLs.end(), [](const KeyL& a, const KeyL& b){
+        return a.population > b.population;
+    });
+}
+
+void ResetOctree(Octree& octree) {
+    if (octree.nodes.empty()) {
+        octree.nodes.resize(OCTREE_NODE_BUDGET);
+        octree.freeNodes.reserve(OCTREE_NODE_BUDGET);
+    } else {
+        std::fill(octree.nodes.begin(), octree.nodes.begin() + octree.usedNodes, OctreeNode{});
+    }
+
+    octree.freeNodes.clear();
+    for (int i = OCTREE_NODE_BUDGET - 1; i > 0; --i)
+        octree.freeNodes.push_back(i);
+    memset(octree.reducibleNodes, 0, sizeof(octree.reducibleNodes));
+    octree.leafCount = 0;
+    octree.usedNodes = 1;
+}
+
+void ReduceOctree(Octree& octree) {
+    int level = OCTREE_DEPTH - 1;
+    while (level > 0 && !octree.reducibleNodes[level])
+        --level;
+
+    //Children of the deepest reducible node are always leaves
+    int nodeIdx = octree.reducibleNodes[level];
+    OctreeNode& node = octree.nodes[nodeIdx];
+    octree.reducibleNodes[level] = node.nextReducible;
+
+    int childCount = 0;
+    for (int i = 0; i < 8; ++i) {
+        int childIdx = node.children[i];
+        if (!childIdx)
+            continue;
+        OctreeNode& child = octree.nodes[childIdx];
+        node.r += child.r;
+        node.g += child.g;
+        node.b += child.b;
+        node.population += child.population;
+        child = OctreeNode{};
+        octree.freeNodes.push_back(childIdx);
+        node.children[i] = 0;
+        ++childCount;
+    }
+
+    node.leaf = true;
+    octree.leafCount -= childCount - 1;
+}
+
+void InsertOctreeColor(Octree& octree, unsigned char r, unsigned char g, unsigned char b) {
+    int nodeIdx = 0;
+    for (int level = 0; level < OCTREE_DEPTH && !octree.nodes[nodeIdx].leaf; ++level) {
+        int shift = 7 - level;
+        int childPos = ((r >> shift) & 1) << 2 | ((g >> shift) & 1) << 1 | ((b >> shift) & 1);
+        int childIdx = octree.nodes[nodeIdx].children[childPos];
+
+        if (!childIdx) {
+            childIdx = octree.freeNodes.back();
+            octree.freeNodes.pop_back();
+            octree.usedNodes = std::max(octree.usedNodes, childIdx + 1);
+            octree.nodes[nodeIdx].children[childPos] = childIdx;
+
+            OctreeNode& child = octree.nodes[childIdx];
+            if (level + 1 == OCTREE_DEPTH) {
+                child.leaf = true;
+                ++octree.leafCount;
+            } else {
+                child.nextReducible = octree.reducibleNodes[level + 1];
+                octree.reducibleNodes[level + 1] = childIdx;
+            }
+        }
+
+        nodeIdx = childIdx;
+    }
+
+    OctreeNode& node = octree.nodes[nodeIdx];
+    node.r += r;
+    node.g += g;
+    node.b += b;
+    node.population += 1;
+}
+
+ExtractionStats ExtractKeysOctree(const ImageView& image, int colorCount, Octree& octree, std::vector<ColorKey>& colorKeys, PaletteKeys& keys) {
+    ResetOctree(octree);
+
+    ExtractionStats stats{};
+    stats.population = ForEachPixelQuantized(image, [&](unsigned char r, unsigned char g, unsigned char b){
+        //A single insertion allocates at most one node per level
+        while (octree.leafCount > colorCount || octree.freeNodes.size() < OCTREE_DEPTH)
+            ReduceOctree(octree);
+        InsertOctreeColor(octree, r, g, b);
+    });
+
+    while (octree.leafCount > colorCount)
+        ReduceOctree(octree);
+
+    colorKeys.clear();
+    for (int i = 0; i < octree.usedNodes; ++i) {
+        const OctreeNode& node = octree.nodes[i];
+        if (!node.leaf || !node.population)
+            continue;
+        float r = (float)node.r / node.population / 255.0;
+        float g = (float)node.g / node.population / 255.0;
+        float b = (float)node.b / node.population / 255.0;
+        AppendColorKey(colorKeys, r, g, b, node.population);
+    }
+
+    BuildColorKeys(colorKeys, keys);
+
+    stats.scratchBytes = octree.nodes.size() * sizeof(OctreeNode) + octree.freeNodes.capacity() * sizeof(int);
+    return stats;
+}
+
+ColorLab Rgb2Oklab(float r, float g, float b) {
+    r = SrgbToLinear(r);
+    g = SrgbToLinear(g);
+    b = SrgbToLinear(b);
+
+    float l = cbrtf(0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b);
+    float m = cbrtf(0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b);
+    float s = cbrtf(0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b);
+
+    ColorLab color{};
+    color.l = 0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s;
+    color.a = 1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s;
+    color.b = 0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s;
+    return color;
+}
+
+void Oklab2Rgb(const ColorLab& color, float& r, float& g, float& b) {
+    float l = color.l + 0.3963377774f * color.a + 0.2158037573f * color.b;
+    float m = color.l - 0.1055613458f * color.a - 0.0638541728f * color.b;
+    float s = color.l - 0.0894841775f * color.a - 1.2914855480f * color.b;
+    l = l * l * l;
+    m = m * m * m;
+    s = s * s * s;
+
+    r = LinearToSrgb(4.0767416621f * l - 3.3077115913f * m + 0.2309699292f * s);
+    g = LinearToSrgb(-1.2684380046f * l + 2.6097574011f * m - 0.3413193965f * s);
+    b = LinearToSrgb(-0.0041960863f * l - 0.7034186147f * m + 1.7076147010f * s);
+}
+
+void RunTracedTask(void (*task)(void* context, int workerIdx), void* context, int workerIdx) {
+    if (!IsTracing()) {
+        task(context, workerIdx);
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    task(context, workerIdx);
+    TraceSpan("task", "pool", start, std::chrono::steady_clock::now());
+}
+
+void RunPoolWorker(WorkerPool* pool, int workerIdx) {
+    int generation = 0;
+    std::unique_lock<std::mutex> lock{ pool->mutex };
+    while (true) {
+        pool->condition.wait(lock, [&]{ return pool->generation != generation || pool->stopping; });
+        if (pool->stopping)
+            return;
+        generation = pool->generation;
+        traceImage = pool->traceImage;
+
+        lock.unlock();
+        RunTracedTask(pool->task, pool->context, workerIdx);
+        lock.lock();
+
+        if (--pool->pending == 0)
+            pool->condition.notify_all();
+    }
+}
+
+//Workers already running are joined when one fails to start, a joinable thread would terminate on destruction
+void StartWorkerPool(WorkerPool& pool, int threadCount) {
+    try {
+        for (int i = 1; i < threadCount; ++i)
+            pool.threads.emplace_back(RunPoolWorker, &pool, i);
+    } catch (...) {
+        StopWorkerPool(pool);
+        throw;
+    }
+}
+
+void StopWorkerPool(WorkerPool& pool) {
+    {
+        std::lock_guard<std::mutex> lock{ pool.mutex };
+        pool.stopping = true;
+    }
+    pool.condition.notify_all();
+    for (auto& thread : pool.threads)
+        thread.join();
+    pool.threads.clear();
+}
+
+int GetWorkerCount(const WorkerPool& pool) {
+    return pool.threads.size() + 1;
+}
+
+//Calls task(context, workerIdx) once per worker and returns when all of them are done
+void RunWorkerPool(WorkerPool& pool, void (*task)(void* context, int workerIdx), void* context) {
+    if (pool.threads.empty()) {
+        RunTracedTask(task, context, 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{ pool.mutex };
+        pool.task = task;
+        pool.context = context;
+        pool.traceImage = traceImage;
+        pool.pending = pool.threads.size();
+        ++pool.generation;
+    }
+    pool.condition.notify_all();
+
+    RunTracedTask(task, context, 0);
+
+    std::unique_lock<std::mutex> lock{ pool.mutex };
+    pool.condition.wait(lock, [&]{ return pool.pending == 0; });
+}
+
+float GetLabDistance(const KMeansPoints& points, int i, const KMeansPoints& centers, int c) {
+    float dl = points.l[i] - centers.l[c];
+    float da = points.a[i] - centers.a[c];
+    float db = points.b[i] - centers.b[c];
+    return dl * dl + da * da + db * db;
+}
+
+void AssignClusters(const KMeansPoints& points, int begin, int end, const KMeansPoints& centers, int* labels) {
+    float bestDistances[KMEANS_BLOCK_SIZE];
+    int centerCount = centers.l.size();
+
+    //Loop over centers outside so the inner loop runs branchless over contiguous points
+    for (int blockBegin = begin; blockBegin < end; blockBegin += KMEANS_BLOCK_SIZE) {
+        int blockSize = std::min(KMEANS_BLOCK_SIZE, end - blockBegin);
+        const float* l = points.l.data() + blockBegin;
+        const float* a = points.a.data() + blockBegin;
+        const float* b = points.b.data() + blockBegin;
+        int* blockLabels = labels + blockBegin;
+
+        for (int i = 0; i < blockSize; ++i) {
+            bestDistances[i] = FLT_MAX;
+            blockLabels[i] = 0;
+        }
+
+        for (int c = 0; c < centerCount; ++c) {
+            float cl = centers.l[c];
+            float ca = centers.a[c];
+            float cb = centers.b[c];
+            for (int i = 0; i < blockSize; ++i) {
+                float dl = l[i] - cl;
+                float da = a[i] - ca;
+                float db = b[i] - cb;
+                float distance = dl * dl + da * da + db * db;
+                bool closer = distance < bestDistances[i];
+                bestDistances[i] = closer ? distance : bestDistances[i];
+                blockLabels[i] = closer ? c : blockLabels[i];
+            }
+        }
+    }
+}
+
+struct AssignClustersJob {
+    const KMeansPoints* points{ nullptr };
+    int count{};
+    const KMeansPoints* centers{ nullptr };
+    int* labels{ nullptr };
+    int chunkSize{};
+};
+
+void RunAssignClustersJob(void* context, int workerIdx) {
+    const AssignClustersJob& job = *(const AssignClustersJob*)context;
+    int begin = workerIdx * job.chunkSize;
+    if (begin < job.count)
+        AssignClusters(*job.points, begin, std::min(begin + job.chunkSize, job.count), *job.centers, job.labels);
+}
+
+void ParallelAssignClusters(WorkerPool& pool, const KMeansPoints& points, int count, const KMeansPoints& centers, int* labels) {
+    //Chunks are block aligned, labels don't depend on the split so results are identical for any thread count
+    int threadCount = GetWorkerCount(pool);
+    int blockCount = (count + KMEANS_BLOCK_SIZE - 1) / KMEANS_BLOCK_SIZE;
+    int blocksPerThread = (blockCount + threadCount - 1) / threadCount;
+
+    AssignClustersJob job{ &points, count, &centers, labels, blocksPerThread * KMEANS_BLOCK_SIZE };
+    RunWorkerPool(pool, RunAssignClustersJob, &job);
+}
+
+void SeedClusters(const KMeansPoints& samples, int clusterCount, std::mt19937& rng, std::vector<float>& distances, KMeansPoints& centers) {
+    int sampleCount = samples.l.size();
+    distances.assign(sampleCount, FLT_MAX);
+
+    int idx = rng() % sampleCount;
+    for (int c = 0; c < clusterCount; ++c) {
+        centers.l.push_back(samples.l[idx]);
+        centers.a.push_back(samples.a[idx]);
+        centers.b.push_back(samples.b[idx]);
+
+        double sum = 0.0;
+        for (int i = 0; i < sampleCount; ++i) {
+            distances[i] = std::min(distances[i], GetLabDistance(samples, i, centers, c));
+            sum += distances[i];
+        }
+
+        //Every sample already sits on a center
+        if (sum <= 0.0)
+            break;
+
+        double target = (double)rng() / (double)std::mt19937::max() * sum;
+        for (idx = 0; idx < sampleCount - 1; ++idx) {
+            target -= distances[idx];
+            if (target <= 0.0)
+                break;
+        }
+    }
+}
+
+void ResizePoints(KMeansPoints& points, int count) {
+    points.l.resize(count);
+    points.a.resize(count);
+    points.b.resize(count);
+}
+
+ExtractionStats ExtractKeysKMeans(const ImageView& image, const ExtractionSettings& settings, KMeansScratch& scratch, WorkerPool& pool,
+    std::vector<ColorKey>& colorKeys, PaletteKeys& keys) {
+    std::mt19937 rng{ settings.seed };
+    ImageRect region = GetImageRegion(image);
+    int pixelCount = region.width * region.height;
+    int sampleLimit = std::min(pixelCount, KMEANS_SAMPLE_COUNT);
+    int drawLimit = sampleLimit == pixelCount ? pixelCount : sampleLimit * KMEANS_DRAW_FACTOR;
+
+    KMeansPoints& samples = scratch.samples;
+    ResizePoints(samples, sampleLimit);
+    int sampleCount = 0;
+    int draws = 0;
+    for (; draws < drawLimit && sampleCount < sampleLimit; ++draws) {
+        int idx = sampleLimit == pixelCount ? draws : rng() % pixelCount;
+        float r, g, b;
+        if (!ReadPixel(image, idx, r, g, b))
+            continue;
+        ColorLab color = Rgb2Oklab(r, g, b);
+        samples.l[sampleCount] = color.l;
+        samples.a[sampleCount] = color.a;
+        samples.b[sampleCount] = color.b;
+        ++sampleCount;
+    }
+    ResizePoints(samples, sampleCount);
+
+    ExtractionStats stats{};
+    colorKeys.clear();
+    if (!sampleCount) {
+        BuildColorKeys(colorKeys, keys);
+        return stats;
+    }
+
+    //Opaque pixel count estimated from the acceptance rate of the draws
+    stats.population = (long long)pixelCount * sampleCount / draws;
+
+    KMeansPoints& centers = scratch.centers;
+    ResizePoints(centers, 0);
+    SeedClusters(samples, settings.colorCount, rng, scratch.distances, centers);
+    int clusterCount = centers.l.size();
+
+    int batchSize = std::min(sampleCount, KMEANS_BATCH_SIZE);
+    KMeansPoints& batch = scratch.batch;
+    ResizePoints(batch, batchSize);
+    std::vector<int>& labels = scratch.labels;
+    std::vector<int>& populations = scratch.populations;
+    labels.resize(sampleCount);
+    populations.assign(clusterCount, 0);
+
+    for (int iteration = 0; iteration < KMEANS_MAX_ITERATIONS; ++iteration) {
+        for (int i = 0; i < batchSize; ++i) {
+            int idx = rng() % sampleCount;
+            batch.l[i] = samples.l[idx];
+            batch.a[i] = samples.a[idx];
+            batch.b[i] = samples.b[idx];
+        }
+
+        ParallelAssignClusters(pool, batch, batchSize, centers, labels.data());
+
+        //Per-center learning rate decays with the number of points the center has absorbed
+        KMeansPoints& previousCenters = scratch.previousCenters;
+        previousCenters.l.assign(centers.l.begin(), centers.l.end());
+        previousCenters.a.assign(centers.a.begin(), centers.a.end());
+        previousCenters.b.assign(centers.b.begin(), centers.b.end());
+        for (int i = 0; i < batchSize; ++i) {
+            int c = labels[i];
+            populations[c] += 1;
+            float eta = 1.0f / populations[c];
+            centers.l[c] += (batch.l[i] - centers.l[c]) * eta;
+            centers.a[c] += (batch.a[i] - centers.a[c]) * eta;
+            centers.b[c] += (batch.b[i] - centers.b[c]) * eta;
+        }
+
+        float maxShift = 0.0f;
+        for (int c = 0; c < clusterCount; ++c)
+            maxShift = std::max(maxShift, GetLabDistance(centers, c, previousCenters, c));
+        if (maxShift < KMEANS_TOLERANCE)
+            break;
+    }
+
+    ParallelAssignClusters(pool, samples, sampleCount, centers, labels.data());
+    std::fill(populations.begin(), populations.end(), 0);
+    for (int i = 0; i < sampleCount; ++i)
+        populations[labels[i]] += 1;
+
+    //Populations are rescaled to the full image so popularity scores match the other engines
+    for (int c = 0; c < clusterCount; ++c) {
+        if (!populations[c])
+            continue;
+        ColorLab color{ centers.l[c], centers.a[c], centers.b[c] };
+        float r, g, b;
+        Oklab2Rgb(color, r, g, b);
+        AppendColorKey(colorKeys, r, g, b, (int)(populations[c] * stats.population / sampleCount));
+    }
+
+    BuildColorKeys(colorKeys, keys);
+
+    stats.scratchBytes = (samples.l.capacity() * 3 + batch.l.capacity() * 3 + centers.l.capacity() * 6 + scratch.distances.capacity()) * sizeof(float)
+        + (labels.capacity() + populations.capacity()) * sizeof(int);
+    return stats;
+}
+
+//"dark-truncated" keeps the palettes of older versions, which truncated the weights of "dark" to int
+const SelectionProfile SELECTION_PROFILES[] = {
+    { "dark",
+        { 0, 0, 10, 0.0f, 0.0f, 1.0f, 1.0f },
+        { 10, 0, 8, 0.5f, 0.25f, 1.0f, 0.5f },
+        { 50, 0, 40, 0.25f, 0.0f, 2.0f, 0.25f },
+        { 0, 50, 70, 0.0f, 1.0f, 1.0f, 0.1f } },
+    { "light",
+        { 0, 0, 90, 0.0f, 0.0f, 1.0f, 1.0f },
+        { 10, 0, -8, 0.5f, 0.25f, 1.0f, 0.5f },
+        { 50, 0, -40, 0.25f, 0.0f, 2.0f, 0.25f },
+        { 0, 50, 40, 0.0f, 1.0f, 1.0f, 0.1f } },
+    { "high-contrast",
+        { 0, 0, 0, 0.0f, 0.0f, 1.0f, 1.0f },
+        { 10, 0, 12, 0.5f, 0.25f, 1.0f, 0.5f },
+        { 50, 0, 60, 0.25f, 0.0f, 2.0f, 0.25f },
+        { 0, 80, 75, 0.0f, 1.0f, 1.0f, 0.1f } },
+    { "dark-truncated",
+        { 0, 0, 10, 0.0f, 0.0f, 1.0f, 1.0f },
+        { 10, 0, 8, 0.0f, 0.0f, 1.0f, 0.0f },
+        { 50, 0, 40, 0.0f, 0.0f, 2.0f, 0.0f },
+        { 0, 50, 70, 0.0f, 1.0f, 1.0f, 0.0f } }
+};
+
+void GetSelectionProfiles(std::vector<SelectionProfile>& profiles) {
+    profiles.assign(std::begin(SELECTION_PROFILES), std::end(SELECTION_PROFILES));
+}
+
+bool FindSelectionProfile(const std::vector<SelectionProfile>& profiles, const char* name, SelectionProfile& profile) {
+    for (const auto& candidate : profiles) {
+        if (candidate.name == name) {
+            profile = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+MatchTarget* GetMatchTarget(SelectionProfile& profile, const std::string& role) {
+    if (role == "background")
+        return &profile.background;
+    if (role == "step")
+        return &profile.step;
+    if (role == "last-step")
+        return &profile.lastStep;
+    if (role == "accents")
+        return &profile.accents;
+    return nullptr;
+}
+
+//One target per line, '#' starts a comment:
+//  <profile> <background|step|last-step|accents> <hue> <saturation> <brightness> <hue weight> <saturation weight> <brightness weight> <popularity weight>
+//A profile that isn't known yet starts as a copy of "dark", known ones are overridden target by target
+bool LoadSelectionProfiles(const char* path, std::vector<SelectionProfile>& profiles) {
+    std::ifstream file{ path };
+    if (!file)
+        return false;
+
+    std::string line{};
+    while (std::getline(file, line)) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields{ line };
+        std::string name{};
+        std::string role{};
+        if (!(fields >> name))
+            continue;
+
+        MatchTarget target{};
+        if (!(fields >> role >> target.hue >> target.saturation >> target.brightness
+            >> target.hueWeight >> target.saturationWeight >> target.brightnessWeight >> target.popularityWeight))
+            return false;
+        std::string trailing{};
+        if (fields >> trailing)
+            return false;
+
+        auto profile = std::find_if(profiles.begin(), profiles.end(), [&](const SelectionProfile& candidate) { return candidate.name == name; });
+        if (profile == profiles.end()) {
+            profiles.push_back(SELECTION_PROFILES[0]);
+            profiles.back().name = name;
+            profile = profiles.end() - 1;
+        }
+
+        MatchTarget* matchTarget = GetMatchTarget(*profile, role);
+        if (!matchTarget)
+            return false;
+        *matchTarget = target;
+    }
+    return true;
+}
+
+//base00 is scored first but swapped with base01, the steps are relative to the previous pick
+void CompileSelectionPlan(const SelectionProfile& profile, SelectionPlan& plan) {
+    plan = SelectionPlan{};
+    plan.name = profile.name;
+    plan.steps[0] = ScoringStep{ profile.background, -1, 1, 1 };
+    plan.steps[1] = ScoringStep{ profile.step, 0, 0, 1 };
+    for (int i = 2; i < 5; ++i)
+        plan.steps[i] = ScoringStep{ profile.step, i - 1, i, 1 };
+    plan.steps[5] = ScoringStep{ profile.lastStep, 4, 5, 1 };
+    plan.steps[6] = ScoringStep{ profile.accents, -1, 6, 10 };
+    plan.stepCount = 7;
+}
+
+const SelectionPlan& GetDefaultSelectionPlan() {
+    static const SelectionPlan plan = []() {
+        SelectionPlan defaultPlan{};
+        CompileSelectionPlan(SELECTION_PROFILES[0], defaultPlan);
+        return defaultPlan;
+    }();
+    return plan;
+}
+
+void SelectBase16Palette(const PaletteKeys& keys, const SelectionPlan& plan, std::vector<Scored<ColorHSL>>& scoredColors, Base16Palette& palette,
+    float* scores) {
+    if (scores)
+        std::fill(scores, scores + 16, 0.0f);
+    //Nothing to pick from, e.g. a fully transparent image
+    if (keys.keyLs.empty())
+        return;
+
+    Base16HSLPalette hslPalette{};
+    ColorHSL picks[SELECTION_PLAN_MAX_STEPS]{};
+
+    for (int i = 0; i < plan.stepCount; ++i) {
+        const ScoringStep& step = plan.steps[i];
+        const MatchTarget& target = step.target;
+        if (step.reference < 0) {
+            GetMatchingColor(keys, scoredColors, target.hue, target.saturation, target.brightness,
+                target.hueWeight, target.saturationWeight, target.brightnessWeight, target.popularityWeight);
+        } else {
+            GetMatchingDiffColor(keys, scoredColors, picks[step.reference], target.hue, target.saturation, target.brightness,
+                target.hueWeight, target.saturationWeight, target.brightnessWeight, target.popularityWeight, true);
+        }
+        //Nothing scored, the slots and the pick keep their defaults
+        if (scoredColors.empty())
+            continue;
+        picks[i] = scoredColors[0].data;
+
+        for (int j = 0; j < step.count && j < scoredColors.size(); ++j) {
+            int slot = step.slot + j;
+            if (scores && slot < 16)
+                scores[slot] = scoredColors[j].score;
+
+            if (slot < 8) {
+                hslPalette.primary[slot] = scoredColors[j].data;
+            } else {
+                hslPalette.accents[slot - 8] = scoredColors[j].data;
+            }
+        }
+    }
+
+    palette = PaletteHSLtoRGB(hslPalette);
+}
+
+//"00" to "ff", so a color is three 2 byte copies
+struct HexPairs {
+    char digits[256][2]{};
+
+    constexpr HexPairs() {
+        for (int i = 0; i < 256; ++i) {
+            digits[i][0] = "0123456789abcdef"[i >> 4];
+            digits[i][1] = "0123456789abcdef"[i & 15];
+        }
+    }
+};
+
+static constexpr HexPairs HEX_PAIRS{};
+
+char* AppendHexColor(char* cursor, const Color& color) {
+    memcpy(cursor, HEX_PAIRS.digits[color.r], 2);
+    memcpy(cursor + 2, HEX_PAIRS.digits[color.g], 2);
+    memcpy(cursor + 4, HEX_PAIRS.digits[color.b], 2);
+    return cursor + 6;
+}
+
+char* AppendLiteral(char* cursor, const char* literal, size_t length) {
+    memcpy(cursor, literal, length);
+    return cursor + length;
+}
+
+char* AppendDecimal(char* cursor, unsigned long long value) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (count)
+        *cursor++ = digits[--count];
+    return cursor;
+}
+
+//,"base00":"rrggbb" to ,"base0F":"rrggbb"
+char* AppendBase16Colors(char* cursor, const Base16Palette& palette) {
+    char key[] = ",\"base00\":\"";
+    for (int i = 0; i < 16; ++i) {
+        key[7] = "0123456789ABCDEF"[i];
+        cursor = AppendLiteral(cursor, key, sizeof(key) - 1);
+        cursor = AppendHexColor(cursor, i < 8 ? palette.primary[i] : palette.accents[i - 8]);
+        *cursor++ = '"';
+    }
+    return cursor;
+}
+
+bool OpenPaletteSink(PaletteSink& sink, const char* path) {
+    //stdout keeps its own buffering, it's flushed along with the sink
+    bool toStdout = strcmp(path, "-") == 0;
+    sink.file = toStdout ? stdout : fopen(path, "wb");
+    if (!sink.file)
+        return false;
+    if (!toStdout)
+        setvbuf(sink.file, nullptr, _IONBF, 0);
+    sink.buffer.resize(PALETTE_SINK_BUFFER_SIZE);
+    sink.used = 0;
+    sink.failed = false;
+    sink.flushEachLine = false;
+    return true;
+}
+
+bool FlushPaletteSink(PaletteSink& sink) {
+    if (sink.used && fwrite(sink.buffer.data(), 1, sink.used, sink.file) != sink.used)
+        sink.failed = true;
+    if (sink.file == stdout && fflush(stdout) != 0)
+        sink.failed = true;
+    sink.used = 0;
+    return !sink.failed;
+}
+
+bool ClosePaletteSink(PaletteSink& sink) {
+    if (!sink.file)
+        return false;
+    FlushPaletteSink(sink);
+    if (sink.file != stdout && fclose(sink.file) != 0)
+        sink.failed = true;
+    sink.file = nullptr;
+    return !sink.failed;
+}
+
+void AppendPaletteLine(PaletteSink& sink, const char* imagePath, const Base16Palette& palette, const ExtractionStats* stats) {
+    //Escaping makes a path at most 6 times longer, the rest of the line is under 512 bytes
+    size_t pathLength = strlen(imagePath);
+    size_t required = pathLength * 6 + 512;
+    if (sink.used + required > sink.buffer.size()) {
+        FlushPaletteSink(sink);
+        if (required > sink.buffer.size())
+            sink.buffer.resize(required);
+    }
+
+    char* cursor = sink.buffer.data() + sink.used;
+    cursor = AppendLiteral(cursor, "{\"path\":\"", 9);
+    for (size_t i = 0; i < pathLength; ++i) {
+        unsigned char c = imagePath[i];
+        if (c == '"' || c == '\\') {
+            *cursor++ = '\\';
+            *cursor++ = c;
+        } else if (c < 0x20) {
+            cursor = AppendLiteral(cursor, "\\u00", 4);
+            memcpy(cursor, HEX_PAIRS.digits[c], 2);
+            cursor += 2;
+        } else {
+            *cursor++ = c;
+        }
+    }
+    *cursor++ = '"';
+    cursor = AppendBase16Colors(cursor, palette);
+
+    if (stats) {
+        cursor = AppendLiteral(cursor, ",\"population\":", 14);
+        cursor = AppendDecimal(cursor, stats->population);
+        cursor = AppendLiteral(cursor, ",\"scratch_bytes\":", 17);
+        cursor = AppendDecimal(cursor, stats->scratchBytes);
+    }
+    cursor = AppendLiteral(cursor, "}\n", 2);
+    sink.used = cursor - sink.buffer.data();
+    if (sink.flushEachLine)
+        FlushPaletteSink(sink);
+}
+
+void AppendFrameLine(PaletteSink& sink, int frame, double latency, const Base16Palette& palette) {
+    //The line is under 512 bytes
+    if (sink.used + 512 > sink.buffer.size())
+        FlushPaletteSink(sink);
+
+    char* cursor = sink.buffer.data() + sink.used;
+    int length = snprintf(cursor, 64, "{\"frame\":%d,\"latency_ms\":%.3f", frame, latency);
+    cursor += std::min(length, 63);
+    cursor = AppendBase16Colors(cursor, palette);
+    cursor = AppendLiteral(cursor, "}\n", 2);
+    sink.used = cursor - sink.buffer.data();
+    if (sink.flushEachLine)
+        FlushPaletteSink(sink);
+}
+
+unsigned long long HashContent(const unsigned char* data, size_t size) {
+    unsigned long long hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+bool HashFile(const char* path, unsigned long long& hash) {
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    hash = 0xcbf29ce484222325ull;
+    unsigned char buff[65536];
+    size_t size{};
+    while ((size = fread(buff, 1, sizeof(buff), file)) > 0) {
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= buff[i];
+            hash *= 0x100000001b3ull;
+        }
+    }
+    bool failed = ferror(file);
+    fclose(file);
+    return !failed;
+}
+
+void PutLittleEndian(unsigned char* bytes, unsigned long long value, int size) {
+    for (int i = 0; i < size; ++i)
+        bytes[i] = (unsigned char)(value >> (i * 8));
+}
+
+unsigned long long GetLittleEndian(const unsigned char* bytes, int size) {
+    unsigned long long value = 0;
+    for (int i = 0; i < size; ++i)
+        value |= (unsigned long long)bytes[i] << (i * 8);
+    return value;
+}
+
+void BuildPaletteFileHeader(const PaletteFileWriter& writer, unsigned long long hashesOffset, unsigned char (&header)[PALETTE_FILE_HEADER_SIZE]) {
+    memcpy(header, "I2PB", 4);
+    PutLittleEndian(header + 4, PALETTE_FILE_VERSION, 2);
+    PutLittleEndian(header + 6, hashesOffset ? PALETTE_FILE_HAS_HASHES : 0, 2);
+    PutLittleEndian(header + 8, writer.recordCount, 8);
+    PutLittleEndian(header + 16, PALETTE_FILE_HEADER_SIZE, 8);
+    PutLittleEndian(header + 24, hashesOffset, 8);
+}
+
+bool OpenPaletteFileWriter(PaletteFileWriter& writer, const char* path, bool withHashes) {
+    writer.file = fopen(path, "wb");
+    if (!writer.file)
+        return false;
+    setvbuf(writer.file, nullptr, _IOFBF, PALETTE_SINK_BUFFER_SIZE);
+    writer.hashes.clear();
+    writer.recordCount = 0;
+    writer.withHashes = withHashes;
+    writer.failed = false;
+
+    //Rewritten with the final counts when closing
+    unsigned char header[PALETTE_FILE_HEADER_SIZE]{};
+    BuildPaletteFileHeader(writer, 0, header);
+    writer.failed = fwrite(header, 1, sizeof(header), writer.file) != sizeof(header);
+    return true;
+}
+
+void AppendPaletteRecord(PaletteFileWriter& writer, const Base16Palette& palette, unsigned long long contentHash) {
+    unsigned char record[PALETTE_RECORD_SIZE];
+    for (int i = 0; i < 16; ++i) {
+        const Color& color = i < 8 ? palette.primary[i] : palette.accents[i - 8];
+        record[i * 3] = color.r;
+        record[i * 3 + 1] = color.g;
+        record[i * 3 + 2] = color.b;
+    }
+    if (fwrite(record, 1, sizeof(record), writer.file) != sizeof(record))
+        writer.failed = true;
+    if (writer.withHashes)
+        writer.hashes.emplace_back(contentHash, writer.recordCount);
+    ++writer.recordCount;
+}
+
+bool ClosePaletteFileWriter(PaletteFileWriter& writer) {
+    if (!writer.file)
+        return false;
+
+    unsigned long long hashesOffset = 0;
+    if (writer.withHashes) {
+        hashesOffset = PALETTE_FILE_HEADER_SIZE + writer.recordCount * PALETTE_RECORD_SIZE;
+        std::sort(writer.hashes.begin(), writer.hashes.end());
+        for (const auto& hash : writer.hashes) {
+            unsigned char entry[PALETTE_HASH_ENTRY_SIZE];
+            PutLittleEndian(entry, hash.first, 8);
+            PutLittleEndian(entry + 8, hash.second, 8);
+            if (fwrite(entry, 1, sizeof(entry), writer.file) != sizeof(entry))
+                writer.failed = true;
+        }
+    }
+
+    unsigned char header[PALETTE_FILE_HEADER_SIZE]{};
+    BuildPaletteFileHeader(writer, hashesOffset, header);
+    if (fseek(writer.file, 0, SEEK_SET) != 0 || fwrite(header, 1, sizeof(header), writer.file) != sizeof(header))
+        writer.failed = true;
+    if (fclose(writer.file) != 0)
+        writer.failed = true;
+    writer.file = nullptr;
+    return !writer.failed;
+}
+
+//Maps files of at least minSize bytes, or reads them into storage where mmap isn't available
+bool MapFile(const char* path, size_t minSize, const unsigned char*& data, size_t& size, bool& mapped, std::vector<unsigned char>& storage) {
+#ifdef PALETTE_FILE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat status{};
+    if (fstat(fd, &status) != 0 || (size_t)status.st_size < minSize) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+    data = (const unsigned char*)mapping;
+    size = status.st_size;
+    mapped = true;
+    (void)storage;
+#else
+    std::ifstream file{ path, std::ios::binary };
+    if (!file)
+        return false;
+    storage.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    if (storage.size() < minSize)
+        return false;
+    data = storage.data();
+    size = storage.size();
+    mapped = false;
+#endif
+    return true;
+}
+
+void UnmapFile(const unsigned char* data, size_t size, bool mapped) {
+#ifdef PALETTE_FILE_MMAP
+    if (mapped)
+        munmap((void*)data, size);
+#else
+    (void)data;
+    (void)size;
+    (void)mapped;
+#endif
+}
+
+bool OpenPaletteFile(PaletteFileReader& reader, const char* path) {
+    ClosePaletteFile(reader);
+    if (!MapFile(path, PALETTE_FILE_HEADER_SIZE, reader.data, reader.size, reader.mapped, reader.storage))
+        return false;
+
+    const unsigned char* header = reader.data;
+    unsigned long long recordCount = reader.size >= PALETTE_FILE_HEADER_SIZE ? GetLittleEndian(header + 8, 8) : 0;
+    unsigned long long recordsOffset = reader.size >= PALETTE_FILE_HEADER_SIZE ? GetLittleEndian(header + 16, 8) : 0;
+    unsigned long long hashesOffset = reader.size >= PALETTE_FILE_HEADER_SIZE ? GetLittleEndian(header + 24, 8) : 0;
+    bool hasHashes = reader.size >= PALETTE_FILE_HEADER_SIZE && GetLittleEndian(header + 6, 2) & PALETTE_FILE_HAS_HASHES;
+
+    //Sizes are checked by division so a corrupt count can't overflow
+    bool valid = reader.size >= PALETTE_FILE_HEADER_SIZE && memcmp(header, "I2PB", 4) == 0 && GetLittleEndian(header + 4, 2) == PALETTE_FILE_VERSION
+        && recordsOffset >= PALETTE_FILE_HEADER_SIZE && recordsOffset <= reader.size
+        && recordCount <= (reader.size - recordsOffset) / PALETTE_RECORD_SIZE;
+    if (valid && hasHashes) {
+        valid = hashesOffset >= PALETTE_FILE_HEADER_SIZE && hashesOffset <= reader.size
+            && recordCount <= (reader.size - hashesOffset) / PALETTE_HASH_ENTRY_SIZE;
+    }
+    if (!valid) {
+        ClosePaletteFile(reader);
+        return false;
+    }
+
+    reader.recordCount = recordCount;
+    reader.records = reader.data + recordsOffset;
+    reader.hashes = hasHashes ? reader.data + hashesOffset : nullptr;
+    return true;
+}
+
+void ClosePaletteFile(PaletteFileReader& reader) {
+    UnmapFile(reader.data, reader.size, reader.mapped);
+    reader = PaletteFileReader{};
+}
+
+bool GetPaletteRecord(const PaletteFileReader& reader, unsigned long long index, Base16Palette& palette) {
+    if (index >= reader.recordCount)
+        return false;
+    const unsigned char* record = reader.records + index * PALETTE_RECORD_SIZE;
+    for (int i = 0; i < 16; ++i) {
+        Color& color = i < 8 ? palette.primary[i] : palette.accents[i - 8];
+        color = Color{ record[i * 3], record[i * 3 + 1], record[i * 3 + 2] };
+    }
+    return true;
+}
+
+bool FindPaletteRecord(const PaletteFileReader& reader, unsigned long long contentHash, unsigned long long& index) {
+    if (!reader.hashes)
+        return false;
+    unsigned long long begin = 0;
+    unsigned long long end = reader.recordCount;
+    while (begin < end) {
+        unsigned long long middle = begin + (end - begin) / 2;
+        if (GetLittleEndian(reader.hashes + middle * PALETTE_HASH_ENTRY_SIZE, 8) < contentHash)
+            begin = middle + 1;
+        else
+            end = middle;
+    }
+    if (begin == reader.recordCount || GetLittleEndian(reader.hashes + begin * PALETTE_HASH_ENTRY_SIZE, 8) != contentHash)
+        return false;
+    index = GetLittleEndian(reader.hashes + begin * PALETTE_HASH_ENTRY_SIZE + 8, 8);
+    return index < reader.recordCount;
+}
+
+void GetPaletteFeature(const Base16Palette& palette, PaletteFeature& feature) {
+    for (int i = 0; i < 16; ++i) {
+        const Color& color = i < 8 ? palette.primary[i] : palette.accents[i - 8];
+        ColorLab lab = Rgb2Oklab(color.r / 255.0f, color.g / 255.0f, color.b / 255.0f);
+        float channels[3]{ lab.l - 0.5f, lab.a, lab.b };
+        for (int j = 0; j < 3; ++j)
+            feature.values[i * 3 + j] = (signed char)std::clamp((int)lroundf(channels[j] * PALETTE_FEATURE_SCALE), -127, 127);
+    }
+}
+
+int GetFeatureDistance(const signed char* a, const signed char* b) {
+    int distance = 0;
+    for (int i = 0; i < PALETTE_FEATURE_SIZE; ++i) {
+        int difference = a[i] - b[i];
+        distance += difference * difference;
+    }
+    return distance;
+}
+
+int FindNearestCentroid(const std::vector<PaletteFeature>& centroids, const signed char* feature) {
+    int nearest = 0;
+    int nearestDistance = INT_MAX;
+    for (int c = 0; c < centroids.size(); ++c) {
+        int distance = GetFeatureDistance(centroids[c].values, feature);
+        if (distance < nearestDistance) {
+            nearestDistance = distance;
+            nearest = c;
+        }
+    }
+    return nearest;
+}
+
+//Lloyd iterations on a random sample, centers are kept in float and quantized once at the end
+void TrainIndexCentroids(const std::vector<PaletteFeature>& features, int listCount, unsigned int seed, std::vector<PaletteFeature>& centroids) {
+    std::mt19937 rng{ seed };
+    std::vector<int> order(features.size());
+    for (int i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::shuffle(order.begin(), order.end(), rng);
+    order.resize(std::min(order.size(), (size_t)listCount * PALETTE_INDEX_TRAINING_FACTOR));
+
+    centroids.assign(listCount, PaletteFeature{});
+    for (int c = 0; c < listCount && c < order.size(); ++c)
+        centroids[c] = features[order[c]];
+
+    std::vector<float> sums((size_t)listCount * PALETTE_FEATURE_SIZE);
+    std::vector<int> populations(listCount);
+    for (int iteration = 0; iteration < PALETTE_INDEX_ITERATIONS; ++iteration) {
+        std::fill(sums.begin(), sums.end(), 0.0f);
+        std::fill(populations.begin(), populations.end(), 0);
+        for (int idx : order) {
+            int c = FindNearestCentroid(centroids, features[idx].values);
+            populations[c] += 1;
+            for (int i = 0; i < PALETTE_FEATURE_SIZE; ++i)
+                sums[(size_t)c * PALETTE_FEATURE_SIZE + i] += features[idx].values[i];
+        }
+
+        //Empty lists keep their center
+        for (int c = 0; c < listCount; ++c) {
+            if (!populations[c])
+                continue;
+            for (int i = 0; i < PALETTE_FEATURE_SIZE; ++i)
+                centroids[c].values[i] = (signed char)lroundf(sums[(size_t)c * PALETTE_FEATURE_SIZE + i] / populations[c]);
+        }
+    }
+}
+
+//Entries are counting sorted by list into a temporary file, renamed over path once complete
+bool WriteIndexFile(const char* path, const std::vector<PaletteFeature>& centroids, const std::vector<int>& labels,
+    const std::vector<PaletteFeature>& features, const std::vector<std::string>& paths, unsigned long long trainedCount) {
+    unsigned long long entryCount = features.size();
+    int listCount = centroids.size();
+    std::vector<unsigned long long> lists(listCount + 1);
+    for (unsigned long long i = 0; i < entryCount; ++i)
+        lists[labels[i] + 1] += 1;
+    for (int c = 0; c < listCount; ++c)
+        lists[c + 1] += lists[c];
+    std::vector<unsigned int> ids(entryCount);
+    std::vector<unsigned long long> cursors(lists.begin(), lists.end() - 1);
+    for (unsigned long long i = 0; i < entryCount; ++i)
+        ids[cursors[labels[i]]++] = (unsigned int)i;
+
+    std::string temporaryPath = std::string{ path } + ".tmp";
+    FILE* file = fopen(temporaryPath.c_str(), "wb");
+    if (!file)
+        return false;
+    setvbuf(file, nullptr, _IOFBF, PALETTE_SINK_BUFFER_SIZE);
+
+    unsigned long long centroidsOffset = PALETTE_INDEX_HEADER_SIZE;
+    unsigned long long listsOffset = centroidsOffset + (unsigned long long)listCount * PALETTE_FEATURE_SIZE;
+    unsigned long long featuresOffset = listsOffset + (listCount + 1) * 8ull;
+    unsigned long long idsOffset = featuresOffset + entryCount * PALETTE_FEATURE_SIZE;
+    unsigned long long pathsOffset = idsOffset + entryCount * 4;
+
+    unsigned char header[PALETTE_INDEX_HEADER_SIZE]{};
+    memcpy(header, "I2PX", 4);
+    PutLittleEndian(header + 4, PALETTE_INDEX_VERSION, 2);
+    PutLittleEndian(header + 8, listCount, 4);
+    PutLittleEndian(header + 12, trainedCount, 4);
+    PutLittleEndian(header + 16, entryCount, 8);
+    PutLittleEndian(header + 24, centroidsOffset, 8);
+    PutLittleEndian(header + 32, listsOffset, 8);
+    PutLittleEndian(header + 40, featuresOffset, 8);
+    PutLittleEndian(header + 48, idsOffset, 8);
+    PutLittleEndian(header + 56, pathsOffset, 8);
+    bool failed = fwrite(header, 1, sizeof(header), file) != sizeof(header);
+
+    for (const auto& centroid : centroids)
+        failed |= fwrite(centroid.values, 1, PALETTE_FEATURE_SIZE, file) != PALETTE_FEATURE_SIZE;
+    unsigned char bytes[8];
+    for (unsigned long long offset : lists) {
+        PutLittleEndian(bytes, offset, 8);
+        failed |= fwrite(bytes, 1, 8, file) != 8;
+    }
+    for (unsigned int id : ids)
+        failed |= fwrite(features[id].values, 1, PALETTE_FEATURE_SIZE, file) != PALETTE_FEATURE_SIZE;
+    for (unsigned int id : ids) {
+        PutLittleEndian(bytes, id, 4);
+        failed |= fwrite(bytes, 1, 4, file) != 4;
+    }
+
+    unsigned long long pathOffset = 0;
+    for (unsigned long long i = 0; i <= entryCount; ++i) {
+        PutLittleEndian(bytes, pathOffset, 8);
+        failed |= fwrite(bytes, 1, 8, file) != 8;
+        if (i < entryCount)
+            pathOffset += paths[i].size() + 1;
+    }
+    for (const auto& imagePath : paths)
+        failed |= fwrite(imagePath.c_str(), 1, imagePath.size() + 1, file) != imagePath.size() + 1;
+
+    if (fclose(file) != 0)
+        failed = true;
+    if (failed || rename(temporaryPath.c_str(), path) != 0) {
+        remove(temporaryPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool WritePaletteIndex(const char* path, const std::vector<PaletteFeature>& features, const std::vector<std::string>& paths, unsigned int seed) {
+    if (features.size() != paths.size() || features.size() > UINT_MAX)
+        return false;
+
+    int listCount = std::clamp((int)lround(sqrt((double)features.size())), 1, PALETTE_INDEX_MAX_LISTS);
+    std::vector<PaletteFeature> centroids{};
+    TrainIndexCentroids(features, listCount, seed, centroids);
+    std::vector<int> labels(features.size());
+    for (size_t i = 0; i < features.size(); ++i)
+        labels[i] = FindNearestCentroid(centroids, features[i].values);
+    return WriteIndexFile(path, centroids, labels, features, paths, features.size());
+}
+
+bool UpdatePaletteIndex(const char* path, const std::vector<PaletteFeature>& features, const std::vector<std::string>& paths, unsigned int seed) {
+    if (features.size() != paths.size())
+        return false;
+    PaletteIndex index{};
+    if (!OpenPaletteIndex(index, path))
+        return WritePaletteIndex(path, features, paths, seed);
+
+    //Everything is copied out in id order, with the list of each entry, so the mapping is gone before the file is replaced
+    std::vector<PaletteFeature> centroids(index.listCount);
+    for (int c = 0; c < index.listCount; ++c)
+        memcpy(centroids[c].values, index.centroids + (size_t)c * PALETTE_FEATURE_SIZE, PALETTE_FEATURE_SIZE);
+    std::vector<PaletteFeature> allFeatures(index.entryCount);
+    std::vector<std::string> allPaths(index.entryCount);
+    std::vector<int> labels(index.entryCount, -1);
+    bool valid = true;
+    for (int c = 0; c < index.listCount; ++c) {
+        unsigned long long begin = GetLittleEndian(index.lists + c * 8ull, 8);
+        unsigned long long end = GetLittleEndian(index.lists + (c + 1) * 8ull, 8);
+        for (unsigned long long i = begin; i < end && valid; ++i) {
+            unsigned long long id = GetLittleEndian(index.ids + i * 4, 4);
+            valid = id < index.entryCount && labels[id] < 0;
+            if (valid) {
+                memcpy(allFeatures[id].values, index.features + i * PALETTE_FEATURE_SIZE, PALETTE_FEATURE_SIZE);
+                labels[id] = c;
+            }
+        }
+    }
+    for (unsigned long long id = 0; id < index.entryCount && valid; ++id) {
+        const char* imagePath = GetPaletteIndexPath(index, (unsigned int)id);
+        valid = imagePath != nullptr;
+        if (valid)
+            allPaths[id] = imagePath;
+    }
+    unsigned long long trainedCount = index.trainedCount;
+    ClosePaletteIndex(index);
+    if (!valid)
+        return false;
+
+    //Images indexed before get their new palette, the others are appended
+    std::unordered_map<std::string, size_t> positions{};
+    for (size_t id = 0; id < allPaths.size(); ++id)
+        positions.emplace(allPaths[id], id);
+    for (size_t i = 0; i < features.size(); ++i) {
+        auto position = positions.emplace(paths[i], allFeatures.size());
+        if (!position.second) {
+            allFeatures[position.first->second] = features[i];
+            labels[position.first->second] = -1;
+            continue;
+        }
+        allFeatures.push_back(features[i]);
+        allPaths.push_back(paths[i]);
+        labels.push_back(-1);
+    }
+    if (allFeatures.size() > UINT_MAX)
+        return false;
+
+    //Lists trained on a much smaller index end up unbalanced
+    if (allFeatures.size() > trainedCount * PALETTE_INDEX_RETRAIN_FACTOR)
+        return WritePaletteIndex(path, allFeatures, allPaths, seed);
+    for (size_t i = 0; i < allFeatures.size(); ++i) {
+        if (labels[i] < 0)
+            labels[i] = FindNearestCentroid(centroids, allFeatures[i].values);
+    }
+    return WriteIndexFile(path, centroids, labels, allFeatures, allPaths, trainedCount);
+}
+
+bool OpenPaletteIndex(PaletteIndex& index, const char* path) {
+    ClosePaletteIndex(index);
+    if (!MapFile(path, PALETTE_INDEX_HEADER_SIZE, index.data, index.size, index.mapped, index.storage))
+        return false;
+
+    const unsigned char* header = index.data;
+    bool valid = index.size >= PALETTE_INDEX_HEADER_SIZE && memcmp(header, "I2PX", 4) == 0 && GetLittleEndian(header + 4, 2) == PALETTE_INDEX_VERSION;
+    unsigned long long listCount = valid ? GetLittleEndian(header + 8, 4) : 0;
+    unsigned long long entryCount = valid ? GetLittleEndian(header + 16, 8) : 0;
+    unsigned long long offsets[5]{};
+    for (int i = 0; valid && i < 5; ++i) {
+        offsets[i] = GetLittleEndian(header + 24 + i * 8, 8);
+        valid = offsets[i] >= PALETTE_INDEX_HEADER_SIZE && offsets[i] <= index.size;
+    }
+
+    //Same division checks as palette files, then every list and the path table must stay in bounds
+    unsigned long long available[5]{};
+    for (int i = 0; valid && i < 5; ++i)
+        available[i] = index.size - offsets[i];
+    valid = valid && listCount >= 1 && listCount <= PALETTE_INDEX_MAX_LISTS
+        && listCount <= available[0] / PALETTE_FEATURE_SIZE && listCount + 1 <= available[1] / 8
+        && entryCount <= available[2] / PALETTE_FEATURE_SIZE && entryCount <= available[3] / 4
+        && entryCount < available[4] / 8;
+    for (unsigned long long c = 0; valid && c < listCount; ++c) {
+        unsigned long long begin = GetLittleEndian(index.data + offsets[1] + c * 8, 8);
+        unsigned long long end = GetLittleEndian(index.data + offsets[1] + (c + 1) * 8, 8);
+        valid = begin <= end && end <= entryCount && (c || begin == 0);
+    }
+    unsigned long long pathsBegin = offsets[4] + (entryCount + 1) * 8;
+    unsigned long long pathsSize = valid ? index.size - pathsBegin : 0;
+    //An empty batch writes an index with no entries and no paths, queries on it find nothing
+    valid = valid && (entryCount == 0 ? pathsSize == 0 : pathsSize > 0 && index.data[index.size - 1] == '\0');
+    if (!valid) {
+        ClosePaletteIndex(index);
+        return false;
+    }
+
+    index.entryCount = entryCount;
+    index.listCount = (int)listCount;
+    index.trainedCount = std::min(GetLittleEndian(header + 12, 4), entryCount);
+    index.centroids = (const signed char*)(index.data + offsets[0]);
+    index.lists = index.data + offsets[1];
+    index.features = (const signed char*)(index.data + offsets[2]);
+    index.ids = index.data + offsets[3];
+    index.pathOffsets = index.data + offsets[4];
+    index.paths = (const char*)(index.data + pathsBegin);
+    index.pathsSize = pathsSize;
+    return true;
+}
+
+void ClosePaletteIndex(PaletteIndex& index) {
+    UnmapFile(index.data, index.size, index.mapped);
+    index = PaletteIndex{};
+}
+
+void FindNearestPalettes(const PaletteIndex& index, const PaletteFeature& query, int count, int probes, std::vector<PaletteMatch>& matches) {
+    matches.clear();
+    if (count <= 0 || !index.data)
+        return;
+
+    std::vector<std::pair<int, int>> lists(index.listCount);
+    for (int c = 0; c < index.listCount; ++c)
+        lists[c] = { GetFeatureDistance(index.centroids + (size_t)c * PALETTE_FEATURE_SIZE, query.values), c };
+    probes = std::clamp(probes > 0 ? probes : PALETTE_INDEX_DEFAULT_PROBES, 1, index.listCount);
+    std::partial_sort(lists.begin(), lists.begin() + probes, lists.end());
+
+    //Max heap on distance, the worst of the best count matches sits on top
+    auto closer = [](const PaletteMatch& a, const PaletteMatch& b) { return a.distance < b.distance; };
+    for (int p = 0; p < probes; ++p) {
+        int c = lists[p].second;
+        unsigned long long begin = GetLittleEndian(index.lists + c * 8ull, 8);
+        unsigned long long end = GetLittleEndian(index.lists + (c + 1) * 8ull, 8);
+        for (unsigned long long i = begin; i < end; ++i) {
+            int distance = GetFeatureDistance(index.features + i * PALETTE_FEATURE_SIZE, query.values);
+            if (matches.size() == count && distance >= matches.front().distance)
+                continue;
+            if (matches.size() == count) {
+                std::pop_heap(matches.begin(), matches.end(), closer);
+                matches.pop_back();
+            }
+            matches.push_back(PaletteMatch{ (unsigned int)GetLittleEndian(index.ids + i * 4, 4), distance });
+            std::push_heap(matches.begin(), matches.end(), closer);
+        }
+    }
+    std::sort_heap(matches.begin(), matches.end(), closer);
+}
+
+const char* GetPaletteIndexPath(const PaletteIndex& index, unsigned int id) {
+    if (id >= index.entryCount)
+        return nullptr;
+    unsigned long long offset = GetLittleEndian(index.pathOffsets + id * 8ull, 8);
+    return offset < index.pathsSize ? index.paths + offset : nullptr;
+}
+
+//Placeholders are {{base00}} to {{base0F}} for "rrggbb" and {{base00.rgb}} for "r;g;b", -1 for anything else.
+//Fields 0 to 15 are the hex colors, 16 to 31 the decimal ones
+constexpr int GetTemplateField(const char* name, size_t size) {
+    if ((size != 6 && size != 10) || name[0] != 'b' || name[1] != 'a' || name[2] != 's' || name[3] != 'e' || name[4] != '0')
+        return -1;
+    int index = name[5] >= '0' && name[5] <= '9' ? name[5] - '0' : name[5] >= 'A' && name[5] <= 'F' ? name[5] - 'A' + 10 : -1;
+    if (index < 0 || size == 6)
+        return index;
+    if (name[6] != '.' || name[7] != 'r' || name[8] != 'g' || name[9] != 'b')
+        return -1;
+    return index + 16;
+}
+
+constexpr bool IsValidPaletteTemplate(const char* text) {
+    for (size_t i = 0; text[i]; ++i) {
+        if (text[i] != '{' || text[i + 1] != '{')
+            continue;
+        size_t end = i + 2;
+        while (text[end] && !(text[end] == '}' && text[end + 1] == '}'))
+            ++end;
+        if (!text[end] || GetTemplateField(text + i + 2, end - i - 2) < 0)
+            return false;
+        i = end + 1;
+    }
+    return true;
+}
+
+constexpr char JSON_PALETTE_TEMPLATE[] = R"JSON(
+{
+    "base00": "{{base00}}",
+    "base01": "{{base01}}",
+    "base02": "{{base02}}",
+    "base03": "{{base03}}",
+    "base04": "{{base04}}",
+    "base05": "{{base05}}",
+    "base06": "{{base06}}",
+    "base07": "{{base07}}",
+    "base08": "{{base08}}",
+    "base09": "{{base09}}",
+    "base0A": "{{base0A}}",
+    "base0B": "{{base0B}}",
+    "base0C": "{{base0C}}",
+    "base0D": "{{base0D}}",
+    "base0E": "{{base0E}}",
+    "base0F": "{{base0F}}"
+}
+    )JSON";
+
+constexpr char HTML_PALETTE_TEMPLATE[] = R"HTML(
+<html>
+    <head>
+        <style>
+            body {
+                margin: 2rem;
+                font-family: sans-serif;
+            }
+            body > div {
+                display: flex;
+                flex-direction: row;
+                flex-wrap: wrap;
+                gap: 1em;
+            }
+            body > div > div {
+                width: 5rem;
+                height: 5rem;
+                display: flex;
+                justify-content: center;
+                align-items: center;
+            }
+            #base00 { background-color: #{{base00}}; color: #cdd6f4; }
+            #base01 { background-color: #{{base01}}; color: #cdd6f4; }
+            #base02 { background-color: #{{base02}}; color: #cdd6f4; }
+            #base03 { background-color: #{{base03}}; color: #1e1e2e; }
+            #base04 { background-color: #{{base04}}; color: #1e1e2e; }
+            #base05 { background-color: #{{base05}}; color: #1e1e2e; }
+            #base06 { background-color: #{{base06}}; color: #1e1e2e; }
+            #base07 { background-color: #{{base07}}; color: #1e1e2e; }
+            #base08 { background-color: #{{base08}}; color: #1e1e2e; }
+            #base09 { background-color: #{{base09}}; color: #1e1e2e; }
+            #base0A { background-color: #{{base0A}}; color: #1e1e2e; }
+            #base0B { background-color: #{{base0B}}; color: #1e1e2e; }
+            #base0C { background-color: #{{base0C}}; color: #1e1e2e; }
+            #base0D { background-color: #{{base0D}}; color: #1e1e2e; }
+            #base0E { background-color: #{{base0E}}; color: #1e1e2e; }
+            #base0F { background-color: #{{base0F}}; color: #1e1e2e; }
+        </style>
+    </head>
+    <body>
+        <h2>Primary colors</h2>
+        <div>
+            <div id="base00">00</div>
+            <div id="base01">01</div>
+            <div id="base02">02</div>
+            <div id="base03">03</div>
+            <div id="base04">04</div>
+            <div id="base05">05</div>
+            <div id="base06">06</div>
+            <div id="base07">07</div>
+        </div>
+        <h2>Accents</h2>
+        <div>
+            <div id="base08">08</div>
+            <div id="base09">09</div>
+            <div id="base0A">0A</div>
+            <div id="base0B">0B</div>
+            <div id="base0C">0C</div>
+            <div id="base0D">0D</div>
+            <div id="base0E">0E</div>
+            <div id="base0F">0F</div>
+        </div>
+    </body>
+</html>
+    )HTML";
+
+constexpr char YAML_PALETTE_TEMPLATE[] = R"YAML(scheme: "palette-generator"
+author: "palette-generator"
+base00: "{{base00}}"
+base01: "{{base01}}"
+base02: "{{base02}}"
+base03: "{{base03}}"
+base04: "{{base04}}"
+base05: "{{base05}}"
+base06: "{{base06}}"
+base07: "{{base07}}"
+base08: "{{base08}}"
+base09: "{{base09}}"
+base0A: "{{base0A}}"
+base0B: "{{base0B}}"
+base0C: "{{base0C}}"
+base0D: "{{base0D}}"
+base0E: "{{base0E}}"
+base0F: "{{base0F}}"
+)YAML";
+
+constexpr char XRESOURCES_PALETTE_TEMPLATE[] = R"X(#define base00 #{{base00}}
+#define base01 #{{base01}}
+#define base02 #{{base02}}
+#define base03 #{{base03}}
+#define base04 #{{base04}}
+#define base05 #{{base05}}
+#define base06 #{{base06}}
+#define base07 #{{base07}}
+#define base08 #{{base08}}
+#define base09 #{{base09}}
+#define base0A #{{base0A}}
+#define base0B #{{base0B}}
+#define base0C #{{base0C}}
+#define base0D #{{base0D}}
+#define base0E #{{base0E}}
+#define base0F #{{base0F}}
+
+*foreground: base05
+*background: base00
+*cursorColor: base05
+
+*color0: base00
+*color1: base08
+*color2: base0B
+*color3: base0A
+*color4: base0D
+*color5: base0E
+*color6: base0C
+*color7: base05
+*color8: base03
+*color9: base08
+*color10: base0B
+*color11: base0A
+*color12: base0D
+*color13: base0E
+*color14: base0C
+*color15: base07
+*color16: base09
+*color17: base0F
+*color18: base01
+*color19: base02
+*color20: base04
+*color21: base06
+)X";
+
+constexpr char CSS_PALETTE_TEMPLATE[] = R"CSS(:root {
+    --base00: #{{base00}};
+    --base01: #{{base01}};
+    --base02: #{{base02}};
+    --base03: #{{base03}};
+    --base04: #{{base04}};
+    --base05: #{{base05}};
+    --base06: #{{base06}};
+    --base07: #{{base07}};
+    --base08: #{{base08}};
+    --base09: #{{base09}};
+    --base0A: #{{base0A}};
+    --base0B: #{{base0B}};
+    --base0C: #{{base0C}};
+    --base0D: #{{base0D}};
+    --base0E: #{{base0E}};
+    --base0F: #{{base0F}};
+}
+)CSS";
+
+constexpr char ANSI_PALETTE_TEMPLATE[] =
+    "\x1b[48;2;{{base00.rgb}};38;2;205;214;244m 00 \x1b[0m"
+    "\x1b[48;2;{{base01.rgb}};38;2;205;214;244m 01 \x1b[0m"
+    "\x1b[48;2;{{base02.rgb}};38;2;205;214;244m 02 \x1b[0m"
+    "\x1b[48;2;{{base03.rgb}};38;2;30;30;46m 03 \x1b[0m"
+    "\x1b[48;2;{{base04.rgb}};38;2;30;30;46m 04 \x1b[0m"
+    "\x1b[48;2;{{base05.rgb}};38;2;30;30;46m 05 \x1b[0m"
+    "\x1b[48;2;{{base06.rgb}};38;2;30;30;46m 06 \x1b[0m"
+    "\x1b[48;2;{{base07.rgb}};38;2;30;30;46m 07 \x1b[0m" "\n"
+    "\x1b[48;2;{{base08.rgb}};38;2;30;30;46m 08 \x1b[0m"
+    "\x1b[48;2;{{base09.rgb}};38;2;30;30;46m 09 \x1b[0m"
+    "\x1b[48;2;{{base0A.rgb}};38;2;30;30;46m 0A \x1b[0m"
+    "\x1b[48;2;{{base0B.rgb}};38;2;30;30;46m 0B \x1b[0m"
+    "\x1b[48;2;{{base0C.rgb}};38;2;30;30;46m 0C \x1b[0m"
+    "\x1b[48;2;{{base0D.rgb}};38;2;30;30;46m 0D \x1b[0m"
+    "\x1b[48;2;{{base0E.rgb}};38;2;30;30;46m 0E \x1b[0m"
+    "\x1b[48;2;{{base0F.rgb}};38;2;30;30;46m 0F \x1b[0m" "\n";
+
+static_assert(IsValidPaletteTemplate(JSON_PALETTE_TEMPLATE), "Unknown field in the JSON template");
+static_assert(IsValidPaletteTemplate(HTML_PALETTE_TEMPLATE), "Unknown field in the HTML template");
+static_assert(IsValidPaletteTemplate(YAML_PALETTE_TEMPLATE), "Unknown field in the YAML template");
+static_assert(IsValidPaletteTemplate(XRESOURCES_PALETTE_TEMPLATE), "Unknown field in the Xresources template");
+static_assert(IsValidPaletteTemplate(CSS_PALETTE_TEMPLATE), "Unknown field in the CSS template");
+static_assert(IsValidPaletteTemplate(ANSI_PALETTE_TEMPLATE), "Unknown field in the ANSI template");
+
+struct PaletteTemplate {
+    const char* name{ nullptr };
+    const char* text{ nullptr };
+    size_t size{};
+};
+
+//In PaletteFormat order
+static const PaletteTemplate PALETTE_TEMPLATES[PALETTE_FORMAT_COUNT]{
+    { "JSON palette", JSON_PALETTE_TEMPLATE, sizeof(JSON_PALETTE_TEMPLATE) - 1 },
+    { "HTML palette", HTML_PALETTE_TEMPLATE, sizeof(HTML_PALETTE_TEMPLATE) - 1 },
+    { "base16 scheme", YAML_PALETTE_TEMPLATE, sizeof(YAML_PALETTE_TEMPLATE) - 1 },
+    { "Xresources", XRESOURCES_PALETTE_TEMPLATE, sizeof(XRESOURCES_PALETTE_TEMPLATE) - 1 },
+    { "CSS variables", CSS_PALETTE_TEMPLATE, sizeof(CSS_PALETTE_TEMPLATE) - 1 },
+    { "ANSI preview", ANSI_PALETTE_TEMPLATE, sizeof(ANSI_PALETTE_TEMPLATE) - 1 }
+};
+
+void SetRendererPalette(PaletteRenderer& renderer, const Base16Palette& palette) {
+    for (int i = 0; i < 16; ++i) {
+        const Color& color = i < 8 ? palette.primary[i] : palette.accents[i - 8];
+        AppendHexColor(renderer.hex[i], color);
+        char* cursor = AppendDecimal(renderer.rgb[i], color.r);
+        *cursor++ = ';';
+        cursor = AppendDecimal(cursor, color.g);
+        *cursor++ = ';';
+        cursor = AppendDecimal(cursor, color.b);
+        renderer.rgbSize[i] = (unsigned char)(cursor - renderer.rgb[i]);
+    }
+}
+
+void AppendRendered(PaletteRenderer& renderer, const char* data, size_t size) {
+    if (renderer.used + size > renderer.buffer.size())
+        renderer.buffer.resize(std::max(renderer.buffer.size() * 2, renderer.used + size));
+    memcpy(renderer.buffer.data() + renderer.used, data, size);
+    renderer.used += size;
+}
+
+const char* RenderPalette(PaletteRenderer& renderer, PaletteFormat format, size_t& size) {
+    const PaletteTemplate& paletteTemplate = PALETTE_TEMPLATES[(int)format];
+    const char* text = paletteTemplate.text;
+    const char* end = text + paletteTemplate.size;
+    renderer.used = 0;
+    while (text < end) {
+        const char* field = strstr(text, "{{");
+        if (!field) {
+            AppendRendered(renderer, text, end - text);
+            break;
+        }
+        AppendRendered(renderer, text, field - text);
+
+        //Every field was checked when compiling the templates
+        const char* fieldEnd = strstr(field + 2, "}}");
+        int index = GetTemplateField(field + 2, fieldEnd - field - 2);
+        if (index < 16)
+            AppendRendered(renderer, renderer.hex[index], 6);
+        else
+            AppendRendered(renderer, renderer.rgb[index - 16], renderer.rgbSize[index - 16]);
+        text = fieldEnd + 2;
+    }
+    size = renderer.used;
+    return renderer.buffer.data();
+}
+
+bool WritePaletteFormat(PaletteRenderer& renderer, PaletteFormat format, const char* path) {
+    size_t size = 0;
+    const char* text = RenderPalette(renderer, format, size);
+    bool toStdout = strcmp(path, "-") == 0;
+    FILE* file = toStdout ? stdout : fopen(path, "wb");
+    if (!file)
+        return false;
+    bool written = fwrite(text, 1, size, file) == size;
+    if (toStdout)
+        return fflush(file) == 0 && written;
+    return fclose(file) == 0 && written;
+}
+
+const char* GetPaletteFormatName(PaletteFormat format) {
+    return PALETTE_TEMPLATES[(int)format].name;
+}
+
+void WriteJsonPalette(const Base16Palette& palette, const char* path) {
+    PaletteRenderer renderer{};
+    SetRendererPalette(renderer, palette);
+    WritePaletteFormat(renderer, PaletteFormat::Json, path);
+}
+
+void WriteHtmlPalette(const Base16Palette& palette, const char* path) {
+    PaletteRenderer renderer{};
+    SetRendererPalette(renderer, palette);
+    WritePaletteFormat(renderer, PaletteFormat::Html, path);
+}
+
+void PrintKeys(const PaletteKeys& keys, int totalPopulation) {
+    for (const auto& keyL : keys.keyLs) {
+        printf("KeyL: { population: %d%%, brightness: %d%% }\n", (int)((float)keyL.population / (float)totalPopulation * 100.0), (int)keyL.brightness);
+        for (int i = keyL.keyHSBegin; i < keyL.keyHSEnd; ++i) {
+            const KeyHS& keyHS = keys.keyHSs[i];
+            printf("\t- KeyHS: { population: %d%%, hue: %d, saturation: %d%%}\n", (int)((float)keyHS.population / (float)keyL.population * 100.0), (int)keyHS.hue, (int)keyHS.saturation);
+        }
+    }
+}
+
+struct GifFrameJob {
+    int frame{};
+    int slot{};
+};
+
+struct GifFrameWindow {
+    std::mutex mutex{};
+    std::condition_variable condition{};
+    std::vector<std::vector<unsigned char>> slots{};
+    std::vector<int> freeSlots{};
+    std::deque<GifFrameJob> jobs{};
+    bool done{};
+};
+
+bool ExtractGifPalettes(const unsigned char* buffer, int length, const ExtractionSettings& settings, FrameMode mode, float alphaThreshold, std::vector<Base16Palette>& palettes,
+    PaletteKeys* keys, ExtractionStats* stats) {
+    stbi__context context{};
+    stbi__start_mem(&context, buffer, length);
+
+    stbi__gif gif{};
+    memset(&gif, 0, sizeof(gif));
+
+    //Workers only ever see frames copied into the window, stb keeps its own canvas
+    GifFrameWindow window{};
+    window.slots.resize(settings.threadCount + 1);
+    for (int i = 0; i < window.slots.size(); ++i)
+        window.freeSlots.push_back(i);
+
+    int width{};
+    int height{};
+    std::vector<ColorHistogram> histograms(mode == FrameMode::Aggregate ? settings.threadCount : 0);
+    for (auto& histogram : histograms)
+        ResetHistogram(histogram, settings.binResolution);
+
+    //Frames are already spread over the workers, each extracts single threaded
+    ExtractionSettings workerSettings = settings;
+    workerSettings.threadCount = 1;
+
+    auto runJobs = [&](int workerIdx, PaletteExtractor* extractor) {
+        while (true) {
+            GifFrameJob job{};
+            {
+                std::unique_lock<std::mutex> lock{ window.mutex };
+                window.condition.wait(lock, [&]{ return !window.jobs.empty() || window.done; });
+                if (window.jobs.empty())
+                    return;
+                job = window.jobs.front();
+                window.jobs.pop_front();
+            }
+            SetTraceImage(job.frame, nullptr);
+
+            ImageView image{ window.slots[job.slot].data(), SampleType::UInt8, width, height, PixelFormat::RGBA };
+            image.alphaThreshold = alphaThreshold;
+            if (mode == FrameMode::Aggregate) {
+                AccumulateHistogram(image, histograms[workerIdx]);
+            } else {
+                Base16Palette palette{};
+                extractor->extract(image, palette);
+                std::lock_guard<std::mutex> lock{ window.mutex };
+                palettes[job.frame] = palette;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock{ window.mutex };
+                window.freeSlots.push_back(job.slot);
+            }
+            window.condition.notify_all();
+        }
+    };
+
+    //Aggregate workers only bin pixels, the extractor and its scratch are for Each
+    auto worker = [&](int workerIdx) {
+        if (mode == FrameMode::Each) {
+            PaletteExtractor extractor{ workerSettings };
+            runJobs(workerIdx, &extractor);
+        } else {
+            runJobs(workerIdx, nullptr);
+        }
+    };
+
+    std::vector<std::thread> workers{};
+    std::vector<unsigned char> history[2]{};
+    int frameCount = 0;
+    int comp{};
+
+    while (true) {
+        //Disposal method 3 restores the frame before the previous one
+        unsigned char* twoBack = frameCount >= 2 ? history[frameCount % 2].data() : nullptr;
+        unsigned char* frame = stbi__gif_load_next(&context, &gif, &comp, 4, twoBack);
+        if (!frame || frame == (unsigned char*)&context)
+            break;
+
+        int frameSize = gif.w * gif.h * 4;
+        if (!frameCount) {
+            width = gif.w;
+            height = gif.h;
+            for (auto& slot : window.slots)
+                slot.resize(frameSize);
+            for (int i = 0; i < settings.threadCount; ++i)
+                workers.emplace_back(worker, i);
+        }
+        history[frameCount % 2].assign(frame, frame + frameSize);
+
+        {
+            std::unique_lock<std::mutex> lock{ window.mutex };
+            window.condition.wait(lock, [&]{ return !window.freeSlots.empty(); });
+            int slot = window.freeSlots.back();
+            window.freeSlots.pop_back();
+            memcpy(window.slots[slot].data(), frame, frameSize);
+            if (mode == FrameMode::Each)
+                palettes.resize(frameCount + 1);
+            window.jobs.push_back(GifFrameJob{ frameCount, slot });
+        }
+        window.condition.notify_all();
+        ++frameCount;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{ window.mutex };
+        window.done = true;
+    }
+    window.condition.notify_all();
+    for (auto& thread : workers)
+        thread.join();
+
+    STBI_FREE(gif.out);
+    STBI_FREE(gif.history);
+    STBI_FREE(gif.background);
+
+    if (!frameCount)
+        return false;
+
+    if (mode == FrameMode::Aggregate) {
+        for (int i = 1; i < histograms.size(); ++i)
+            MergeHistogram(histograms[0], histograms[i]);
+        PaletteExtractor extractor{ workerSettings };
+        palettes.resize(1);
+        ExtractionStats aggregateStats = extractor.extract(histograms[0], palettes[0]);
+        if (keys)
+            *keys = extractor.getKeys();
+        if (stats)
+            *stats = aggregateStats;
+    }
+
+    return true;
+}
+
+//stb hands 16-bit PNM samples back in file order, which is big-endian
+void SwapPnmSamples(unsigned short* data, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        data[i] = (data[i] >> 8) | (data[i] << 8);
+}
+
+bool IsPnmMagic(const unsigned char* magic, size_t length) {
+    return length >= 2 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6');
+}
+
+bool IsPnmFile(const char* path) {
+    unsigned char magic[2]{};
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+    size_t count = fread(magic, 1, 2, file);
+    fclose(file);
+    return IsPnmMagic(magic, count);
+}
+
+//HDR and 16-bit files are kept at their native precision, the image keeps its tone map
+bool LoadImageFile(const char* path, ImageView& image) {
+    int channels{};
+    if (stbi_is_hdr(path)) {
+        image.data = stbi_loadf(path, &image.width, &image.height, &channels, 0);
+        image.type = SampleType::Float32;
+    } else if (stbi_is_16_bit(path)) {
+        unsigned short* data = stbi_load_16(path, &image.width, &image.height, &channels, 0);
+        if (data && IsPnmFile(path))
+            SwapPnmSamples(data, (size_t)image.width * image.height * channels);
+        image.data = data;
+        image.type = SampleType::UInt16;
+    } else {
+        image.data = stbi_load(path, &image.width, &image.height, &channels, 0);
+        image.type = SampleType::UInt8;
+    }
+    image.format = GetPixelFormat(channels);
+    return image.data;
+}
+
+bool LoadImageMemory(const unsigned char* buffer, int length, ImageView& image) {
+    int channels{};
+    if (stbi_is_hdr_from_memory(buffer, length)) {
+        image.data = stbi_loadf_from_memory(buffer, length, &image.width, &image.height, &channels, 0);
+        image.type = SampleType::Float32;
+    } else if (stbi_is_16_bit_from_memory(buffer, length)) {
+        unsigned short* data = stbi_load_16_from_memory(buffer, length, &image.width, &image.height, &channels, 0);
+        if (data && IsPnmMagic(buffer, length))
+            SwapPnmSamples(data, (size_t)image.width * image.height * channels);
+        image.data = data;
+        image.type = SampleType::UInt16;
+    } else {
+        image.data = stbi_load_from_memory(buffer, length, &image.width, &image.height, &channels, 0);
+        image.type = SampleType::UInt8;
+    }
+    image.format = GetPixelFormat(channels);
+    return image.data;
+}
+
+//Weight masks are read as grey and must match the image size
+bool LoadWeightMask(const char* path, int width, int height, std::vector<unsigned char>& weights) {
+    int maskWidth{};
+    int maskHeight{};
+    int channels{};
+    unsigned char* data = stbi_load(path, &maskWidth, &maskHeight, &channels, 1);
+    if (!data)
+        return false;
+
+    bool sizeMatches = maskWidth == width && maskHeight == height;
+    if (sizeMatches)
+        weights.assign(data, data + (size_t)width * height);
+    stbi_image_free(data);
+    return sizeMatches;
+}
+
+//Full weight in the centre, falling off quadratically to zero in the corners
+void BuildCenterWeightMask(int width, int height, std::vector<unsigned char>& weights) {
+    weights.resize((size_t)width * height);
+    for (int y = 0; y < height; ++y) {
+        float dy = (y + 0.5f) / height * 2.0f - 1.0f;
+        for (int x = 0; x < width; ++x) {
+            float dx = (x + 0.5f) / width * 2.0f - 1.0f;
+            float weight = std::max(1.0f - (dx * dx + dy * dy) * 0.5f, 0.0f);
+            weights[(size_t)y * width + x] = (unsigned char)(weight * WEIGHT_UNIT + 0.5f);
+        }
+    }
+}
+
+void FreeImage(ImageView& image) {
+    stbi_image_free((void*)image.data);
+    image.data = nullptr;
+}
+
+bool IsGifMemory(const unsigned char* buffer, int length) {
+    stbi__context context{};
+    stbi__start_mem(&context, buffer, length);
+    return stbi__gif_test(&context);
+}
+
+//The pixel pass is split into bands over the pool like a single image
+void PushSlidingHistogram(SlidingHistogram& window, int windowSize, const ImageView& image, WorkerPool& pool, std::vector<ColorHistogram>& bandHistograms) {
+    //The expired frame's storage is recycled for the incoming one
+    ColorHistogram frame{};
+    if (window.frames.size() >= windowSize) {
+        frame = std::move(window.frames.front());
+        window.frames.pop_front();
+        SubtractHistogram(window.total, frame);
+    }
+
+    //Only the rows the expired frame touched are zeroed, a new frame or resolution is reset in full
+    ClearHistogram(frame, window.total.resolution);
+    ParallelAccumulateHistogram(image, pool, bandHistograms, frame);
+    MergeHistogram(window.total, frame);
+    window.frames.push_back(std::move(frame));
+}
+
+int ReadPnmStream(void* user, char* data, int size) {
+    PnmStream& stream = *(PnmStream*)user;
+    int count = std::min((size_t)size, stream.pending.size() - stream.pendingOffset);
+    memcpy(data, stream.pending.data() + stream.pendingOffset, count);
+    stream.pendingOffset += count;
+    return count + fread(data + count, 1, size - count, stream.file);
+}
+
+void SkipPnmStream(void* user, int n) {
+    char buff[4096];
+    while (n > 0) {
+        int count = ReadPnmStream(user, buff, std::min(n, (int)sizeof(buff)));
+        if (!count)
+            break;
+        n -= count;
+    }
+}
+
+int EofPnmStream(void* user) {
+    PnmStream& stream = *(PnmStream*)user;
+    if (stream.pendingOffset < stream.pending.size())
+        return 0;
+    int c = fgetc(stream.file);
+    if (c == EOF)
+        return 1;
+    ungetc(c, stream.file);
+    return 0;
+}
+
+bool LoadPnmStreamFrame(PnmStream& stream, ImageView& image) {
+    if (EofPnmStream(&stream))
+        return false;
+
+    stbi_io_callbacks callbacks{ ReadPnmStream, SkipPnmStream, EofPnmStream };
+    stbi__context context{};
+    stbi__start_callbacks(&context, &callbacks, &stream);
+
+    int channels{};
+    stbi__result_info info{};
+    void* data = stbi__pnm_load(&context, &image.width, &image.height, &channels, 0, &info);
+
+    //stb reads ahead, hand the bytes back so the next frame starts at its header
+    if (context.read_from_callbacks) {
+        std::vector<char> pending(context.img_buffer, context.img_buffer_end);
+        pending.insert(pending.end(), stream.pending.begin() + stream.pendingOffset, stream.pending.end());
+        stream.pending.swap(pending);
+        stream.pendingOffset = 0;
+    }
+
+    if (data && info.bits_per_channel == 16)
+        SwapPnmSamples((unsigned short*)data, (size_t)image.width * image.height * channels);
+
+    image.data = data;
+    image.type = info.bits_per_channel == 16 ? SampleType::UInt16 : SampleType::UInt8;
+    image.format = GetPixelFormat(channels);
+    return data;
+}
+
+struct i2p_extractor {
+    PaletteExtractor extractor;
+    Engine engine{};
+    HdrToneMap toneMap{};
+    float alphaThreshold{};
+    std::vector<SelectionProfile> profiles{};
+    std::vector<SelectionPlan> plans{}; //Compiled from profiles, switching between them costs nothing per image
+
+    explicit i2p_extractor(const ExtractionSettings& settings) : extractor{ settings }, engine{ settings.engine } {}
+};
+
+void CompileSelectionPlans(i2p_extractor* extractor) {
+    extractor->plans.resize(extractor->profiles.size());
+    for (int i = 0; i < extractor->profiles.size(); ++i)
+        CompileSelectionPlan(extractor->profiles[i], extractor->plans[i]);
+}
+
+const SelectionPlan* FindSelectionPlan(const i2p_extractor* extractor, const char* name) {
+    if (!name)
+        return nullptr;
+    for (const auto& plan : extractor->plans) {
+        if (plan.name == name)
+            return &plan;
+    }
+    return nullptr;
+}
+
+void CopyPalette(const Base16Palette& palette, i2p_palette* output) {
+    for (int i = 0; i < 16; ++i) {
+        const Color& color = i < 8 ? palette.primary[i] : palette.accents[i - 8];
+        output->colors[i][0] = color.r;
+        output->colors[i][1] = color.g;
+        output->colors[i][2] = color.b;
+    }
+}
+
+extern "C" void i2p_default_settings(i2p_settings* settings) {
+    ExtractionSettings defaults{};
+    settings->engine = (i2p_engine)defaults.engine;
+    settings->color_count = defaults.colorCount;
+    settings->seed = defaults.seed;
+    settings->thread_count = defaults.threadCount;
+    settings->alpha_threshold = 0.0f;
+    settings->exposure = 0.0f;
+    settings->reinhard = 1;
+    settings->bins = (i2p_bins)defaults.binResolution;
+}
+
+extern "C" i2p_extractor* i2p_create(const i2p_settings* settings) {
+    if (settings->engine < I2P_ENGINE_HISTOGRAM || settings->engine > I2P_ENGINE_KMEANS)
+        return nullptr;
+    if (settings->color_count < 1 || settings->color_count > OCTREE_NODE_BUDGET / OCTREE_DEPTH || settings->thread_count < 1)
+        return nullptr;
+    if (settings->bins < I2P_BINS_QUALITY || settings->bins > I2P_BINS_FAST)
+        return nullptr;
+
+    //The C enums mirror Engine, BinResolution, SampleType and PixelFormat
+    ExtractionSettings extractionSettings{};
+    extractionSettings.engine = (Engine)settings->engine;
+    extractionSettings.colorCount = settings->color_count;
+    extractionSettings.seed = settings->seed;
+    extractionSettings.threadCount = settings->thread_count;
+    extractionSettings.binResolution = (BinResolution)settings->bins;
+
+    //No exception crosses the C interface, allocation and thread start failures return NULL or -1
+    i2p_extractor* extractor = nullptr;
+    try {
+        extractor = new i2p_extractor{ extractionSettings };
+        extractor->toneMap.exposure = exp2f(settings->exposure);
+        extractor->toneMap.reinhard = settings->reinhard;
+        extractor->alphaThreshold = settings->alpha_threshold;
+        GetSelectionProfiles(extractor->profiles);
+        CompileSelectionPlans(extractor);
+    } catch (...) {
+        delete extractor;
+        return nullptr;
+    }
+    return extractor;
+}
+
+extern "C" void i2p_destroy(i2p_extractor* extractor) {
+    delete extractor;
+}
+
+extern "C" int i2p_extract_memory(i2p_extractor* extractor, const void* data, size_t size, i2p_palette* palette) {
+    if (size > INT_MAX)
+        return -1;
+
+    ImageView image{};
+    image.toneMap = extractor->toneMap;
+    image.alphaThreshold = extractor->alphaThreshold;
+    if (!LoadImageMemory((const unsigned char*)data, size, image))
+        return -1;
+
+    Base16Palette base16Palette{};
+    try {
+        extractor->extractor.extract(image, base16Palette);
+    } catch (...) {
+        FreeImage(image);
+        return -1;
+    }
+    FreeImage(image);
+    CopyPalette(base16Palette, palette);
+    return 0;
+}
+
+extern "C" int i2p_extract_pixels(i2p_extractor* extractor, const void* pixels, int width, int height, int channels,
+    i2p_sample_type type, i2p_palette* palette) {
+    if (channels < 1 || channels > 4)
+        return -1;
+
+    i2p_image image{};
+    image.pixels = pixels;
+    image.width = width;
+    image.height = height;
+    image.format = (i2p_pixel_format)GetPixelFormat(channels);
+    image.type = type;
+    return i2p_extract_image(extractor, &image, palette);
+}
+
+bool IsRectInside(const i2p_rect& rect, int width, int height) {
+    if (rect.x < 0 || rect.y < 0 || rect.width < 0 || rect.height < 0 || rect.x >= width || rect.y >= height)
+        return false;
+    return rect.x + rect.width <= width && rect.y + rect.height <= height;
+}
+
+bool GetImageView(const i2p_extractor* extractor, const i2p_image* image, ImageView& view) {
+    if (!image->pixels || image->width <= 0 || image->height <= 0)
+        return false;
+    if (image->type < I2P_SAMPLE_UINT8 || image->type > I2P_SAMPLE_FLOAT32 || image->format < I2P_FORMAT_GREY || image->format > I2P_FORMAT_BGRA)
+        return false;
+    if (!IsRectInside(image->roi, image->width, image->height))
+        return false;
+    if (image->weights && extractor->engine != Engine::Histogram)
+        return false;
+
+    view = ImageView{ image->pixels, (SampleType)image->type, image->width, image->height, (PixelFormat)image->format, image->stride };
+    view.roi = ImageRect{ image->roi.x, image->roi.y, image->roi.width, image->roi.height };
+    view.weights = image->weights;
+    view.weightStride = image->weight_stride;
+    view.toneMap = extractor->toneMap;
+    view.alphaThreshold = extractor->alphaThreshold;
+
+    size_t rowSize = (size_t)image->width * GetChannelCount(view.format) * GetSampleSize(view.type);
+    if (image->stride && image->stride < rowSize)
+        return false;
+    return !image->weight_stride || image->weight_stride >= (size_t)image->width;
+}
+
+extern "C" int i2p_extract_image(i2p_extractor* extractor, const i2p_image* image, i2p_palette* palette) {
+    ImageView view{};
+    if (!GetImageView(extractor, image, view))
+        return -1;
+
+    Base16Palette base16Palette{};
+    try {
+        extractor->extractor.extract(view, base16Palette);
+    } catch (...) {
+        return -1;
+    }
+    CopyPalette(base16Palette, palette);
+    return 0;
+}
+
+extern "C" int i2p_extract_regions(i2p_extractor* extractor, const i2p_image* image, const i2p_rect* rois, int roi_count, i2p_palette* palettes) {
+    ImageView view{};
+    if (extractor->engine != Engine::Histogram || roi_count < 1 || roi_count > MAX_REGION_COUNT)
+        return -1;
+    if (!GetImageView(extractor, image, view))
+        return -1;
+
+    ImageRect regions[MAX_REGION_COUNT]{};
+    for (int i = 0; i < roi_count; ++i) {
+        if (!IsRectInside(rois[i], image->width, image->height))
+            return -1;
+        regions[i] = ImageRect{ rois[i].x, rois[i].y, rois[i].width, rois[i].height };
+    }
+
+    Base16Palette base16Palettes[MAX_REGION_COUNT]{};
+    try {
+        extractor->extractor.extractRegions(view, regions, roi_count, base16Palettes);
+    } catch (...) {
+        return -1;
+    }
+    for (int i = 0; i < roi_count; ++i)
+        CopyPalette(base16Palettes[i], &palettes[i]);
+    return 0;
+}
+
+//The profiles are only swapped in once compiled, a failure leaves the extractor as it was
+extern "C" int i2p_load_profiles(i2p_extractor* extractor, const char* path) {
+    try {
+        std::vector<SelectionProfile> profiles{ extractor->profiles };
+        if (!path || !LoadSelectionProfiles(path, profiles))
+            return -1;
+
+        std::vector<SelectionPlan> plans(profiles.size());
+        for (int i = 0; i < profiles.size(); ++i)
+            CompileSelectionPlan(profiles[i], plans[i]);
+        extractor->profiles.swap(profiles);
+        extractor->plans.swap(plans);
+    } catch (...) {
+        return -1;
+    }
+    return 0;
+}
+
+extern "C" int i2p_set_profile(i2p_extractor* extractor, const char* name) {
+    const SelectionPlan* plan = FindSelectionPlan(extractor, name);
+    if (!plan)
+        return -1;
+
+    try {
+        extractor->extractor.setSelectionPlan(*plan);
+    } catch (...) {
+        return -1;
+    }
+    return 0;
+}
+
+extern "C" int i2p_select_variant(i2p_extractor* extractor, const char* name, i2p_palette* palette) {
+    const SelectionPlan* plan = FindSelectionPlan(extractor, name);
+    if (!plan)
+        return -1;
+
+    Base16Palette base16Palette{};
+    try {
+        extractor->extractor.select(*plan, base16Palette);
+    } catch (...) {
+        return -1;
+    }
+    CopyPalette(base16Palette, palette);
+    return 0;
+}
+
+extern "C" void i2p_palette_hex(const i2p_palette* palette, char hex[16][7]) {
+    for (int i = 0; i < 16; ++i)
+        snprintf(hex[i], 7, "%02x%02x%02x", palette->colors[i][0], palette->colors[i][1], palette->colors[i][2]);
+}
+
+struct i2p_palette_file {
+    PaletteFileReader reader{};
+};
+
+extern "C" i2p_palette_file* i2p_open_palette_file(const char* path) {
+    i2p_palette_file* file = new (std::nothrow) i2p_palette_file{};
+    if (!file)
+        return nullptr;
+    try {
+        if (OpenPaletteFile(file->reader, path))
+            return file;
+    } catch (...) {
+    }
+    delete file;
+    return nullptr;
+}
+
+extern "C" void i2p_close_palette_file(i2p_palette_file* file) {
+    if (!file)
+        return;
+    ClosePaletteFile(file->reader);
+    delete file;
+}
+
+extern "C" unsigned long long i2p_palette_file_count(const i2p_palette_file* file) {
+    return file->reader.recordCount;
+}
+
+extern "C" int i2p_palette_file_get(const i2p_palette_file* file, unsigned long long index, i2p_palette* palette) {
+    Base16Palette base16Palette{};
+    if (!GetPaletteRecord(file->reader, index, base16Palette))
+        return -1;
+    CopyPalette(base16Palette, palette);
+    return 0;
+}
+
+extern "C" int i2p_palette_file_find(const i2p_palette_file* file, unsigned long long hash, unsigned long long* index) {
+    return FindPaletteRecord(file->reader, hash, *index) ? 0 : -1;
+}
+
+extern "C" unsigned long long i2p_hash_content(const void* data, size_t size) {
+    return HashContent((const unsigned char*)data, size);
+}
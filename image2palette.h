@@ -0,0 +1,140 @@
+#ifndef IMAGE2PALETTE_H
+#define IMAGE2PALETTE_H
+
+//C interface of libimage2palette, everything the palette-generator CLI does for one image can be
+//done in process through it. There is no build system, the library is built by hand:
+//
+//  static:  g++ -O2 -std=c++17 -c image2palette.cpp -o image2palette.o && ar rcs libimage2palette.a image2palette.o
+//  shared:  g++ -O2 -std=c++17 -fPIC -shared image2palette.cpp -o libimage2palette.so -lpthread
+//  cli:     g++ -O2 -std=c++17 main.cpp image2palette.cpp -o palette-generator -lpthread
+//  bench:   g++ -O2 -std=c++17 benchmark.cpp image2palette.cpp -o palette-benchmark -lpthread
+//  throughput: g++ -O2 -std=c++17 throughput.cpp image2palette.cpp -o palette-throughput -lpthread
+//
+//C users of the static library also need to link the C++ runtime (-lstdc++ -lm -lpthread).
+//An extractor keeps its scratch buffers between calls, create one per thread and reuse it.
+//No C++ exception leaves these functions, running out of memory or threads returns NULL or -1.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct i2p_extractor i2p_extractor;
+typedef struct i2p_palette_file i2p_palette_file;
+
+typedef enum i2p_engine {
+    I2P_ENGINE_HISTOGRAM = 0,
+    I2P_ENGINE_OCTREE = 1,
+    I2P_ENGINE_KMEANS = 2
+} i2p_engine;
+
+typedef enum i2p_bins {
+    I2P_BINS_QUALITY = 0, //360 hues x 100 saturations x 100 brightnesses
+    I2P_BINS_FAST = 1 //72 x 32 x 32, histogram engine only
+} i2p_bins;
+
+typedef enum i2p_sample_type {
+    I2P_SAMPLE_UINT8 = 0,
+    I2P_SAMPLE_UINT16 = 1,
+    I2P_SAMPLE_FLOAT32 = 2 //Linear HDR values, tone mapped with exposure and reinhard
+} i2p_sample_type;
+
+typedef enum i2p_pixel_format {
+    I2P_FORMAT_GREY = 0,
+    I2P_FORMAT_GREY_ALPHA = 1,
+    I2P_FORMAT_RGB = 2,
+    I2P_FORMAT_RGBA = 3,
+    I2P_FORMAT_BGR = 4,
+    I2P_FORMAT_BGRA = 5
+} i2p_pixel_format;
+
+//A width or height of 0 extends the rectangle to the edge of the image
+typedef struct i2p_rect {
+    int x;
+    int y;
+    int width;
+    int height;
+} i2p_rect;
+
+//Pixels stay owned by the caller and are read in place
+typedef struct i2p_image {
+    const void* pixels;
+    int width;
+    int height;
+    size_t stride; //Bytes between two rows, 0 for tightly packed rows
+    i2p_pixel_format format;
+    i2p_sample_type type;
+    i2p_rect roi; //All zero for the whole image
+    const unsigned char* weights; //Optional, one byte per pixel of the whole image, histogram engine only
+    size_t weight_stride; //0 for width
+} i2p_image;
+
+typedef struct i2p_settings {
+    i2p_engine engine;
+    int color_count; //Octree leaves and k-means clusters, 1 to 512
+    unsigned int seed;
+    int thread_count;
+    float alpha_threshold; //Pixels with an alpha at or below this are skipped
+    float exposure; //In stops, only applies to float samples
+    int reinhard; //0 clamps float samples instead
+    i2p_bins bins;
+} i2p_settings;
+
+//base00 to base0F, RGB
+typedef struct i2p_palette {
+    unsigned char colors[16][3];
+} i2p_palette;
+
+void i2p_default_settings(i2p_settings* settings);
+
+//Returns NULL when the settings are out of range
+i2p_extractor* i2p_create(const i2p_settings* settings);
+void i2p_destroy(i2p_extractor* extractor);
+
+//Decodes an encoded image (PNG, JPEG, GIF first frame, PNM, HDR...), returns 0 on success and -1 otherwise
+int i2p_extract_memory(i2p_extractor* extractor, const void* data, size_t size, i2p_palette* palette);
+
+//Pixels are tightly packed rows of 1 (grey), 2 (grey, alpha), 3 (RGB) or 4 (RGBA) channels
+int i2p_extract_pixels(i2p_extractor* extractor, const void* pixels, int width, int height, int channels,
+    i2p_sample_type type, i2p_palette* palette);
+
+//Same for padded rows, BGR orders or a sub-rectangle, the region of interest must lie inside the image
+int i2p_extract_image(i2p_extractor* extractor, const i2p_image* image, i2p_palette* palette);
+
+//One palette per region of interest (up to 16) from a single pass over the pixels, histogram engine only.
+//The regions replace the image's own roi
+int i2p_extract_regions(i2p_extractor* extractor, const i2p_image* image, const i2p_rect* rois, int roi_count, i2p_palette* palettes);
+
+//Adds the selection profiles of a file to the built-in "dark", "light", "high-contrast" and "dark-truncated" ones.
+//One target per line, '#' starts a comment:
+//  <profile> <background|step|last-step|accents> <hue> <saturation> <brightness> <4 weights: hue saturation brightness popularity>
+//New profiles start as a copy of "dark". Nothing changes when the file is invalid
+int i2p_load_profiles(i2p_extractor* extractor, const char* path);
+
+//Profile used by the extract calls, "dark" by default. Profiles are compiled when loaded, switching is free
+int i2p_set_profile(i2p_extractor* extractor, const char* name);
+
+//Selects the palette of another profile from the colors found by the last single image extraction
+//without reading the pixels again
+int i2p_select_variant(i2p_extractor* extractor, const char* name, i2p_palette* palette);
+
+//Writes the 16 colors as "rrggbb" strings
+void i2p_palette_hex(const i2p_palette* palette, char hex[16][7]);
+
+//Binary palette files written by palette-generator --binary, mmapped where the platform allows.
+//Returns NULL when the file is missing or isn't a valid palette file
+i2p_palette_file* i2p_open_palette_file(const char* path);
+void i2p_close_palette_file(i2p_palette_file* file);
+unsigned long long i2p_palette_file_count(const i2p_palette_file* file);
+int i2p_palette_file_get(const i2p_palette_file* file, unsigned long long index, i2p_palette* palette);
+
+//Record of an image from the 64 bit FNV-1a hash of its encoded bytes, for files written with --binary-hashes
+int i2p_palette_file_find(const i2p_palette_file* file, unsigned long long hash, unsigned long long* index);
+unsigned long long i2p_hash_content(const void* data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,653 @@
+#ifndef IMAGE2PALETTE_HPP
+#define IMAGE2PALETTE_HPP
+
+//C++ side of libimage2palette, shared by the library and the palette-generator CLI.
+//The stable interface for other languages is the C one in image2palette.h.
+
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <ctime>
+
+#define HUE_VALUE_COUNT 360
+#define SATURATION_VALUE_COUNT 100
+#define BRIGHTNESS_VALUE_COUNT 100
+
+#define MAX_REGION_COUNT 16
+#define WEIGHT_UNIT 255
+
+#define SELECTION_PLAN_MAX_STEPS 16
+
+#define PHASE_COUNT 5
+#define PERF_COUNTER_COUNT 5
+
+#define PALETTE_SINK_BUFFER_SIZE (1 << 20)
+
+#define PALETTE_FORMAT_COUNT 6
+
+#define PALETTE_FILE_VERSION 1
+#define PALETTE_FILE_HEADER_SIZE 32
+#define PALETTE_RECORD_SIZE 48
+#define PALETTE_HASH_ENTRY_SIZE 16
+#define PALETTE_FILE_HAS_HASHES 1
+
+#define PALETTE_INDEX_VERSION 1
+#define PALETTE_INDEX_HEADER_SIZE 64
+#define PALETTE_FEATURE_SIZE 48
+#define PALETTE_FEATURE_SCALE 254.0f
+#define PALETTE_INDEX_MAX_LISTS 4096
+#define PALETTE_INDEX_TRAINING_FACTOR 64
+#define PALETTE_INDEX_ITERATIONS 8
+#define PALETTE_INDEX_DEFAULT_PROBES 8
+#define PALETTE_INDEX_RETRAIN_FACTOR 4
+
+#define OCTREE_DEPTH 8
+#define OCTREE_MAX_COLORS 64
+#define OCTREE_NODE_BUDGET 4096
+
+enum class SampleType {
+    UInt8,
+    UInt16,
+    Float32
+};
+
+enum class PixelFormat {
+    Grey,
+    GreyAlpha,
+    RGB,
+    RGBA,
+    BGR,
+    BGRA
+};
+
+enum class FrameMode {
+    First,
+    Aggregate,
+    Each
+};
+
+enum class Engine {
+    Histogram,
+    Octree,
+    KMeans
+};
+
+//Bins of the histogram engine, hue x saturation x brightness
+enum class BinResolution {
+    Quality, //360 x 100 x 100
+    Fast //72 x 32 x 32, the histogram fits in L2
+};
+
+//Decode and Output are timed by the caller, the extractor times the rest.
+//The octree and k-means engines build their keys as they go, all of it counts as Accumulate
+enum class Phase {
+    Decode,
+    Accumulate,
+    Keys,
+    Selection,
+    Output
+};
+
+enum class PaletteFormat {
+    Json,
+    Html,
+    Yaml, //base16 scheme
+    Xresources,
+    Css, //Custom properties on :root
+    Ansi //24 bit terminal preview
+};
+
+enum class PerfCounter {
+    Cycles,
+    Instructions,
+    BranchMisses,
+    L1DMisses,
+    LLCMisses
+};
+
+//Hardware counters of the thread that opened them, workers aren't counted.
+//Counters the kernel refuses stay closed at -1, in containers that's often all of them
+struct PerfCounters {
+    int fds[PERF_COUNTER_COUNT]{ -1, -1, -1, -1, -1 };
+};
+
+//Accumulated over every timed call until cleared
+struct PhaseTimings {
+    double wallSeconds[PHASE_COUNT]{};
+    double cpuSeconds[PHASE_COUNT]{}; //Process CPU time, includes the k-means workers
+    const PerfCounters* counters{ nullptr }; //Optional, read around every phase
+    double counterValues[PHASE_COUNT][PERF_COUNTER_COUNT]{};
+};
+
+struct PhaseTimer {
+    std::chrono::steady_clock::time_point wallStart{};
+    std::clock_t cpuStart{};
+    double counterStart[PERF_COUNTER_COUNT]{};
+};
+
+struct SelectionPlan;
+
+struct ExtractionSettings {
+    Engine engine{ Engine::Histogram };
+    int colorCount{ OCTREE_MAX_COLORS };
+    unsigned int seed{ 1 };
+    int threadCount{ 1 };
+    BinResolution binResolution{ BinResolution::Quality };
+    const SelectionPlan* selectionPlan{ nullptr }; //Copied by the extractor, nullptr for "dark"
+};
+
+struct HdrToneMap {
+    float exposure{ 1.0f }; //Linear multiplier applied before the curve
+    bool reinhard{ true };
+};
+
+struct ImageRect {
+    int x{};
+    int y{};
+    int width{}; //0 means up to the right edge
+    int height{}; //0 means up to the bottom edge
+};
+
+//Describes pixels owned by the caller, nothing is copied
+struct ImageView {
+    const void* data{ nullptr };
+    SampleType type{ SampleType::UInt8 };
+    int width{};
+    int height{};
+    PixelFormat format{ PixelFormat::RGB };
+    size_t stride{}; //Bytes between the start of two rows, 0 means tightly packed
+    ImageRect roi{}; //Only pixels inside are visited, clipped to the image
+    const unsigned char* weights{ nullptr }; //Optional per-pixel weights over the whole image, 0 ignores the pixel
+    size_t weightStride{}; //0 means width
+    HdrToneMap toneMap{};
+    float alphaThreshold{}; //Pixels with an alpha at or below this are skipped
+};
+
+struct ColorHSL {
+    unsigned int hue{};
+    unsigned int saturation{};
+    unsigned int brightness{};
+};
+
+struct Color {
+    unsigned char r{};
+    unsigned char g{};
+    unsigned char b{};
+};
+
+template<typename T>
+struct Scored {
+    float score{};
+    T data{};
+};
+
+struct Base16Palette {
+    Color primary[8]{};
+    Color accents[8]{};
+};
+
+struct KeyHS {
+    int population{};
+    float hue{};
+    float saturation{};
+};
+
+struct KeyL {
+    int population{};
+    float brightness{};
+    int keyHSBegin{}; //Range of this key's KeyHS in PaletteKeys::keyHSs
+    int keyHSEnd{};
+};
+
+//KeyHS are stored flat so reusing a PaletteKeys between images doesn't allocate
+struct PaletteKeys {
+    std::vector<KeyL> keyLs{};
+    std::vector<KeyHS> keyHSs{};
+};
+
+//Engine output before grouping by brightness
+struct ColorKey {
+    int keyLIdx{};
+    int brightness{};
+    KeyHS keyHS{};
+};
+
+struct MatchTarget {
+    int hue{};
+    int saturation{};
+    int brightness{};
+    float hueWeight{};
+    float saturationWeight{};
+    float brightnessWeight{};
+    float popularityWeight{};
+};
+
+//Targets of the base16 selection, running it again over the same keys is cheap
+struct SelectionProfile {
+    std::string name{};
+    MatchTarget background{}; //base00, absolute
+    MatchTarget step{}; //base01 to base04, relative to the previous color, signed brightness
+    MatchTarget lastStep{}; //base05, same as step
+    MatchTarget accents{}; //base06 to base0F, absolute
+};
+
+//One scoring pass over the keys, its best picks fill consecutive palette slots
+struct ScoringStep {
+    MatchTarget target{};
+    int reference{ -1 }; //Step whose best pick the targets are relative to, -1 for absolute targets
+    int slot{}; //0 to 15 for base00 to base0F
+    int count{ 1 };
+};
+
+//A profile compiled once into the scoring passes, in the order they run
+struct SelectionPlan {
+    std::string name{};
+    ScoringStep steps[SELECTION_PLAN_MAX_STEPS]{};
+    int stepCount{};
+};
+
+struct ExtractionStats {
+    long long population{}; //Pixels that took part, transparent ones excluded
+    size_t scratchBytes{};
+};
+
+//Compact JSON lines, one object per image, gathered in a large buffer that is written out in one call once full
+struct PaletteSink {
+    FILE* file{ nullptr }; //Unbuffered unless stdout, the sink's buffer is the only one
+    std::vector<char> buffer{};
+    size_t used{};
+    bool failed{};
+    bool flushEachLine{}; //For streams, a line is written as soon as it's appended
+};
+
+//Every field of one palette formatted once, each format is then a copy of its template with the fields
+//spliced in. The buffer grows to the largest render and is reused as is
+struct PaletteRenderer {
+    char hex[16][6]{}; //"rrggbb"
+    char rgb[16][11]{}; //"r;g;b" in decimal
+    unsigned char rgbSize[16]{};
+    std::vector<char> buffer{};
+    size_t used{};
+};
+
+//Binary palettes for bulk readers, little endian and meant to be mmapped:
+//  header   "I2PB", u16 version, u16 flags, u64 record count, u64 records offset, u64 hashes offset (0 without)
+//  records  48 bytes each, base00 to base0F as RGB, record i is the i-th palette appended
+//  hashes   with PALETTE_FILE_HAS_HASHES, (u64 content hash, u64 record index) pairs sorted by hash
+struct PaletteFileWriter {
+    FILE* file{ nullptr };
+    std::vector<std::pair<unsigned long long, unsigned long long>> hashes{};
+    unsigned long long recordCount{};
+    bool withHashes{};
+    bool failed{};
+};
+
+struct PaletteFileReader {
+    const unsigned char* data{ nullptr };
+    size_t size{};
+    unsigned long long recordCount{};
+    const unsigned char* records{ nullptr };
+    const unsigned char* hashes{ nullptr }; //nullptr without a hash section
+    bool mapped{};
+    std::vector<unsigned char> storage{}; //The whole file where mmap isn't available
+};
+
+//base00 to base0F in OKLab, L centered on 0.5, every channel scaled by PALETTE_FEATURE_SCALE and clamped to int8.
+//The scale is shared so squared differences stay a euclidean OKLab distance
+struct PaletteFeature {
+    signed char values[PALETTE_FEATURE_SIZE]{};
+};
+
+//Inverted file of palette features, little endian and meant to be mmapped:
+//  header     "I2PX", u16 version, u16 0, u32 list count, u32 entries the lists were trained on, u64 entry count, then u64 offsets of
+//             the centroids, lists, features, ids and paths sections
+//  centroids  list count features, the k-means centers the entries are bucketed by
+//  lists      list count + 1 u64, list i holds the entries from lists[i] to lists[i + 1]
+//  features   entry count features, grouped by list
+//  ids        u32 per entry, its position in the batch and in the path table
+//  paths      entry count + 1 u64 offsets into the nul terminated strings that follow
+struct PaletteIndex {
+    const unsigned char* data{ nullptr };
+    size_t size{};
+    unsigned long long entryCount{};
+    int listCount{};
+    unsigned long long trainedCount{};
+    const signed char* centroids{ nullptr };
+    const unsigned char* lists{ nullptr };
+    const signed char* features{ nullptr };
+    const unsigned char* ids{ nullptr };
+    const unsigned char* pathOffsets{ nullptr };
+    const char* paths{ nullptr };
+    unsigned long long pathsSize{};
+    bool mapped{};
+    std::vector<unsigned char> storage{}; //The whole file where mmap isn't available
+};
+
+struct PaletteMatch {
+    unsigned int id{};
+    int distance{}; //Squared, in quantized feature units
+};
+
+struct HistogramBin {
+    long long population{};
+    long long saturation{}; //Sum of the saturation indices, divided by population gives the mean
+};
+
+struct ColorHistogram {
+    long long population{};
+    std::vector<HistogramBin> bins{}; //Brightness + 1 rows of hue bins, counts depend on the resolution
+    BinResolution resolution{};
+    int dirtyBegin{}; //Rows outside [dirtyBegin, dirtyEnd) are known to be zero
+    int dirtyEnd{};
+    int unit{ 1 }; //Population of one pixel, WEIGHT_UNIT once weights are applied
+};
+
+struct OctreeNode {
+    unsigned long long r{};
+    unsigned long long g{};
+    unsigned long long b{};
+    int population{};
+    int children[8]{}; //0 means no child, the root is never a child
+    int nextReducible{};
+    bool leaf{};
+};
+
+struct Octree {
+    std::vector<OctreeNode> nodes{};
+    std::vector<int> freeNodes{};
+    int reducibleNodes[OCTREE_DEPTH]{}; //Linked list heads per level, 0 means empty
+    int leafCount{};
+    int usedNodes{}; //Nodes past this index were never handed out since the last reset
+};
+
+struct KMeansPoints {
+    std::vector<float> l{};
+    std::vector<float> a{};
+    std::vector<float> b{};
+};
+
+struct KMeansScratch {
+    KMeansPoints samples{};
+    KMeansPoints batch{};
+    KMeansPoints centers{};
+    KMeansPoints previousCenters{};
+    std::vector<int> labels{};
+    std::vector<int> populations{};
+    std::vector<float> distances{};
+};
+
+//Threads are started once and parked between jobs, the calling thread always runs worker 0
+struct WorkerPool {
+    std::vector<std::thread> threads{};
+    std::mutex mutex{};
+    std::condition_variable condition{};
+    void (*task)(void* context, int workerIdx){ nullptr };
+    void* context{ nullptr };
+    int generation{};
+    int pending{};
+    int traceImage{ -1 }; //Of the thread running the pool, tags the workers' events
+    bool stopping{};
+};
+
+struct SlidingHistogram {
+    ColorHistogram total{};
+    std::deque<ColorHistogram> frames{};
+};
+
+struct PnmStream {
+    FILE* file{ nullptr };
+    std::vector<char> pending{};
+    size_t pendingOffset{};
+};
+
+int GetChannelCount(PixelFormat format);
+int GetSampleSize(SampleType type);
+PixelFormat GetPixelFormat(int channels);
+ImageRect GetImageRegion(const ImageView& image);
+
+const char* GetEngineName(Engine engine);
+bool ParseEngine(const char* name, Engine& engine);
+float GetColorBrightness(float r, float g, float b);
+float GetColorSaturation(float r, float g, float b);
+float GetColorHUE(float r, float g, float b);
+Color Hsl2Rgb(const ColorHSL& hslColor);
+void GetMatchingDiffColor(const PaletteKeys& keys, std::vector<Scored<ColorHSL>>& scoredColors,
+    ColorHSL refColor, int t0 /*HUE*/, int t1 /*Saturation*/, int t2 /*Brightness*/, float w0, float w1, float w2, float w3, bool signedBrightness);
+void GetMatchingColor(const PaletteKeys& keys, std::vector<Scored<ColorHSL>>& scoredColors,
+    int t0 /*HUE*/, int t1 /*Saturation*/, int t2 /*Brightness*/, float w0, float w1, float w2, float w3);
+
+bool ParseBinResolution(const char* name, BinResolution& resolution);
+const char* GetPhaseName(Phase phase);
+
+//Returns false when no counter could be opened, errno tells why
+bool OpenPerfCounters(PerfCounters& counters);
+void ClosePerfCounters(PerfCounters& counters);
+const char* GetPerfCounterName(PerfCounter counter);
+//Closed counters read 0, multiplexed ones are scaled to the time they were enabled
+void ReadPerfCounters(const PerfCounters& counters, double (&values)[PERF_COUNTER_COUNT]);
+
+//Chrome trace events of every phase and worker pool task, in per-thread buffers.
+//Thread 1 is the one that started tracing. Starting again drops the events traced so far,
+//StartTracing and WriteTrace must run while no other thread is traced
+void StartTracing();
+bool IsTracing();
+//Tags the following events of the calling thread and of the pool tasks it runs, name is optional
+void SetTraceImage(int image, const char* name);
+void TraceSpan(const char* name, const char* category, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+bool WriteTrace(const char* path);
+
+//Both are no-ops without timings unless tracing, StopPhase restarts the timer so phases can be chained
+void StartPhase(PhaseTimer& timer, const PhaseTimings* timings);
+void StopPhase(PhaseTimer& timer, PhaseTimings* timings, Phase phase);
+bool ParseFrameMode(const char* name, FrameMode& mode);
+
+void ResetHistogram(ColorHistogram& histogram, BinResolution resolution);
+void ClearHistogram(ColorHistogram& histogram, BinResolution resolution);
+void AccumulateHistogram(const ImageView& image, ColorHistogram& histogram);
+void AccumulateRegionHistograms(const ImageView& image, const ImageRect* regions, int regionCount, ColorHistogram* histograms);
+void MergeHistogram(ColorHistogram& histogram, const ColorHistogram& other);
+void SubtractHistogram(ColorHistogram& histogram, const ColorHistogram& other);
+void ParallelAccumulateHistogram(const ImageView& image, WorkerPool& pool, std::vector<ColorHistogram>& bandHistograms, ColorHistogram& histogram);
+void PushSlidingHistogram(SlidingHistogram& window, int windowSize, const ImageView& image, WorkerPool& pool, std::vector<ColorHistogram>& bandHistograms);
+
+void ExtractKeysFromHistogram(const ColorHistogram& histogram, PaletteKeys& keys);
+ExtractionStats ExtractKeysHistogram(const ImageView& image, BinResolution resolution, WorkerPool& pool, std::vector<ColorHistogram>& bandHistograms,
+    ColorHistogram& histogram, PaletteKeys& keys, PhaseTimings* timings = nullptr);
+ExtractionStats ExtractKeysOctree(const ImageView& image, int colorCount, Octree& octree, std::vector<ColorKey>& colorKeys, PaletteKeys& keys);
+ExtractionStats ExtractKeysKMeans(const ImageView& image, const ExtractionSettings& settings, KMeansScratch& scratch, WorkerPool& pool,
+    std::vector<ColorKey>& colorKeys, PaletteKeys& keys);
+
+void StartWorkerPool(WorkerPool& pool, int threadCount);
+void StopWorkerPool(WorkerPool& pool);
+int GetWorkerCount(const WorkerPool& pool);
+void RunWorkerPool(WorkerPool& pool, void (*task)(void* context, int workerIdx), void* context);
+
+void GetSelectionProfiles(std::vector<SelectionProfile>& profiles);
+bool LoadSelectionProfiles(const char* path, std::vector<SelectionProfile>& profiles);
+bool FindSelectionProfile(const std::vector<SelectionProfile>& profiles, const char* name, SelectionProfile& profile);
+void CompileSelectionPlan(const SelectionProfile& profile, SelectionPlan& plan);
+const SelectionPlan& GetDefaultSelectionPlan();
+//scores, when given, receives the score of the color picked for each of the 16 slots, 0 for slots left empty
+void SelectBase16Palette(const PaletteKeys& keys, const SelectionPlan& plan, std::vector<Scored<ColorHSL>>& scoredColors, Base16Palette& palette,
+    float* scores = nullptr);
+void SetRendererPalette(PaletteRenderer& renderer, const Base16Palette& palette);
+//Valid until the next render with the same renderer
+const char* RenderPalette(PaletteRenderer& renderer, PaletteFormat format, size_t& size);
+//"-" writes to stdout
+bool WritePaletteFormat(PaletteRenderer& renderer, PaletteFormat format, const char* path);
+const char* GetPaletteFormatName(PaletteFormat format);
+void WriteJsonPalette(const Base16Palette& palette, const char* path);
+//"-" writes to stdout, which is flushed but never closed
+bool OpenPaletteSink(PaletteSink& sink, const char* path);
+//{"path":...,"base00":"rrggbb",...,"base0F":...} plus "population" and "scratch_bytes" when stats are given
+void AppendPaletteLine(PaletteSink& sink, const char* imagePath, const Base16Palette& palette, const ExtractionStats* stats = nullptr);
+//{"frame":...,"latency_ms":...,"base00":"rrggbb",...,"base0F":...}, one line per streamed frame
+void AppendFrameLine(PaletteSink& sink, int frame, double latency, const Base16Palette& palette);
+bool FlushPaletteSink(PaletteSink& sink);
+//Flushes, false when any write failed along the way
+bool ClosePaletteSink(PaletteSink& sink);
+
+//64 bit FNV-1a of the encoded image, what the hash section of a palette file is keyed by
+unsigned long long HashContent(const unsigned char* data, size_t size);
+bool HashFile(const char* path, unsigned long long& hash);
+bool OpenPaletteFileWriter(PaletteFileWriter& writer, const char* path, bool withHashes);
+void AppendPaletteRecord(PaletteFileWriter& writer, const Base16Palette& palette, unsigned long long contentHash = 0);
+//Writes the hash section and the final header, false when any write failed
+bool ClosePaletteFileWriter(PaletteFileWriter& writer);
+//Checks the header and that every section fits in the file
+bool OpenPaletteFile(PaletteFileReader& reader, const char* path);
+void ClosePaletteFile(PaletteFileReader& reader);
+bool GetPaletteRecord(const PaletteFileReader& reader, unsigned long long index, Base16Palette& palette);
+//Binary search of the hash section, false when there is none or the hash isn't in it
+bool FindPaletteRecord(const PaletteFileReader& reader, unsigned long long contentHash, unsigned long long& index);
+void GetPaletteFeature(const Base16Palette& palette, PaletteFeature& feature);
+//About sqrt(n) lists trained on a sample of the features, paths[i] belongs to features[i]
+bool WritePaletteIndex(const char* path, const std::vector<PaletteFeature>& features, const std::vector<std::string>& paths, unsigned int seed);
+//Adds to the index at path, or builds it when there is none. New entries go to the nearest existing list and paths already
+//indexed get their new palette. The lists are trained again once the index outgrows PALETTE_INDEX_RETRAIN_FACTOR times
+//the entries they were trained on
+bool UpdatePaletteIndex(const char* path, const std::vector<PaletteFeature>& features, const std::vector<std::string>& paths, unsigned int seed);
+//An index without entries opens, FindNearestPalettes returns no matches on it
+bool OpenPaletteIndex(PaletteIndex& index, const char* path);
+void ClosePaletteIndex(PaletteIndex& index);
+//Scans the probes lists closest to the query, matches are sorted by distance. probes 0 uses PALETTE_INDEX_DEFAULT_PROBES
+void FindNearestPalettes(const PaletteIndex& index, const PaletteFeature& query, int count, int probes, std::vector<PaletteMatch>& matches);
+//nullptr when the id is out of range
+const char* GetPaletteIndexPath(const PaletteIndex& index, unsigned int id);
+void WriteHtmlPalette(const Base16Palette& palette, const char* path);
+void PrintKeys(const PaletteKeys& keys, int totalPopulation);
+
+//Owns the scratch buffers of every engine and of the selection. Once warmed up by a first image,
+//extracting from images no larger than the biggest one seen so far doesn't allocate
+class PaletteExtractor {
+public:
+    explicit PaletteExtractor(const ExtractionSettings& settings)
+        : settings{ settings }, plan{ settings.selectionPlan ? *settings.selectionPlan : GetDefaultSelectionPlan() } {
+        StartWorkerPool(pool, settings.engine == Engine::Octree ? 1 : settings.threadCount);
+    }
+
+    ~PaletteExtractor() {
+        StopWorkerPool(pool);
+    }
+
+    PaletteExtractor(const PaletteExtractor&) = delete;
+    PaletteExtractor& operator=(const PaletteExtractor&) = delete;
+
+    ExtractionStats extractKeys(const ImageView& image) {
+        PhaseTimer timer{};
+        StartPhase(timer, timings);
+        ExtractionStats stats{};
+        switch (settings.engine) {
+            case Engine::Octree:
+                stats = ExtractKeysOctree(image, settings.colorCount, octree, colorKeys, keys);
+                break;
+            case Engine::KMeans:
+                stats = ExtractKeysKMeans(image, settings, kmeans, pool, colorKeys, keys);
+                break;
+            default:
+                return ExtractKeysHistogram(image, settings.binResolution, pool, bandHistograms, histogram, keys, timings);
+        }
+        StopPhase(timer, timings, Phase::Accumulate);
+        return stats;
+    }
+
+    ExtractionStats extract(const ImageView& image, Base16Palette& palette) {
+        ExtractionStats stats = extractKeys(image);
+        select(plan, palette);
+        return stats;
+    }
+
+    //For histograms accumulated elsewhere, e.g. over several frames
+    ExtractionStats extract(const ColorHistogram& colorHistogram, Base16Palette& palette) {
+        PhaseTimer timer{};
+        StartPhase(timer, timings);
+        ExtractKeysFromHistogram(colorHistogram, keys);
+        StopPhase(timer, timings, Phase::Keys);
+        select(plan, palette);
+
+        ExtractionStats stats{};
+        stats.population = colorHistogram.population / colorHistogram.unit;
+        return stats;
+    }
+
+    //Adds a frame to the window and drops the oldest past windowSize, with the same workers as extract
+    void pushFrame(SlidingHistogram& window, int windowSize, const ImageView& image) {
+        PushSlidingHistogram(window, windowSize, image, pool, bandHistograms);
+    }
+
+    //One pixel pass fills a histogram per region, histogram engine only
+    void extractRegions(const ImageView& image, const ImageRect* regions, int regionCount, Base16Palette* palettes) {
+        PhaseTimer timer{};
+        StartPhase(timer, timings);
+        if (regionHistograms.size() < regionCount)
+            regionHistograms.resize(regionCount);
+        for (int i = 0; i < regionCount; ++i)
+            ClearHistogram(regionHistograms[i], settings.binResolution);
+
+        AccumulateRegionHistograms(image, regions, regionCount, regionHistograms.data());
+        StopPhase(timer, timings, Phase::Accumulate);
+        for (int i = 0; i < regionCount; ++i)
+            extract(regionHistograms[i], palettes[i]);
+    }
+
+    //Plan of the extract calls, "dark" by default
+    void setSelectionPlan(const SelectionPlan& selectionPlan) {
+        plan = selectionPlan;
+    }
+
+    //Another palette from the keys of the last extraction
+    void select(const SelectionPlan& selectionPlan, Base16Palette& palette) {
+        PhaseTimer timer{};
+        StartPhase(timer, timings);
+        SelectBase16Palette(keys, selectionPlan, scoredColors, palette, scores);
+        StopPhase(timer, timings, Phase::Selection);
+    }
+
+    //Of the last selection, for reports
+    const float* getScores() const {
+        return scores;
+    }
+
+    //Phases of the following calls are added to these, nullptr stops timing
+    void setTimings(PhaseTimings* phaseTimings) {
+        timings = phaseTimings;
+    }
+
+    const PaletteKeys& getKeys() const {
+        return keys;
+    }
+
+private:
+    ExtractionSettings settings{};
+    ColorHistogram histogram{};
+    std::vector<ColorHistogram> regionHistograms{};
+    std::vector<ColorHistogram> bandHistograms{};
+    Octree octree{};
+    KMeansScratch kmeans{};
+    WorkerPool pool{};
+    std::vector<ColorKey> colorKeys{};
+    PaletteKeys keys{};
+    std::vector<Scored<ColorHSL>> scoredColors{};
+    SelectionPlan plan{ GetDefaultSelectionPlan() };
+    float scores[16]{};
+    PhaseTimings* timings{ nullptr };
+};
+
+bool LoadImageFile(const char* path, ImageView& image);
+bool LoadImageMemory(const unsigned char* buffer, int length, ImageView& image);
+bool LoadPnmStreamFrame(PnmStream& stream, ImageView& image);
+bool LoadWeightMask(const char* path, int width, int height, std::vector<unsigned char>& weights);
+void BuildCenterWeightMask(int width, int height, std::vector<unsigned char>& weights);
+void FreeImage(ImageView& image);
+
+bool IsGifMemory(const unsigned char* buffer, int length);
+//In Aggregate mode keys and stats, when given, receive those of the histogram merged over every frame
+bool ExtractGifPalettes(const unsigned char* buffer, int length, const ExtractionSettings& settings, FrameMode mode, float alphaThreshold, std::vector<Base16Palette>& palettes,
+    PaletteKeys* keys = nullptr, ExtractionStats* stats = nullptr);
+
+#endif
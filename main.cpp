@@ -1,536 +1,691 @@
 #include <iostream>
 #include <cstring>
+#include <cerrno>
 #include <fstream>
 #include <cmath>
-#include <algorithm>
+#include <chrono>
+#include <string>
 #include <vector>
+#include <algorithm>
+
+#include "image2palette.hpp"
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
+#define MAX_VARIANT_COUNT 8
 
-#define HUE_VALUE_COUNT 360
-#define SATURATION_VALUE_COUNT 100
-#define BRIGHTNESS_VALUE_COUNT 100
+//Quiet only prints what was asked for (timings, counters), Verbose adds the key dump.
+//Batches and streams default to Quiet, single images to Normal
+enum class Verbosity {
+    Quiet,
+    Normal,
+    Verbose
+};
 
 struct Options {
     const char* inputImage{ nullptr };
+    const char* batchList{ nullptr };
     const char* outputJsonPalette{ nullptr };
     const char* outputHtmlPalette{ nullptr };
+    const char* outputYamlPalette{ nullptr };
+    const char* outputXresources{ nullptr };
+    const char* outputCssPalette{ nullptr };
+    const char* outputAnsiPalette{ nullptr };
+    const char* engine{ nullptr };
+    const char* bins{ nullptr };
+    const char* frames{ nullptr };
+    const char* weights{ nullptr };
+    ImageRect regions[MAX_REGION_COUNT]{};
+    int regionCount{};
+    bool invalidRegion{};
+    const char* profiles{ nullptr };
+    const char* profile{ nullptr };
+    const char* variants{ nullptr };
+    float exposure{};
+    const char* toneMap{ nullptr };
+    float alphaThreshold{};
+    int streamWindow{};
+    float latencyTarget{};
+    int colorCount{ OCTREE_MAX_COLORS };
+    unsigned int seed{ 1 };
+    int threadCount{ 1 };
+    int benchmarkRuns{};
+    bool timings{};
+    bool perfCounters{};
+    const char* trace{ nullptr };
+    const char* report{ nullptr };
+    const char* jsonLines{ nullptr };
+    const char* binary{ nullptr };
+    bool binaryHashes{};
+    const char* convert{ nullptr };
+    const char* index{ nullptr };
+    const char* query{ nullptr };
+    int nearestCount{ 10 };
+    int probes{};
+    Verbosity verbosity{ Verbosity::Normal };
+    bool verbositySet{};
 };
 
-struct ColorHSL {
-    unsigned int hue{};
-    unsigned int saturation{};
-    unsigned int brightness{};
-};
+void RunBenchmark(const ImageView& image, const ExtractionSettings& settings, int runs) {
+    PaletteExtractor extractor{ settings };
+    ExtractionStats stats{};
 
-struct Color {
-    unsigned char r{};
-    unsigned char g{};
-    unsigned char b{};
-};
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; ++i)
+        stats = extractor.extractKeys(image);
+    auto end = std::chrono::steady_clock::now();
 
-template<typename T>
-struct Scored {
-    int score{};
-    T data{};
-};
-
-struct Base16HSLPalette {
-    ColorHSL primary[8]{};
-    ColorHSL accents[8]{};
-};
+    double seconds = std::chrono::duration<double>(end - start).count();
+    double megapixels = (double)image.width * image.height * runs / 1000000.0;
+    printf("Engine %s: %.2f ms/image, %.1f MP/s, %.1f KB scratch, %d keys\n", GetEngineName(settings.engine),
+        seconds * 1000.0 / runs, megapixels / seconds, stats.scratchBytes / 1024.0, (int)extractor.getKeys().keyLs.size());
+}
 
-struct Base16Palette {
-    Color primary[8]{};
-    Color accents[8]{};
-};
+size_t GetDecodedByteCount(const ImageView& image) {
+    return (size_t)image.width * image.height * GetChannelCount(image.format) * GetSampleSize(image.type);
+}
 
-struct KeyHS {
-    int population{};
-    float hue{};
-    float saturation{};
-};
+double GetTotalSeconds(const double (&seconds)[PHASE_COUNT]) {
+    double total = 0.0;
+    for (double phaseSeconds : seconds)
+        total += phaseSeconds;
+    return total;
+}
 
-struct KeyL {
-    int population{};
-    float brightness{};
-    std::vector<KeyHS> keyHSs{};
-};
+void PrintTimings(const PhaseTimings& timings, long long pixels, size_t decodedBytes) {
+    double wallSeconds = GetTotalSeconds(timings.wallSeconds);
+    double decodeSeconds = timings.wallSeconds[(int)Phase::Decode];
 
-float GetMinChannelValue(float r, float g, float b) {
-    r = r < g ? r : g;
-    return r < b ? r : b;
+    printf("Timings:\n");
+    for (int i = 0; i < PHASE_COUNT; ++i)
+        printf("  %-10s %10.3f ms wall %10.3f ms cpu\n", GetPhaseName((Phase)i), timings.wallSeconds[i] * 1000.0, timings.cpuSeconds[i] * 1000.0);
+    printf("  %-10s %10.3f ms wall %10.3f ms cpu\n", "total", wallSeconds * 1000.0, GetTotalSeconds(timings.cpuSeconds) * 1000.0);
+    printf("  %.1f MP/s, %.1f MB/s decoded\n", pixels / 1000000.0 / wallSeconds, decodeSeconds > 0.0 ? decodedBytes / 1000000.0 / decodeSeconds : 0.0);
 }
 
-float GetMaxChannelValue(float r, float g, float b) {
-    r = r > g ? r : g;
-    return r > b ? r : b;
+FILE* OpenReport(const Options& options) {
+    if (!options.report)
+        return nullptr;
+    FILE* report = fopen(options.report, "w");
+    if (!report)
+        std::cerr << "Couldn't write the report \"" << options.report << "\"." << std::endl;
+    return report;
 }
 
-float GetColorBrightness(float r, float g, float b) {
-    return std::clamp((r * 0.299f) + (g * 0.587f) + (b * 0.114f), 0.0f, 1.0f);
+bool CloseReport(const Options& options, FILE* report) {
+    if (fclose(report) != 0) {
+        std::cerr << "Couldn't write the report \"" << options.report << "\"." << std::endl;
+        return false;
+    }
+    if (options.verbosity >= Verbosity::Normal)
+        std::cout << "Writing report to \"" << options.report << "\".\n";
+    return true;
 }
 
-float GetColorSaturation(float r, float g, float b) {
-    float min = GetMinChannelValue(r, g, b) / 255.0;
-    float max = GetMaxChannelValue(r, g, b) / 255.0;
+bool CloseJsonLines(const Options& options, PaletteSink& sink) {
+    if (!ClosePaletteSink(sink)) {
+        std::cerr << "Couldn't write \"" << options.jsonLines << "\"." << std::endl;
+        return false;
+    }
+    if (options.verbosity >= Verbosity::Normal && strcmp(options.jsonLines, "-") != 0)
+        std::cout << "Writing JSON lines to \"" << options.jsonLines << "\".\n";
+    return true;
+}
 
-    if (!max) //Color is black so saturation is 0
-        return 0;
+bool OpenBinaryOutput(const Options& options, PaletteFileWriter& writer) {
+    if (!OpenPaletteFileWriter(writer, options.binary, options.binaryHashes)) {
+        std::cerr << "Couldn't write \"" << options.binary << "\"." << std::endl;
+        return false;
+    }
+    return true;
+}
 
-    float l = max - min;
+//The hash is of the encoded file, read a second time from the page cache
+void AppendBinaryOutput(const Options& options, PaletteFileWriter& writer, const char* path, const Base16Palette& palette) {
+    unsigned long long hash = 0;
+    if (options.binaryHashes && !HashFile(path, hash))
+        hash = 0;
+    AppendPaletteRecord(writer, palette, hash);
+}
 
-    if (l <= 0.5)
-        return l / (max + min);
-    return std::clamp(l / (2 - max - min), 0.0f, 1.0f);
+bool CloseBinaryOutput(const Options& options, PaletteFileWriter& writer) {
+    if (!ClosePaletteFileWriter(writer)) {
+        std::cerr << "Couldn't write \"" << options.binary << "\"." << std::endl;
+        return false;
+    }
+    if (options.verbosity >= Verbosity::Normal)
+        std::cout << "Writing binary palettes to \"" << options.binary << "\".\n";
+    return true;
 }
 
-float GetColorHUE(float r, float g, float b) {
-    r /= 255.0;
-    g /= 255.0;
-    b /= 255.0;
-    
-    float min = GetMinChannelValue(r, g, b);
-    float max = GetMaxChannelValue(r, g, b);
+//Binary palette file back to JSON lines, {"record":i,"content_hash":"...",base00...base0F}, on stdout without --jsonl
+int ConvertPaletteFile(const Options& options) {
+    PaletteFileReader reader{};
+    if (!OpenPaletteFile(reader, options.convert)) {
+        std::cerr << "\"" << options.convert << "\" isn't a palette file." << std::endl;
+        return -1;
+    }
 
-    if (max == 0 || max == min)
-        return 0;
-    
-    float v = 0;
-
-    if (b == max)
-        v = 4.0 + (r - g) / (max - min);
-    if (g == max)
-        v = 2.0 + (b - r) / (max - min);
-    if (r == max)
-        v = (g - b) / (max - min);
-    
-    v *= 60;
-    v = v < 0 ? v + 360 : v;
-
-    return std::clamp(v, 0.0f, 360.0f);
-}
-
-float HueToRgb(float p, float q, float t) {
-    if (t < 0.0f) t += 1;
-    if (t > 1.0f) t -= 1;
-    if (t < 1.0f/6.0f) return p + (q - p) * 6.0f * t;
-    if (t < 1.0f/2.0f) return q;
-    if (t < 2.0f/3.0f) return p + (q - p) * (2.0f/3.0f - t) * 6.0f;
-    return p;
-}
-
-Color Hsl2Rgb(const ColorHSL& hslColor) {
-    float h = (float)hslColor.hue / (float)HUE_VALUE_COUNT;
-    float s = (float)hslColor.saturation / (float)SATURATION_VALUE_COUNT;
-    float l = (float)hslColor.brightness / (float)BRIGHTNESS_VALUE_COUNT;
-
-    Color color{};
-    if (s == 0) {
-        color.r = l;
-        color.g = l;
-        color.b = l;
-    } else {
-        float q = l < 0.5f ? l * (1.0f + s) : l + s - l * s;
-        float p = 2.0f * l - q;
-        color.r = HueToRgb(p, q, h + 1.0f / 3.0f) * 255;
-        color.g = HueToRgb(p, q, h) * 255;
-        color.b = HueToRgb(p, q, h - 1.0f / 3.0f) * 255;
-    }
-    
-    return color;
-}
-
-void WriteJsonPalette(const Base16Palette& palette, const char* path) {
-        char buff[65536]{};
-
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-truncation"
-    snprintf(buff, 65536, R"JSON(
-{
-    "base00": "%02x%02x%02x",
-    "base01": "%02x%02x%02x",
-    "base02": "%02x%02x%02x",
-    "base03": "%02x%02x%02x",
-    "base04": "%02x%02x%02x",
-    "base05": "%02x%02x%02x",
-    "base06": "%02x%02x%02x",
-    "base07": "%02x%02x%02x",
-    "base08": "%02x%02x%02x",
-    "base09": "%02x%02x%02x",
-    "base0A": "%02x%02x%02x",
-    "base0B": "%02x%02x%02x",
-    "base0C": "%02x%02x%02x",
-    "base0D": "%02x%02x%02x",
-    "base0E": "%02x%02x%02x",
-    "base0F": "%02x%02x%02x"
-}
-    )JSON", 
-    palette.primary[0].r, palette.primary[0].g, palette.primary[0].b, 
-    palette.primary[1].r, palette.primary[1].g, palette.primary[1].b, 
-    palette.primary[2].r, palette.primary[2].g, palette.primary[2].b, 
-    palette.primary[3].r, palette.primary[3].g, palette.primary[3].b, 
-    palette.primary[4].r, palette.primary[4].g, palette.primary[4].b, 
-    palette.primary[5].r, palette.primary[5].g, palette.primary[5].b, 
-    palette.primary[6].r, palette.primary[6].g, palette.primary[6].b, 
-    palette.primary[7].r, palette.primary[7].g, palette.primary[7].b, 
-
-    palette.accents[0].r, palette.accents[0].g, palette.accents[0].b, 
-    palette.accents[1].r, palette.accents[1].g, palette.accents[1].b, 
-    palette.accents[2].r, palette.accents[2].g, palette.accents[2].b, 
-    palette.accents[3].r, palette.accents[3].g, palette.accents[3].b, 
-    palette.accents[4].r, palette.accents[4].g, palette.accents[4].b, 
-    palette.accents[5].r, palette.accents[5].g, palette.accents[5].b, 
-    palette.accents[6].r, palette.accents[6].g, palette.accents[6].b, 
-    palette.accents[7].r, palette.accents[7].g, palette.accents[7].b);
-#pragma GCC diagnostic pop
-
-    std::ofstream file{};
-    file.open(path);
-    file << buff;
-    file.close();
-}
-
-void WriteHtmlPalette(const Base16Palette& palette, const char* path) {
-    char buff[65536]{};
-
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-truncation"
-    snprintf(buff, 65536, R"HTML(
-<html>
-    <head>
-        <style>
-            body {
-                margin: 2rem;
-                font-family: sans-serif;
-            }
-            body > div {
-                display: flex;
-                flex-direction: row;
-                flex-wrap: wrap;
-                gap: 1em;
-            }
-            body > div > div {
-                width: 5rem;
-                height: 5rem;
-                display: flex;
-                justify-content: center;
-                align-items: center;
+    FILE* file = options.jsonLines ? fopen(options.jsonLines, "w") : stdout;
+    if (!file) {
+        std::cerr << "Couldn't write \"" << options.jsonLines << "\"." << std::endl;
+        ClosePaletteFile(reader);
+        return -1;
+    }
+
+    //The hash section is sorted by hash, this turns it back into record order
+    std::vector<unsigned long long> hashes{};
+    if (reader.hashes) {
+        hashes.resize(reader.recordCount);
+        for (unsigned long long i = 0; i < reader.recordCount; ++i) {
+            const unsigned char* entry = reader.hashes + i * PALETTE_HASH_ENTRY_SIZE;
+            unsigned long long hash = 0, record = 0;
+            for (int j = 0; j < 8; ++j) {
+                hash |= (unsigned long long)entry[j] << (j * 8);
+                record |= (unsigned long long)entry[8 + j] << (j * 8);
             }
-            #base00 { background-color: #%02x%02x%02x; color: #cdd6f4; }
-            #base01 { background-color: #%02x%02x%02x; color: #cdd6f4; }
-            #base02 { background-color: #%02x%02x%02x; color: #cdd6f4; }
-            #base03 { background-color: #%02x%02x%02x; color: #1e1e2e; }
-            #base04 { background-color: #%02x%02x%02x; color: #1e1e2e; }
-            #base05 { background-color: #%02x%02x%02x; color: #1e1e2e; }
-            #base06 { background-color: #%02x%02x%02x; color: #1e1e2e; }
-            #base07 { background-color: #%02x%02x%02x; color: #1e1e2e; }
-            #base08 { background-color: #%02x%02x%02x; color: #1e1e2e; }
-            #base09 { background-color: #%02x%02x%02x; color: #1e1e2e; }
-            #base0A { background-color: #%02x%02x%02x; color: #1e1e2e; }
-            #base0B { background-color: #%02x%02x%02x; color: #1e1e2e; }
-            #base0C { background-color: #%02x%02x%02x; color: #1e1e2e; }
-            #base0D { background-color: #%02x%02x%02x; color: #1e1e2e; }
-            #base0E { background-color: #%02x%02x%02x; color: #1e1e2e; }
-            #base0F { background-color: #%02x%02x%02x; color: #1e1e2e; }
-        </style>
-    </head>
-    <body>
-        <h2>Primary colors</h2>
-        <div>
-            <div id="base00">00</div>
-            <div id="base01">01</div>
-            <div id="base02">02</div>
-            <div id="base03">03</div>
-            <div id="base04">04</div>
-            <div id="base05">05</div>
-            <div id="base06">06</div>
-            <div id="base07">07</div>
-        </div>
-        <h2>Accents</h2>
-        <div>
-            <div id="base08">08</div>
-            <div id="base09">09</div>
-            <div id="base0A">0A</div>
-            <div id="base0B">0B</div>
-            <div id="base0C">0C</div>
-            <div id="base0D">0D</div>
-            <div id="base0E">0E</div>
-            <div id="base0F">0F</div>
-        </div>
-    </body>
-</html>
-    )HTML", 
-    palette.primary[0].r, palette.primary[0].g, palette.primary[0].b, 
-    palette.primary[1].r, palette.primary[1].g, palette.primary[1].b, 
-    palette.primary[2].r, palette.primary[2].g, palette.primary[2].b, 
-    palette.primary[3].r, palette.primary[3].g, palette.primary[3].b, 
-    palette.primary[4].r, palette.primary[4].g, palette.primary[4].b, 
-    palette.primary[5].r, palette.primary[5].g, palette.primary[5].b, 
-    palette.primary[6].r, palette.primary[6].g, palette.primary[6].b, 
-    palette.primary[7].r, palette.primary[7].g, palette.primary[7].b, 
-
-    palette.accents[0].r, palette.accents[0].g, palette.accents[0].b, 
-    palette.accents[1].r, palette.accents[1].g, palette.accents[1].b, 
-    palette.accents[2].r, palette.accents[2].g, palette.accents[2].b, 
-    palette.accents[3].r, palette.accents[3].g, palette.accents[3].b, 
-    palette.accents[4].r, palette.accents[4].g, palette.accents[4].b, 
-    palette.accents[5].r, palette.accents[5].g, palette.accents[5].b, 
-    palette.accents[6].r, palette.accents[6].g, palette.accents[6].b, 
-    palette.accents[7].r, palette.accents[7].g, palette.accents[7].b);
-#pragma GCC diagnostic pop
-
-    std::ofstream file{};
-    file.open(path);
-    file << buff;
-    file.close();
-}
-
-Base16Palette PaletteHSLtoRGB(const Base16HSLPalette& palette) {
-    Base16Palette paletteRGB{};
-    
-    for (int i = 0; i < 8; ++i) {
-        paletteRGB.primary[i] = Hsl2Rgb(palette.primary[i]);
-        paletteRGB.accents[i] = Hsl2Rgb(palette.accents[i]);
-    }
-
-    return paletteRGB;
-}
-
-int CalculateDifferenceMatchingScore(int a, int b, int target) {
-    return abs(abs(a - b) - target);
-}
-
-float Lerp(float a, float b, float t) {
-    return a + (b - a) * t;
-}
-
-void GetMatchingDiffColor(const std::vector<KeyL>& keyLs, std::vector<Scored<ColorHSL>>& scoredColors, 
-    ColorHSL refColor, int t0 /*HUE*/, int t1 /*Saturation*/, int t2 /*Brightness*/, int w0, int w1, int w2, int w3, bool signedBrightness) {
-    scoredColors.clear();
-    for (auto keyL : keyLs) {
-        int brightnessMatchingScore{};
-        if (signedBrightness) {
-            brightnessMatchingScore = abs(keyL.brightness - refColor.brightness - t2);
-        }else {
-            brightnessMatchingScore = CalculateDifferenceMatchingScore(keyL.brightness, refColor.brightness, t2);
-        }
-
-        for (auto keyHS : keyL.keyHSs) {
-            int popularityScore = 100.0f - std::clamp(((float)keyHS.population / 10000.0f), 0.0f, 100.0f);
-            int hueMatchingScore = CalculateDifferenceMatchingScore(keyHS.hue, refColor.hue, t0);
-            int saturationMatchingScore = CalculateDifferenceMatchingScore(keyHS.saturation, refColor.saturation, t1);
-            
-            Scored<ColorHSL> scoredColor{};
-            scoredColor.score = brightnessMatchingScore * w2 + hueMatchingScore * w0 + saturationMatchingScore * w1 + popularityScore * w3;
-            scoredColor.data.hue = keyHS.hue;
-            scoredColor.data.saturation = keyHS.saturation;
-            scoredColor.data.brightness = keyL.brightness;
-            scoredColors.push_back(scoredColor);
-        }
-    }
-
-    std::sort(scoredColors.begin(), scoredColors.end(), [](const Scored<ColorHSL>& a, const Scored<ColorHSL>& b){
-        return a.score < b.score;
-    });
-}
-
-void GetMatchingColor(const std::vector<KeyL>& keyLs, std::vector<Scored<ColorHSL>>& scoredColors, 
-    int t0 /*HUE*/, int t1 /*Saturation*/, int t2 /*Brightness*/, int w0, int w1, int w2, int w3) {
-    scoredColors.clear();
-    for (auto keyL : keyLs) {
-        int brightnessMatchingScore = abs(keyL.brightness - t2);
-        for (auto keyHS : keyL.keyHSs) {
-            int popularityScore = 100.0f - std::clamp(((float)keyHS.population / 10000.0f), 0.0f, 100.0f);
-            int hueMatchingScore = abs(keyHS.hue - t0);
-            int saturationMatchingScore = abs(keyHS.saturation - t1);
-            
-            Scored<ColorHSL> scoredColor{};
-            scoredColor.score = brightnessMatchingScore * w2 + hueMatchingScore * w0 + saturationMatchingScore * w1 + popularityScore * w3;
-            scoredColor.data.hue = keyHS.hue;
-            scoredColor.data.saturation = keyHS.saturation;
-            scoredColor.data.brightness = keyL.brightness;
-            scoredColors.push_back(scoredColor);
-        }
-    }
-
-    std::sort(scoredColors.begin(), scoredColors.end(), [](const Scored<ColorHSL>& a, const Scored<ColorHSL>& b){
-        return a.score < b.score;
-    });
-}
-
-void ExtractPaletteFromImage(unsigned char* data, int width, int height, int channels, Base16Palette& palette) {
-    int totalPopulation = width * height;
-    int populationBrightness[BRIGHTNESS_VALUE_COUNT]{};
-
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            int idx = x + y * width;
-            float r = data[idx * channels] / 255.0;
-            float g = data[idx * channels + 1] / 255.0;
-            float b = data[idx * channels + 2] / 255.0;
-            //int hueIdx = (int)GetColorHUE(r, g, b);
-            //int saturationIdx = (int)(GetColorSaturation(r, g, b) * SATURATION_VALUE_COUNT);
-            int brightnessIdx = (int)(GetColorBrightness(r, g, b) * BRIGHTNESS_VALUE_COUNT);
-            populationBrightness[brightnessIdx] += 1;
+            if (record < hashes.size())
+                hashes[record] = hash;
         }
     }
 
-    std::vector<KeyL> keyLs{};
-
-    for (int i = 0; i < BRIGHTNESS_VALUE_COUNT; ++i) {
-        if (populationBrightness[i] > totalPopulation / 1000) {
-            KeyL keyL{};
-            keyL.population = populationBrightness[i];
-            keyL.brightness = i;
-            keyLs.push_back(keyL);
+    for (unsigned long long i = 0; i < reader.recordCount; ++i) {
+        Base16Palette palette{};
+        GetPaletteRecord(reader, i, palette);
+        fprintf(file, "{\"record\":%llu", i);
+        if (reader.hashes)
+            fprintf(file, ",\"content_hash\":\"%016llx\"", hashes[i]);
+        for (int j = 0; j < 16; ++j) {
+            const Color& color = j < 8 ? palette.primary[j] : palette.accents[j - 8];
+            fprintf(file, ",\"base%02X\":\"%02x%02x%02x\"", j, color.r, color.g, color.b);
         }
+        fprintf(file, "}\n");
+    }
+
+    ClosePaletteFile(reader);
+    if (file != stdout && fclose(file) != 0) {
+        std::cerr << "Couldn't write \"" << options.jsonLines << "\"." << std::endl;
+        return -1;
     }
+    return 0;
+}
 
-    for (int i = 0; i < keyLs.size() - 1;) {
-        KeyL keyA = keyLs[i];
-        KeyL keyB = keyLs[i + 1];
+//Images that fail to load are left out, the index only refers to paths. An existing index is added to
+bool WriteBatchIndex(const Options& options, const std::vector<PaletteFeature>& features, const std::vector<std::string>& paths) {
+    if (!UpdatePaletteIndex(options.index, features, paths, options.seed)) {
+        std::cerr << "Couldn't write \"" << options.index << "\"." << std::endl;
+        return false;
+    }
+    if (options.verbosity >= Verbosity::Normal)
+        std::cout << "Adding " << features.size() << " images to the palette index \"" << options.index << "\".\n";
+    return true;
+}
 
-        if (keyB.brightness - keyA.brightness < 3.0f) {
-            KeyL newKey{};
-            newKey.population = keyA.population + keyB.population;
-            newKey.brightness = (keyA.brightness * keyA.population + keyB.brightness * keyB.population) / newKey.population;
-            keyLs.erase(keyLs.begin() + i);
-            keyLs.erase(keyLs.begin() + i);
-            keyLs.insert(keyLs.begin() + i, newKey);
+//"<distance>\t<path>" per match, closest first
+bool QueryPaletteIndex(const Options& options, const Base16Palette& palette) {
+    auto start = std::chrono::steady_clock::now();
+    PaletteIndex index{};
+    if (!OpenPaletteIndex(index, options.query)) {
+        std::cerr << "\"" << options.query << "\" isn't a palette index." << std::endl;
+        return false;
+    }
+
+    PaletteFeature feature{};
+    GetPaletteFeature(palette, feature);
+    std::vector<PaletteMatch> matches{};
+    FindNearestPalettes(index, feature, options.nearestCount, options.probes, matches);
+    double latency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    for (const auto& match : matches) {
+        const char* path = GetPaletteIndexPath(index, match.id);
+        std::cout << match.distance << '\t' << (path ? path : "") << '\n';
+    }
+    if (options.verbosity >= Verbosity::Normal)
+        std::cout << "Found " << matches.size() << " of " << index.entryCount << " palettes in " << latency << " ms.\n";
+    ClosePaletteIndex(index);
+    return true;
+}
+
+void AppendJsonString(std::string& line, const char* string) {
+    line += '"';
+    for (const char* c = string; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            line += '\\';
+            line += *c;
+        } else if ((unsigned char)*c < 0x20) {
+            char buff[8];
+            snprintf(buff, sizeof(buff), "\\u%04x", (unsigned char)*c);
+            line += buff;
         } else {
-            ++i;
+            line += *c;
         }
     }
+    line += '"';
+}
 
-    std::vector<int[HUE_VALUE_COUNT][SATURATION_VALUE_COUNT + 1]> keyLsPopulationsHUE( keyLs.size() );
-    {
-        for (int y = 0; y < height; ++y) {
-            for (int x = 0; x < width; ++x) {
-                int idx = x + y * width;
-                float r = data[idx * channels] / 255.0;
-                float g = data[idx * channels + 1] / 255.0;
-                float b = data[idx * channels + 2] / 255.0;
-                int hueIdx = (int)GetColorHUE(r, g, b);
-                int saturationIdx = (int)(GetColorSaturation(r, g, b) * SATURATION_VALUE_COUNT);
-                int brightnessIdx = (int)(GetColorBrightness(r, g, b) * BRIGHTNESS_VALUE_COUNT);
-                int lastDiff{ BRIGHTNESS_VALUE_COUNT };
-                for (int i = 0; i < keyLs.size(); ++i) {
-                    int currentDiff = abs(brightnessIdx - keyLs[i].brightness);
-                    if (currentDiff > lastDiff) {
-                        keyLsPopulationsHUE[i - 1][hueIdx][0] += 1;
-                        keyLsPopulationsHUE[i - 1][hueIdx][saturationIdx + 1] += 1;
-                        break;
-                    } else if (i == keyLs.size() - 1) {
-                        keyLsPopulationsHUE[i][hueIdx][0] += 1;
-                        keyLsPopulationsHUE[i][hueIdx][saturationIdx + 1] += 1;
-                        break;
-                    }
-                    lastDiff = currentDiff;
-                }
-            }
+//One JSON line per image with the keys, the palette and the score of every pick. The line is reused and
+//goes through stdio's buffer, nothing is flushed per image
+void WriteReportLine(FILE* report, const char* path, const PaletteExtractor& extractor, long long population, const Base16Palette& palette, std::string& line) {
+    char buff[256];
+    line.assign("{\"image\":");
+    AppendJsonString(line, path);
+    snprintf(buff, sizeof(buff), ",\"population\":%lld,\"palette\":[", population);
+    line += buff;
+    for (int i = 0; i < 16; ++i) {
+        const Color& color = i < 8 ? palette.primary[i] : palette.accents[i - 8];
+        snprintf(buff, sizeof(buff), "%s\"%02x%02x%02x\"", i ? "," : "", color.r, color.g, color.b);
+        line += buff;
+    }
+    line += "],\"scores\":[";
+    for (int i = 0; i < 16; ++i) {
+        snprintf(buff, sizeof(buff), "%s%g", i ? "," : "", extractor.getScores()[i]);
+        line += buff;
+    }
+    line += "],\"keys\":[";
+    const PaletteKeys& keys = extractor.getKeys();
+    for (size_t i = 0; i < keys.keyLs.size(); ++i) {
+        const KeyL& keyL = keys.keyLs[i];
+        snprintf(buff, sizeof(buff), "%s{\"population\":%d,\"brightness\":%d,\"hs\":[", i ? "," : "", keyL.population, (int)keyL.brightness);
+        line += buff;
+        for (int j = keyL.keyHSBegin; j < keyL.keyHSEnd; ++j) {
+            const KeyHS& keyHS = keys.keyHSs[j];
+            snprintf(buff, sizeof(buff), "%s{\"population\":%d,\"hue\":%d,\"saturation\":%d}", j > keyL.keyHSBegin ? "," : "",
+                keyHS.population, (int)keyHS.hue, (int)keyHS.saturation);
+            line += buff;
         }
+        line += "]}";
     }
+    line += "]}\n";
+    fwrite(line.data(), 1, line.size(), report);
+}
 
-    for (int i = 0; i < keyLsPopulationsHUE.size(); ++i) {
-        for (int j = 0; j < HUE_VALUE_COUNT; ++j) {
-            if (keyLsPopulationsHUE[i][j][0] > keyLs[i].population / 500) {
-                KeyHS keyHS{};
-                keyHS.population = keyLsPopulationsHUE[i][j][0];
-                keyHS.hue = j;
-                for (int k = 0; k < SATURATION_VALUE_COUNT; ++k)
-                    keyHS.saturation += k * keyLsPopulationsHUE[i][j][k];
-                keyHS.saturation /= keyHS.population;
-                keyLs[i].keyHSs.push_back(keyHS);
-            }
+//Writes the --trace file once every thread is done, a run that succeeded fails when it can't be written
+int FinishTrace(const Options& options, int result) {
+    if (!options.trace)
+        return result;
+    if (!WriteTrace(options.trace)) {
+        std::cerr << "Couldn't write the trace \"" << options.trace << "\"." << std::endl;
+        return -1;
+    }
+    if (options.verbosity >= Verbosity::Normal)
+        std::cout << "Writing trace to \"" << options.trace << "\".\n";
+    return result;
+}
+
+//Returns nullptr when --perf-counters isn't set or no counter could be opened, the run goes on without them
+const PerfCounters* StartPerfCounters(const Options& options, PerfCounters& counters) {
+    if (!options.perfCounters)
+        return nullptr;
+    if (!OpenPerfCounters(counters)) {
+        std::cerr << "Hardware counters are unavailable (" << strerror(errno) << "), continuing without them. "
+            "Containers usually need kernel.perf_event_paranoid <= 2 and CAP_PERFMON." << std::endl;
+        return nullptr;
+    }
+    return &counters;
+}
+
+void FormatCounter(char* buff, size_t size, const PerfCounters& counters, PerfCounter counter, double value, double divisor) {
+    if (counters.fds[(int)counter] < 0 || divisor <= 0.0)
+        snprintf(buff, size, "n/a");
+    else
+        snprintf(buff, size, divisor == 1.0 ? "%.0f" : "%.3f", value / divisor);
+}
+
+//Misses are per pixel of the image, only the main thread is counted
+void PrintPerfCounters(const PhaseTimings& timings, const PerfCounters& counters, long long pixels) {
+    printf("Perf counters:\n");
+    printf("  %-10s %14s %14s %6s %12s %12s %12s\n", "phase", "cycles", "instructions", "IPC", "br-miss/px", "L1D-miss/px", "LLC-miss/px");
+    for (int i = 0; i <= PHASE_COUNT; ++i) {
+        double values[PERF_COUNTER_COUNT]{};
+        for (int j = 0; j < PERF_COUNTER_COUNT; ++j) {
+            for (int k = 0; k < PHASE_COUNT; ++k)
+                values[j] += i == PHASE_COUNT || i == k ? timings.counterValues[k][j] : 0.0;
         }
 
-        std::vector<KeyHS>& keyHSs = keyLs[i].keyHSs;
-        for (int j = 0; j < keyHSs.size() && keyHSs.size() >= 2;) {
-            KeyHS keyA = keyHSs[j];
-            KeyHS keyB = keyHSs[(j + 1) % keyHSs.size()];
-
-            float rawDiff = abs(keyA.hue - keyB.hue);
-            float currentDiff = abs(abs(fmod(rawDiff * 2 / 360, 2) - 1) - 1) * 180;
-
-            if (currentDiff < 20.0f) {
-                KeyHS newKey{};
-                newKey.population = keyA.population + keyB.population;
-                newKey.saturation = (keyA.saturation * keyA.population + keyB.saturation * keyB.population) / newKey.population;
-                if (rawDiff <= 180) {
-                    newKey.hue = (keyA.hue * keyA.population + keyB.hue * keyB.population) / newKey.population;
-                    keyHSs.erase(keyHSs.begin() + j);
-                    keyHSs.erase(keyHSs.begin() + j % keyHSs.size());
-                    keyHSs.insert(keyHSs.begin() + j, newKey);
-                } else {
-                    newKey.hue = fmod((keyA.hue + 360.0) * keyA.population + keyB.hue * keyB.population, 360) / newKey.population;
-                    keyHSs.erase(keyHSs.begin() + j);
-                    keyHSs.erase(keyHSs.begin() + j % keyHSs.size());
-                    for (int k = 0; k < keyHSs.size(); ++k) {
-                        if (keyHSs[k].hue > newKey.hue) {
-                            keyHSs.insert(keyHSs.begin() + k, newKey);
-                            break;
-                        }
-                    }
-                }
-            } else {
-                ++j;
+        char cells[6][32];
+        FormatCounter(cells[0], 32, counters, PerfCounter::Cycles, values[(int)PerfCounter::Cycles], 1.0);
+        FormatCounter(cells[1], 32, counters, PerfCounter::Instructions, values[(int)PerfCounter::Instructions], 1.0);
+        if (counters.fds[(int)PerfCounter::Cycles] < 0 || values[(int)PerfCounter::Cycles] <= 0.0)
+            snprintf(cells[2], 32, "n/a");
+        else
+            FormatCounter(cells[2], 32, counters, PerfCounter::Instructions, values[(int)PerfCounter::Instructions], values[(int)PerfCounter::Cycles]);
+        FormatCounter(cells[3], 32, counters, PerfCounter::BranchMisses, values[(int)PerfCounter::BranchMisses], (double)pixels);
+        FormatCounter(cells[4], 32, counters, PerfCounter::L1DMisses, values[(int)PerfCounter::L1DMisses], (double)pixels);
+        FormatCounter(cells[5], 32, counters, PerfCounter::LLCMisses, values[(int)PerfCounter::LLCMisses], (double)pixels);
+        printf("  %-10s %14s %14s %6s %12s %12s %12s\n", i < PHASE_COUNT ? GetPhaseName((Phase)i) : "total",
+            cells[0], cells[1], cells[2], cells[3], cells[4], cells[5]);
+    }
+}
+
+//Nearest rank, values end up sorted
+double GetPercentile(std::vector<double>& values, double percentile) {
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)std::ceil(percentile / 100.0 * values.size());
+    return values[std::clamp(rank, (size_t)1, values.size()) - 1];
+}
+
+void PrintPhaseStatistics(const char* name, std::vector<double>& milliseconds, bool last) {
+    double p50 = GetPercentile(milliseconds, 50.0);
+    double p99 = GetPercentile(milliseconds, 99.0);
+    printf("            \"%s\": { \"min\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f }%s\n", name,
+        milliseconds.front(), p50, p99, milliseconds.back(), last ? "" : ",");
+}
+
+//Per image distributions of every phase, in milliseconds
+void PrintBatchTimings(const std::vector<PhaseTimings>& samples, long long pixels, size_t decodedBytes) {
+    if (samples.empty())
+        return;
+
+    PhaseTimings total{};
+    for (const auto& sample : samples) {
+        for (int i = 0; i < PHASE_COUNT; ++i) {
+            total.wallSeconds[i] += sample.wallSeconds[i];
+            total.cpuSeconds[i] += sample.cpuSeconds[i];
+        }
+    }
+    double wallSeconds = GetTotalSeconds(total.wallSeconds);
+    double decodeSeconds = total.wallSeconds[(int)Phase::Decode];
+
+    std::vector<double> milliseconds(samples.size());
+    printf("{\n    \"timings\": {\n");
+    printf("        \"images\": %d,\n", (int)samples.size());
+    printf("        \"megapixels_per_second\": %.3f,\n", pixels / 1000000.0 / wallSeconds);
+    printf("        \"decoded_megabytes_per_second\": %.3f,\n", decodeSeconds > 0.0 ? decodedBytes / 1000000.0 / decodeSeconds : 0.0);
+    for (int clock = 0; clock < 2; ++clock) {
+        printf("        \"%s\": {\n", clock == 0 ? "wall_ms" : "cpu_ms");
+        for (int i = 0; i <= PHASE_COUNT; ++i) {
+            for (int j = 0; j < samples.size(); ++j) {
+                const double (&seconds)[PHASE_COUNT] = clock == 0 ? samples[j].wallSeconds : samples[j].cpuSeconds;
+                milliseconds[j] = (i < PHASE_COUNT ? seconds[i] : GetTotalSeconds(seconds)) * 1000.0;
             }
+            PrintPhaseStatistics(i < PHASE_COUNT ? GetPhaseName((Phase)i) : "total", milliseconds, i == PHASE_COUNT);
         }
+        printf("        }%s\n", clock == 0 ? "," : "");
+    }
+    printf("    }\n}\n");
+}
+
+bool ReadFile(const char* path, std::vector<unsigned char>& buffer) {
+    std::ifstream file{ path, std::ios::binary };
+    if (!file)
+        return false;
+    buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
 
-        std::sort(keyHSs.begin(), keyHSs.end(), [](const KeyHS& a, const KeyHS& b){
-            return a.population > b.population;
-        });
+//Inserts ".<suffix>" before the extension, "out.json" becomes "out.<suffix>.json"
+std::string SuffixedOutputPath(const std::string& path, const std::string& suffix) {
+    std::string suffixedPath{ path };
+    size_t separator = suffixedPath.find_last_of("/\\");
+    size_t extension = suffixedPath.find_last_of('.');
+    if (extension == std::string::npos || (separator != std::string::npos && extension < separator))
+        extension = suffixedPath.size();
+    suffixedPath.insert(extension, "." + suffix);
+    return suffixedPath;
+}
+
+std::string IndexedOutputPath(const char* path, int index) {
+    return SuffixedOutputPath(path, std::to_string(index));
+}
+
+std::string GetOutputPath(const char* path, int index, const char* variant) {
+    std::string outputPath = index < 0 ? path : IndexedOutputPath(path, index);
+    if (variant)
+        outputPath = SuffixedOutputPath(outputPath, variant);
+    return outputPath;
+}
+
+//The palette is formatted once, every requested format is rendered from it into the same buffer
+void WritePaletteOutputs(const Options& options, PaletteRenderer& renderer, const Base16Palette& palette, int index, const char* variant = nullptr) {
+    const char* paths[PALETTE_FORMAT_COUNT]{ options.outputJsonPalette, options.outputHtmlPalette, options.outputYamlPalette,
+        options.outputXresources, options.outputCssPalette, options.outputAnsiPalette };
+    SetRendererPalette(renderer, palette);
+    for (int i = 0; i < PALETTE_FORMAT_COUNT; ++i) {
+        if (!paths[i])
+            continue;
+        std::string path = strcmp(paths[i], "-") == 0 ? paths[i] : GetOutputPath(paths[i], index, variant);
+        if (!WritePaletteFormat(renderer, (PaletteFormat)i, path.c_str()))
+            std::cerr << "Couldn't write \"" << path << "\"." << std::endl;
+        else if (options.verbosity >= Verbosity::Normal && path != "-")
+            std::cout << "Writing " << GetPaletteFormatName((PaletteFormat)i) << " to \"" << path << "\".\n";
     }
+}
 
-    std::sort(keyLs.begin(), keyLs.end(), [](const KeyL& a, const KeyL& b){
-        return a.population > b.population;
-    });
+//Every variant is selected again from the keys of the last extraction, the pixels are only read once
+void WriteVariantOutputs(const Options& options, PaletteRenderer& renderer, const std::vector<SelectionPlan>& variants,
+    PaletteExtractor& extractor, const Base16Palette& palette, int index) {
+    if (variants.empty()) {
+        WritePaletteOutputs(options, renderer, palette, index);
+        return;
+    }
 
-    Base16HSLPalette hslPalette{};
+    for (const auto& plan : variants) {
+        Base16Palette variant{};
+        extractor.select(plan, variant);
+        WritePaletteOutputs(options, renderer, variant, index, plan.name.c_str());
+    }
+}
 
-    std::vector<Scored<ColorHSL>> scoredColors{};
+//Comma separated profile names, compiled once before any image is read
+bool CompileVariants(const char* list, const std::vector<SelectionProfile>& profiles, std::vector<SelectionPlan>& variants) {
+    std::string names{ list };
+    size_t begin = 0;
+    while (begin <= names.size()) {
+        size_t end = std::min(names.find(',', begin), names.size());
+        SelectionProfile profile{};
+        if (variants.size() >= MAX_VARIANT_COUNT || !FindSelectionProfile(profiles, names.substr(begin, end - begin).c_str(), profile))
+            return false;
+        variants.emplace_back();
+        CompileSelectionPlan(profile, variants.back());
+        begin = end + 1;
+    }
+    return true;
+}
 
-    GetMatchingColor(keyLs, scoredColors, 0, 0, 10, 0.0f, 0.0f, 1.0f, 1.0f);
-    hslPalette.primary[0] = scoredColors[0].data;
+struct FrameSequence {
+    const char* pattern{ nullptr };
+    int index{};
+    PnmStream pnm{};
+};
 
-    for (int i = 1; i < 6; ++i) {
-        switch (i) {
-            case 5:
-                GetMatchingDiffColor(keyLs, scoredColors, hslPalette.primary[i - 1], 50, 0, 40, 0.25f, 0.0f, 2.0f, 0.25f, true);
-                hslPalette.primary[i] = scoredColors[0].data;
-                break;
-            default:
-                GetMatchingDiffColor(keyLs, scoredColors, hslPalette.primary[i - 1], 10, 0, 8, 0.5f, 0.25f, 1.0f, 0.5f, true);
-                hslPalette.primary[i] = scoredColors[0].data;
-                break;
+bool LoadNextSequenceFrame(FrameSequence& sequence, ImageView& image) {
+    if (strcmp(sequence.pattern, "-") == 0)
+        return LoadPnmStreamFrame(sequence.pnm, image);
+
+    //Sequences numbered like ffmpeg dumps may start at 0 or 1
+    char path[4096];
+    snprintf(path, sizeof(path), sequence.pattern, sequence.index++);
+    if (LoadImageFile(path, image))
+        return true;
+    if (sequence.index != 1)
+        return false;
+    snprintf(path, sizeof(path), sequence.pattern, sequence.index++);
+    return LoadImageFile(path, image);
+}
+
+int RunFrameStream(const Options& options, const ExtractionSettings& settings, const HdrToneMap& toneMap) {
+    FrameSequence sequence{};
+    sequence.pattern = options.inputImage;
+    sequence.pnm.file = stdin;
+
+    PaletteSink sink{};
+    if (!OpenPaletteSink(sink, options.jsonLines)) {
+        std::cerr << "Couldn't write \"" << options.jsonLines << "\"." << std::endl;
+        return -1;
+    }
+    //A frame's palette is delivered when it's extracted, latency included
+    sink.flushEachLine = true;
+
+    SlidingHistogram window{};
+    ResetHistogram(window.total, settings.binResolution);
+    PaletteExtractor extractor{ settings };
+    int frame = 0;
+    int framesOverTarget = 0;
+    double totalLatency = 0.0;
+
+    while (true) {
+        auto start = std::chrono::steady_clock::now();
+        SetTraceImage(frame, nullptr);
+        PhaseTimer timer{};
+        StartPhase(timer, nullptr); //Only traced
+        ImageView image{};
+        image.toneMap = toneMap;
+        image.alphaThreshold = options.alphaThreshold;
+        if (!LoadNextSequenceFrame(sequence, image))
+            break;
+        StopPhase(timer, nullptr, Phase::Decode);
+
+        extractor.pushFrame(window, options.streamWindow, image);
+        FreeImage(image);
+        StopPhase(timer, nullptr, Phase::Accumulate);
+
+        Base16Palette palette{};
+        extractor.extract(window.total, palette);
+
+        double latency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        StartPhase(timer, nullptr);
+        AppendFrameLine(sink, frame, latency, palette);
+        StopPhase(timer, nullptr, Phase::Output);
+        if (sink.failed) {
+            ClosePaletteSink(sink);
+            std::cerr << "Couldn't write \"" << options.jsonLines << "\"." << std::endl;
+            return -1;
         }
+
+        totalLatency += latency;
+        if (options.latencyTarget > 0.0f && latency > options.latencyTarget)
+            ++framesOverTarget;
+        ++frame;
+    }
+
+    if (!frame) {
+        ClosePaletteSink(sink);
+        std::cerr << "Couldn't load any frame." << std::endl;
+        return -1;
+    }
+    if (!CloseJsonLines(options, sink))
+        return -1;
+
+    if (options.verbosity >= Verbosity::Normal) {
+        std::cout << "Streamed " << frame << " frames, " << totalLatency / frame << " ms/frame on average";
+        if (options.latencyTarget > 0.0f)
+            std::cout << ", " << framesOverTarget << " over the " << options.latencyTarget << " ms target";
+        std::cout << ".\n";
     }
 
-    std::swap(hslPalette.primary[0], hslPalette.primary[1]);
+    return 0;
+}
 
-    GetMatchingColor(keyLs, scoredColors, 0, 50, 70, 0.0f, 1.0f, 1.0f, 0.1f);
+//One extractor is reused for every image of the list, outputs are indexed by list entry
+int RunBatch(const Options& options, const ExtractionSettings& settings, const HdrToneMap& toneMap, const std::vector<SelectionPlan>& variants) {
+    std::ifstream list{ options.batchList };
+    if (!list) {
+        std::cerr << "Couldn't read the batch list." << std::endl;
+        return -1;
+    }
 
-    for (int i = 0; i < 10; ++i) {
-        ColorHSL color = scoredColors[i].data;
-        printf("Score: %d\n", scoredColors[i].score);
+    FILE* report = OpenReport(options);
+    if (options.report && !report)
+        return -1;
+    std::string reportLine{};
 
-        if (i <= 1) {
-            hslPalette.primary[i + 6] = color;
-        } else {
-            hslPalette.accents[i - 2] = color;
-        }
+    PaletteSink sink{};
+    if (options.jsonLines && !OpenPaletteSink(sink, options.jsonLines)) {
+        std::cerr << "Couldn't write \"" << options.jsonLines << "\"." << std::endl;
+        return -1;
     }
 
-    palette = PaletteHSLtoRGB(hslPalette);
+    //One record per list entry, images that can't be loaded get a zeroed one so indices stay aligned
+    PaletteFileWriter binary{};
+    if (options.binary && !OpenBinaryOutput(options, binary))
+        return -1;
 
-    for (auto keyL : keyLs) {
-        printf("KeyL: { population: %d%%, brightness: %d%% }\n", (int)((float)keyL.population / (float)totalPopulation * 100.0), (int)keyL.brightness);
-        for (auto keyHS : keyL.keyHSs) {
-            printf("\t- KeyHS: { population: %d%%, hue: %d, saturation: %d%%}\n", (int)((float)keyHS.population / (float)keyL.population * 100.0), (int)keyHS.hue, (int)keyHS.saturation);
+    PaletteExtractor extractor{ settings };
+    PaletteRenderer renderer{};
+    std::vector<PaletteFeature> indexFeatures{};
+    std::vector<std::string> indexPaths{};
+    std::string path{};
+    int index = 0;
+    int failures = 0;
+
+    PerfCounters counters{};
+    const PerfCounters* openedCounters = StartPerfCounters(options, counters);
+    PhaseTimings timings{};
+    PhaseTimings counterTotals{};
+    PhaseTimings* imageTimings = options.timings || openedCounters ? &timings : nullptr;
+    std::vector<PhaseTimings> samples{};
+    long long pixels = 0;
+    size_t decodedBytes = 0;
+    extractor.setTimings(imageTimings);
+
+    while (std::getline(list, path)) {
+        if (path.empty())
+            continue;
+
+        timings = PhaseTimings{};
+        timings.counters = openedCounters;
+        SetTraceImage(index, path.c_str());
+        PhaseTimer timer{};
+        StartPhase(timer, imageTimings);
+
+        ImageView image{};
+        image.toneMap = toneMap;
+        image.alphaThreshold = options.alphaThreshold;
+        if (!LoadImageFile(path.c_str(), image)) {
+            std::cerr << "Couldn't load the image \"" << path << "\"." << std::endl;
+            if (options.binary)
+                AppendBinaryOutput(options, binary, path.c_str(), Base16Palette{});
+            ++failures;
+            ++index;
+            continue;
+        }
+        StopPhase(timer, imageTimings, Phase::Decode);
+        pixels += (long long)image.width * image.height;
+        decodedBytes += GetDecodedByteCount(image);
+
+        if (options.verbosity >= Verbosity::Normal)
+            std::cout << "Processing image \"" << path << "\"...\n";
+
+        Base16Palette palette{};
+        ExtractionStats stats = extractor.extract(image, palette);
+        FreeImage(image);
+        StartPhase(timer, imageTimings);
+        if (options.verbosity >= Verbosity::Verbose)
+            PrintKeys(extractor.getKeys(), stats.population);
+        if (report)
+            WriteReportLine(report, path.c_str(), extractor, stats.population, palette, reportLine);
+        if (options.jsonLines)
+            AppendPaletteLine(sink, path.c_str(), palette, &stats);
+        if (options.binary)
+            AppendBinaryOutput(options, binary, path.c_str(), palette);
+        if (options.index) {
+            indexFeatures.emplace_back();
+            GetPaletteFeature(palette, indexFeatures.back());
+            indexPaths.push_back(path);
+        }
+        WriteVariantOutputs(options, renderer, variants, extractor, palette, index);
+        StopPhase(timer, imageTimings, Phase::Output);
+        if (options.timings)
+            samples.push_back(timings);
+        for (int i = 0; i < PHASE_COUNT; ++i) {
+            for (int j = 0; j < PERF_COUNTER_COUNT; ++j)
+                counterTotals.counterValues[i][j] += timings.counterValues[i][j];
         }
+        ++index;
     }
+
+    if (options.timings)
+        PrintBatchTimings(samples, pixels, decodedBytes);
+    if (openedCounters)
+        PrintPerfCounters(counterTotals, counters, pixels);
+    ClosePerfCounters(counters);
+    if (report && !CloseReport(options, report))
+        return -1;
+    if (options.jsonLines && !CloseJsonLines(options, sink))
+        return -1;
+    if (options.binary && !CloseBinaryOutput(options, binary))
+        return -1;
+    if (options.index && !WriteBatchIndex(options, indexFeatures, indexPaths))
+        return -1;
+    return failures ? -1 : 0;
 }
 
 void GetOptions(int argc, char* argv[], Options& options) {
@@ -542,6 +697,12 @@ void GetOptions(int argc, char* argv[], Options& options) {
                 break;
             options.inputImage = argv[i];
         }
+        if (strcmp(argv[i], "--batch") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.batchList = argv[i];
+        }
         if (strcmp(argv[i], "--json") == 0) {
             ++i;
             if (i >= argc)
@@ -554,6 +715,205 @@ void GetOptions(int argc, char* argv[], Options& options) {
                 break;
             options.outputHtmlPalette = argv[i];
         }
+        if (strcmp(argv[i], "--yaml") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.outputYamlPalette = argv[i];
+        }
+        if (strcmp(argv[i], "--xresources") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.outputXresources = argv[i];
+        }
+        if (strcmp(argv[i], "--css") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.outputCssPalette = argv[i];
+        }
+        if (strcmp(argv[i], "--ansi") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.outputAnsiPalette = argv[i];
+        }
+        if (strcmp(argv[i], "--engine") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.engine = argv[i];
+        }
+        if (strcmp(argv[i], "--bins") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.bins = argv[i];
+        }
+        if (strcmp(argv[i], "--colors") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.colorCount = atoi(argv[i]);
+        }
+        if (strcmp(argv[i], "--bench") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.benchmarkRuns = atoi(argv[i]);
+        }
+        if (strcmp(argv[i], "--timings") == 0)
+            options.timings = true;
+        if (strcmp(argv[i], "--perf-counters") == 0)
+            options.perfCounters = true;
+        if (strcmp(argv[i], "--quiet") == 0 || strcmp(argv[i], "-q") == 0) {
+            options.verbosity = Verbosity::Quiet;
+            options.verbositySet = true;
+        }
+        if (strcmp(argv[i], "--verbose") == 0 || strcmp(argv[i], "-v") == 0) {
+            options.verbosity = Verbosity::Verbose;
+            options.verbositySet = true;
+        }
+        if (strcmp(argv[i], "--binary") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.binary = argv[i];
+        }
+        if (strcmp(argv[i], "--binary-hashes") == 0)
+            options.binaryHashes = true;
+        if (strcmp(argv[i], "--convert") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.convert = argv[i];
+        }
+        if (strcmp(argv[i], "--index") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.index = argv[i];
+        }
+        if (strcmp(argv[i], "--query") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.query = argv[i];
+        }
+        if (strcmp(argv[i], "--nearest") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.nearestCount = atoi(argv[i]);
+        }
+        if (strcmp(argv[i], "--probes") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.probes = atoi(argv[i]);
+        }
+        if (strcmp(argv[i], "--jsonl") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.jsonLines = argv[i];
+        }
+        if (strcmp(argv[i], "--report") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.report = argv[i];
+        }
+        if (strcmp(argv[i], "--trace") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.trace = argv[i];
+        }
+        if (strcmp(argv[i], "--seed") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.seed = strtoul(argv[i], nullptr, 10);
+        }
+        if (strcmp(argv[i], "--threads") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.threadCount = atoi(argv[i]);
+        }
+        if (strcmp(argv[i], "--frames") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.frames = argv[i];
+        }
+        if (strcmp(argv[i], "--roi") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            ImageRect region{};
+            if (sscanf(argv[i], "%d,%d,%d,%d", &region.x, &region.y, &region.width, &region.height) != 4)
+                options.invalidRegion = true;
+            if (options.regionCount < MAX_REGION_COUNT)
+                options.regions[options.regionCount] = region;
+            ++options.regionCount;
+        }
+        if (strcmp(argv[i], "--profiles") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.profiles = argv[i];
+        }
+        if (strcmp(argv[i], "--profile") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.profile = argv[i];
+        }
+        if (strcmp(argv[i], "--variants") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.variants = argv[i];
+        }
+        if (strcmp(argv[i], "--weights") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.weights = argv[i];
+        }
+        if (strcmp(argv[i], "--exposure") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.exposure = atof(argv[i]);
+        }
+        if (strcmp(argv[i], "--tonemap") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.toneMap = argv[i];
+        }
+        if (strcmp(argv[i], "--alpha-threshold") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.alphaThreshold = atof(argv[i]);
+        }
+        if (strcmp(argv[i], "--stream") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.streamWindow = atoi(argv[i]);
+        }
+        if (strcmp(argv[i], "--latency-target") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.latencyTarget = atof(argv[i]);
+        }
         ++i;
     }
 }
@@ -562,33 +922,275 @@ int main(int argc, char* argv[]) {
     Options options{};
     GetOptions(argc, argv, options);
 
-    if (!options.inputImage) {
-        std::cerr << "Input image is missing. use -i <image>." << std::endl;
+    if (options.convert)
+        return ConvertPaletteFile(options);
+
+    if (!options.inputImage && !options.batchList) {
+        std::cerr << "Input image is missing. use -i <image> or --batch <list>." << std::endl;
+        return -1;
+    }
+
+    ExtractionSettings settings{};
+    if (options.engine && !ParseEngine(options.engine, settings.engine)) {
+        std::cerr << "Unknown engine \"" << options.engine << "\". use --engine <histogram|octree|kmeans>." << std::endl;
+        return -1;
+    }
+    if (options.bins && !ParseBinResolution(options.bins, settings.binResolution)) {
+        std::cerr << "Unknown bin resolution \"" << options.bins << "\". use --bins <quality|fast>." << std::endl;
+        return -1;
+    }
+    if (options.colorCount < 1 || options.colorCount > OCTREE_NODE_BUDGET / OCTREE_DEPTH) {
+        std::cerr << "Color count must be between 1 and " << OCTREE_NODE_BUDGET / OCTREE_DEPTH << "." << std::endl;
+        return -1;
+    }
+    if (options.threadCount < 1) {
+        std::cerr << "Thread count must be at least 1." << std::endl;
         return -1;
     }
+    settings.colorCount = options.colorCount;
+    settings.seed = options.seed;
+    settings.threadCount = options.threadCount;
 
-    int width, height, channels;
-    unsigned char* data = stbi_load(options.inputImage, &width, &height, &channels, 3);
+    FrameMode frameMode{ FrameMode::First };
+    if (options.frames && !ParseFrameMode(options.frames, frameMode)) {
+        std::cerr << "Unknown frame mode \"" << options.frames << "\". use --frames <first|aggregate|each>." << std::endl;
+        return -1;
+    }
+    if (frameMode == FrameMode::Aggregate && settings.engine != Engine::Histogram) {
+        std::cerr << "Aggregating frames requires the histogram engine." << std::endl;
+        return -1;
+    }
 
-    if (!data) {
-        std::cerr << "Couldn't load the image." << std::endl;
+    for (int i = 0; i < options.regionCount && i < MAX_REGION_COUNT; ++i) {
+        const ImageRect& region = options.regions[i];
+        if (region.x < 0 || region.y < 0 || region.width < 0 || region.height < 0)
+            options.invalidRegion = true;
+    }
+    if (options.invalidRegion) {
+        std::cerr << "Invalid region of interest. use --roi <x,y,width,height>." << std::endl;
+        return -1;
+    }
+    if (options.regionCount > MAX_REGION_COUNT) {
+        std::cerr << "At most " << MAX_REGION_COUNT << " regions of interest are supported." << std::endl;
+        return -1;
+    }
+    if ((options.regionCount > 1 || options.weights) && settings.engine != Engine::Histogram) {
+        std::cerr << "Several regions of interest or weights require the histogram engine." << std::endl;
+        return -1;
+    }
+    if ((options.regionCount || options.weights) && (options.batchList || options.streamWindow > 0 || frameMode != FrameMode::First)) {
+        std::cerr << "Regions of interest and weights only apply to single images." << std::endl;
         return -1;
     }
 
-    std::cout << "Porcessing image \"" << options.inputImage << "\"..." << std::endl;
+    std::vector<SelectionProfile> profiles{};
+    GetSelectionProfiles(profiles);
+    if (options.profiles && !LoadSelectionProfiles(options.profiles, profiles)) {
+        std::cerr << "Couldn't load the selection profiles \"" << options.profiles << "\"." << std::endl;
+        return -1;
+    }
+
+    SelectionPlan plan{ GetDefaultSelectionPlan() };
+    if (options.profile) {
+        SelectionProfile profile{};
+        if (!FindSelectionProfile(profiles, options.profile, profile)) {
+            std::cerr << "Unknown selection profile \"" << options.profile << "\"." << std::endl;
+            return -1;
+        }
+        CompileSelectionPlan(profile, plan);
+    }
+    settings.selectionPlan = &plan;
 
-    Base16Palette palette{};
-    ExtractPaletteFromImage(data, width, height, channels, palette);
-    
-    if (options.outputJsonPalette) {
-        WriteJsonPalette(palette, options.outputJsonPalette);
-        std::cout << "Writing JSON palette to \"" << options.outputJsonPalette << "\"." << std::endl;
+    std::vector<SelectionPlan> variants{};
+    if (options.variants && !CompileVariants(options.variants, profiles, variants)) {
+        std::cerr << "Invalid variants \"" << options.variants << "\". use --variants <dark,light,high-contrast>, at most "
+            << MAX_VARIANT_COUNT << "." << std::endl;
+        return -1;
+    }
+    if (!variants.empty() && (options.regionCount > 1 || options.streamWindow > 0 || frameMode != FrameMode::First)) {
+        std::cerr << "Variants only apply to single images and batches." << std::endl;
+        return -1;
     }
 
-    if (options.outputHtmlPalette) {
-        WriteHtmlPalette(palette, options.outputHtmlPalette);
-        std::cout << "Writing HTML palette to \"" << options.outputHtmlPalette << "\"." << std::endl;
+    HdrToneMap toneMap{};
+    toneMap.exposure = exp2f(options.exposure);
+    if (options.toneMap && strcmp(options.toneMap, "reinhard") != 0) {
+        if (strcmp(options.toneMap, "clamp") != 0) {
+            std::cerr << "Unknown tone map \"" << options.toneMap << "\". use --tonemap <reinhard|clamp>." << std::endl;
+            return -1;
+        }
+        toneMap.reinhard = false;
     }
 
-    return 0;
+    if ((options.timings || options.perfCounters) && (options.streamWindow > 0 || frameMode != FrameMode::First)) {
+        std::cerr << "Timings and perf counters only apply to single images and batches." << std::endl;
+        return -1;
+    }
+    if ((options.report || options.binary) && (options.streamWindow > 0 || frameMode != FrameMode::First || options.regionCount > 1)) {
+        std::cerr << "Reports and binary palettes only apply to single images and batches, without regions." << std::endl;
+        return -1;
+    }
+    if (options.jsonLines && (frameMode != FrameMode::First || options.regionCount > 1)) {
+        std::cerr << "JSON lines only apply to single images, batches and streams, without regions." << std::endl;
+        return -1;
+    }
+    if (options.index && !options.batchList) {
+        std::cerr << "Palette indices are built from batches, use --batch <list>." << std::endl;
+        return -1;
+    }
+    if (options.query && (options.batchList || options.streamWindow > 0 || frameMode != FrameMode::First || options.regionCount > 1)) {
+        std::cerr << "Queries take a single image, without regions." << std::endl;
+        return -1;
+    }
+    if (options.query && options.nearestCount < 1) {
+        std::cerr << "--nearest needs at least 1 match." << std::endl;
+        return -1;
+    }
+    if (!options.verbositySet && (options.batchList || options.streamWindow > 0))
+        options.verbosity = Verbosity::Quiet;
+
+    if (options.trace)
+        StartTracing();
+
+    if (options.batchList)
+        return FinishTrace(options, RunBatch(options, settings, toneMap, variants));
+
+    if (options.streamWindow > 0) {
+        if (settings.engine != Engine::Histogram) {
+            std::cerr << "Streaming requires the histogram engine." << std::endl;
+            return -1;
+        }
+        if (!options.jsonLines) {
+            std::cerr << "Streaming writes JSON lines, use --jsonl <path>." << std::endl;
+            return -1;
+        }
+        if (options.outputJsonPalette || options.outputHtmlPalette || options.outputYamlPalette || options.outputXresources
+            || options.outputCssPalette || options.outputAnsiPalette) {
+            std::cerr << "Streaming only writes JSON lines, palette files don't apply." << std::endl;
+            return -1;
+        }
+        return FinishTrace(options, RunFrameStream(options, settings, toneMap));
+    }
+
+    SetTraceImage(0, options.inputImage);
+    if (frameMode != FrameMode::First) {
+        std::vector<unsigned char> buffer{};
+        if (!ReadFile(options.inputImage, buffer)) {
+            std::cerr << "Couldn't read the image." << std::endl;
+            return -1;
+        }
+
+        if (IsGifMemory(buffer.data(), buffer.size())) {
+            if (options.verbosity >= Verbosity::Normal)
+                std::cout << "Processing frames of \"" << options.inputImage << "\"...\n";
+
+            std::vector<Base16Palette> palettes{};
+            PaletteKeys keys{};
+            ExtractionStats stats{};
+            if (!ExtractGifPalettes(buffer.data(), buffer.size(), settings, frameMode, options.alphaThreshold, palettes, &keys, &stats)) {
+                std::cerr << "Couldn't load the image." << std::endl;
+                return -1;
+            }
+            if (frameMode == FrameMode::Aggregate && options.verbosity >= Verbosity::Verbose)
+                PrintKeys(keys, stats.population);
+
+            PaletteRenderer renderer{};
+            for (int i = 0; i < palettes.size(); ++i)
+                WritePaletteOutputs(options, renderer, palettes[i], frameMode == FrameMode::Each ? i : -1);
+            return FinishTrace(options, 0);
+        }
+    }
+
+    PerfCounters counters{};
+    PhaseTimings timings{};
+    timings.counters = StartPerfCounters(options, counters);
+    PhaseTimings* imageTimings = options.timings || timings.counters ? &timings : nullptr;
+    PhaseTimer timer{};
+    StartPhase(timer, imageTimings);
+
+    ImageView image{};
+    image.toneMap = toneMap;
+    image.alphaThreshold = options.alphaThreshold;
+
+    if (!LoadImageFile(options.inputImage, image)) {
+        std::cerr << "Couldn't load the image." << std::endl;
+        return -1;
+    }
+    StopPhase(timer, imageTimings, Phase::Decode);
+
+    if (options.verbosity >= Verbosity::Normal)
+        std::cout << "Porcessing image \"" << options.inputImage << "\"...\n";
+
+    std::vector<unsigned char> weights{};
+    if (options.weights) {
+        if (strcmp(options.weights, "center") == 0) {
+            BuildCenterWeightMask(image.width, image.height, weights);
+        } else if (!LoadWeightMask(options.weights, image.width, image.height, weights)) {
+            std::cerr << "Couldn't load the weights, use a grey image the size of the input or \"center\"." << std::endl;
+            return -1;
+        }
+        image.weights = weights.data();
+    }
+    if (options.regionCount == 1)
+        image.roi = options.regions[0];
+
+    if (options.benchmarkRuns > 0) {
+        RunBenchmark(image, settings, options.benchmarkRuns);
+        return 0;
+    }
+
+    PaletteExtractor extractor{ settings };
+    extractor.setTimings(imageTimings);
+    PaletteRenderer renderer{};
+    if (options.regionCount > 1) {
+        Base16Palette palettes[MAX_REGION_COUNT]{};
+        extractor.extractRegions(image, options.regions, options.regionCount, palettes);
+        StartPhase(timer, imageTimings);
+        for (int i = 0; i < options.regionCount; ++i)
+            WritePaletteOutputs(options, renderer, palettes[i], i);
+    } else {
+        Base16Palette palette{};
+        ExtractionStats stats = extractor.extract(image, palette);
+        StartPhase(timer, imageTimings);
+        if (options.verbosity >= Verbosity::Verbose)
+            PrintKeys(extractor.getKeys(), stats.population);
+        if (options.report) {
+            FILE* report = OpenReport(options);
+            if (!report)
+                return -1;
+            std::string reportLine{};
+            WriteReportLine(report, options.inputImage, extractor, stats.population, palette, reportLine);
+            if (!CloseReport(options, report))
+                return -1;
+        }
+        if (options.jsonLines) {
+            PaletteSink sink{};
+            if (!OpenPaletteSink(sink, options.jsonLines)) {
+                std::cerr << "Couldn't write \"" << options.jsonLines << "\"." << std::endl;
+                return -1;
+            }
+            AppendPaletteLine(sink, options.inputImage, palette, &stats);
+            if (!CloseJsonLines(options, sink))
+                return -1;
+        }
+        if (options.binary) {
+            PaletteFileWriter binary{};
+            if (!OpenBinaryOutput(options, binary))
+                return -1;
+            AppendBinaryOutput(options, binary, options.inputImage, palette);
+            if (!CloseBinaryOutput(options, binary))
+                return -1;
+        }
+        if (options.query && !QueryPaletteIndex(options, palette))
+            return -1;
+        WriteVariantOutputs(options, renderer, variants, extractor, palette, -1);
+    }
+    StopPhase(timer, imageTimings, Phase::Output);
+
+    if (options.timings)
+        PrintTimings(timings, (long long)image.width * image.height, GetDecodedByteCount(image));
+    if (timings.counters)
+        PrintPerfCounters(timings, counters, (long long)image.width * image.height);
+    ClosePerfCounters(counters);
+    return FinishTrace(options, 0);
 }
\ No newline at end of file
@@ -0,0 +1,714 @@
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <filesystem>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "image2palette.hpp"
+
+//End-to-end throughput over deterministic synthetic images of 1 to 200 MP, decode included.
+//Every configuration runs in its own process so its peak RSS can be read back with wait4.
+//  g++ -O2 -std=c++17 throughput.cpp image2palette.cpp -o palette-throughput -lpthread
+
+#define JPEG_QUALITY 90
+#define PNG_CHUNK_SIZE (1 << 20)
+#define DEFLATE_STORED_BLOCK_SIZE 65535
+
+struct ThroughputOptions {
+    const char* sizes{ "1,12,48,200" };
+    const char* formats{ "jpeg,png,ppm" };
+    const char* workDirectory{ "throughput-images" };
+    const char* outputJson{ nullptr };
+    const char* engine{ nullptr };
+    int maxThreads{};
+    int runs{ 3 };
+};
+
+struct ThroughputResult {
+    int megapixels{};
+    const char* format{ nullptr };
+    int threads{};
+    size_t fileBytes{};
+    double seconds{};
+    long peakRssKb{};
+};
+
+unsigned int HashTile(unsigned int x, unsigned int y) {
+    unsigned int hash = x * 0x9e3779b1u ^ y * 0x85ebca77u;
+    hash ^= hash >> 15;
+    hash *= 0x2c1b3c6du;
+    return hash ^ (hash >> 12);
+}
+
+//Gradients under hashed 64x64 tiles, a lot of distinct hues without being noise
+void GenerateRow(int width, int height, int y, unsigned char* row) {
+    for (int x = 0; x < width; ++x) {
+        unsigned int tile = HashTile(x / 64, y / 64);
+        row[x * 3] = (unsigned char)((x * 256LL / width + (tile & 0x3f)) & 0xff);
+        row[x * 3 + 1] = (unsigned char)((y * 256LL / height + ((tile >> 8) & 0x3f)) & 0xff);
+        row[x * 3 + 2] = (unsigned char)((tile >> 16) & 0xff);
+    }
+}
+
+bool WritePpm(const char* path, int width, int height) {
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    std::vector<unsigned char> row((size_t)width * 3);
+    for (int y = 0; y < height; ++y) {
+        GenerateRow(width, height, y, row.data());
+        fwrite(row.data(), 1, row.size(), file);
+    }
+    return fclose(file) == 0;
+}
+
+unsigned int UpdateCrc32(unsigned int crc, const unsigned char* data, size_t size) {
+    static unsigned int table[256]{};
+    if (!table[1]) {
+        for (unsigned int i = 0; i < 256; ++i) {
+            unsigned int value = i;
+            for (int j = 0; j < 8; ++j)
+                value = value & 1 ? 0xedb88320u ^ (value >> 1) : value >> 1;
+            table[i] = value;
+        }
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+void PutBigEndian32(std::vector<unsigned char>& buffer, unsigned int value) {
+    buffer.push_back(value >> 24);
+    buffer.push_back(value >> 16);
+    buffer.push_back(value >> 8);
+    buffer.push_back(value);
+}
+
+void WritePngChunk(FILE* file, const char* type, const unsigned char* data, size_t size) {
+    std::vector<unsigned char> header{};
+    PutBigEndian32(header, size);
+    header.insert(header.end(), type, type + 4);
+    unsigned int crc = UpdateCrc32(UpdateCrc32(0, header.data() + 4, 4), data, size);
+
+    std::vector<unsigned char> footer{};
+    PutBigEndian32(footer, crc);
+    fwrite(header.data(), 1, header.size(), file);
+    fwrite(data, 1, size, file);
+    fwrite(footer.data(), 1, footer.size(), file);
+}
+
+//Uncompressed deflate, the PNG costs inflate and unfiltering without a real compressor here
+struct StoredZlibStream {
+    FILE* file{ nullptr };
+    std::vector<unsigned char> pending{}; //Raw bytes of the next stored block
+    std::vector<unsigned char> chunk{}; //Zlib bytes of the next IDAT chunk
+    unsigned int adlerA{ 1 };
+    unsigned int adlerB{};
+};
+
+void FlushStoredBlock(StoredZlibStream& stream, bool last) {
+    size_t size = stream.pending.size();
+    stream.chunk.push_back(last ? 1 : 0);
+    stream.chunk.push_back(size & 0xff);
+    stream.chunk.push_back(size >> 8);
+    stream.chunk.push_back(~size & 0xff);
+    stream.chunk.push_back((~size >> 8) & 0xff);
+    stream.chunk.insert(stream.chunk.end(), stream.pending.begin(), stream.pending.end());
+    stream.pending.clear();
+
+    if (stream.chunk.size() >= PNG_CHUNK_SIZE || last) {
+        if (last)
+            PutBigEndian32(stream.chunk, stream.adlerB << 16 | stream.adlerA);
+        WritePngChunk(stream.file, "IDAT", stream.chunk.data(), stream.chunk.size());
+        stream.chunk.clear();
+    }
+}
+
+void WriteStored(StoredZlibStream& stream, const unsigned char* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        stream.adlerA = (stream.adlerA + data[i]) % 65521;
+        stream.adlerB = (stream.adlerB + stream.adlerA) % 65521;
+        stream.pending.push_back(data[i]);
+        if (stream.pending.size() == DEFLATE_STORED_BLOCK_SIZE)
+            FlushStoredBlock(stream, false);
+    }
+}
+
+bool WritePng(const char* path, int width, int height) {
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    fwrite(signature, 1, 8, file);
+
+    std::vector<unsigned char> header{};
+    PutBigEndian32(header, width);
+    PutBigEndian32(header, height);
+    header.insert(header.end(), { 8, 2, 0, 0, 0 }); //8 bit RGB, no interlacing
+    WritePngChunk(file, "IHDR", header.data(), header.size());
+
+    StoredZlibStream stream{};
+    stream.file = file;
+    stream.chunk.insert(stream.chunk.end(), { 0x78, 0x01 });
+
+    std::vector<unsigned char> row((size_t)width * 3 + 1);
+    for (int y = 0; y < height; ++y) {
+        row[0] = 0; //No filter
+        GenerateRow(width, height, y, row.data() + 1);
+        WriteStored(stream, row.data(), row.size());
+    }
+    FlushStoredBlock(stream, true);
+
+    WritePngChunk(file, "IEND", nullptr, 0);
+    return fclose(file) == 0;
+}
+
+const unsigned char ZIGZAG[64] = {
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+const unsigned char LUMINANCE_QUANTIZATION[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99
+};
+
+const unsigned char CHROMINANCE_QUANTIZATION[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99
+};
+
+//Typical Huffman tables of the JPEG specification, annex K.3
+const unsigned char DC_LUMINANCE_BITS[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+const unsigned char DC_CHROMINANCE_BITS[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+const unsigned char DC_VALUES[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+const unsigned char AC_LUMINANCE_BITS[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+const unsigned char AC_LUMINANCE_VALUES[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+const unsigned char AC_CHROMINANCE_BITS[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+const unsigned char AC_CHROMINANCE_VALUES[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+struct HuffmanTable {
+    unsigned short codes[256]{};
+    unsigned char sizes[256]{};
+};
+
+struct JpegComponent {
+    float divisors[64]{}; //Natural order, quantization and DCT scaling folded together
+    const HuffmanTable* dc{ nullptr };
+    const HuffmanTable* ac{ nullptr };
+    int previousDc{};
+};
+
+struct JpegBitWriter {
+    FILE* file{ nullptr };
+    unsigned int buffer{};
+    int count{};
+    std::vector<unsigned char> bytes{};
+};
+
+void BuildHuffmanTable(const unsigned char* bits, const unsigned char* values, HuffmanTable& table) {
+    int code = 0;
+    int k = 0;
+    for (int length = 1; length <= 16; ++length) {
+        for (int i = 0; i < bits[length - 1]; ++i, ++k) {
+            table.codes[values[k]] = code++;
+            table.sizes[values[k]] = length;
+        }
+        code <<= 1;
+    }
+}
+
+void WriteBits(JpegBitWriter& writer, unsigned int bits, int count) {
+    writer.buffer = writer.buffer << count | (bits & ((1u << count) - 1));
+    writer.count += count;
+    while (writer.count >= 8) {
+        unsigned char byte = writer.buffer >> (writer.count - 8);
+        writer.bytes.push_back(byte);
+        if (byte == 0xff)
+            writer.bytes.push_back(0);
+        writer.count -= 8;
+    }
+    if (writer.bytes.size() >= PNG_CHUNK_SIZE) {
+        fwrite(writer.bytes.data(), 1, writer.bytes.size(), writer.file);
+        writer.bytes.clear();
+    }
+}
+
+//Separable AAN forward DCT, the outputs are scaled by the divisors
+void ForwardDct(float* data, int s, int stride) {
+    for (int i = 0; i < 8; ++i) {
+        float* d = data + i * stride;
+        float tmp0 = d[0] + d[7 * s];
+        float tmp7 = d[0] - d[7 * s];
+        float tmp1 = d[s] + d[6 * s];
+        float tmp6 = d[s] - d[6 * s];
+        float tmp2 = d[2 * s] + d[5 * s];
+        float tmp5 = d[2 * s] - d[5 * s];
+        float tmp3 = d[3 * s] + d[4 * s];
+        float tmp4 = d[3 * s] - d[4 * s];
+
+        float tmp10 = tmp0 + tmp3;
+        float tmp13 = tmp0 - tmp3;
+        float tmp11 = tmp1 + tmp2;
+        float tmp12 = tmp1 - tmp2;
+        d[0] = tmp10 + tmp11;
+        d[4 * s] = tmp10 - tmp11;
+        float z1 = (tmp12 + tmp13) * 0.707106781f;
+        d[2 * s] = tmp13 + z1;
+        d[6 * s] = tmp13 - z1;
+
+        tmp10 = tmp4 + tmp5;
+        tmp11 = tmp5 + tmp6;
+        tmp12 = tmp6 + tmp7;
+        float z5 = (tmp10 - tmp12) * 0.382683433f;
+        float z2 = 0.541196100f * tmp10 + z5;
+        float z4 = 1.306562965f * tmp12 + z5;
+        float z3 = tmp11 * 0.707106781f;
+        float z11 = tmp7 + z3;
+        float z13 = tmp7 - z3;
+        d[5 * s] = z13 + z2;
+        d[3 * s] = z13 - z2;
+        d[s] = z11 + z4;
+        d[7 * s] = z11 - z4;
+    }
+}
+
+int GetBitLength(int value) {
+    int length = 0;
+    for (value = abs(value); value; value >>= 1)
+        ++length;
+    return length;
+}
+
+void EncodeBlock(JpegBitWriter& writer, JpegComponent& component, float* block) {
+    ForwardDct(block, 1, 8); //Rows
+    ForwardDct(block, 8, 1); //Columns
+
+    int coefficients[64];
+    for (int i = 0; i < 64; ++i) {
+        float value = block[ZIGZAG[i]] / component.divisors[ZIGZAG[i]];
+        coefficients[i] = (int)(value < 0.0f ? value - 0.5f : value + 0.5f);
+    }
+
+    int diff = coefficients[0] - component.previousDc;
+    component.previousDc = coefficients[0];
+    int length = GetBitLength(diff);
+    WriteBits(writer, component.dc->codes[length], component.dc->sizes[length]);
+    if (length)
+        WriteBits(writer, diff < 0 ? diff - 1 : diff, length);
+
+    int run = 0;
+    for (int i = 1; i < 64; ++i) {
+        if (!coefficients[i]) {
+            ++run;
+            continue;
+        }
+        for (; run >= 16; run -= 16)
+            WriteBits(writer, component.ac->codes[0xf0], component.ac->sizes[0xf0]);
+        length = GetBitLength(coefficients[i]);
+        int symbol = run << 4 | length;
+        WriteBits(writer, component.ac->codes[symbol], component.ac->sizes[symbol]);
+        WriteBits(writer, coefficients[i] < 0 ? coefficients[i] - 1 : coefficients[i], length);
+        run = 0;
+    }
+    if (run)
+        WriteBits(writer, component.ac->codes[0x00], component.ac->sizes[0x00]);
+}
+
+void BuildQuantization(const unsigned char* base, unsigned char* table, float* divisors) {
+    const float aanScales[8] = { 1.0f, 1.387039845f, 1.306562965f, 1.175875602f, 1.0f, 0.785694958f, 0.541196100f, 0.275899379f };
+    int scale = JPEG_QUALITY < 50 ? 5000 / JPEG_QUALITY : 200 - JPEG_QUALITY * 2;
+    for (int i = 0; i < 64; ++i) {
+        table[i] = (unsigned char)std::clamp((base[i] * scale + 50) / 100, 1, 255);
+        divisors[i] = table[i] * aanScales[i / 8] * aanScales[i % 8] * 8.0f;
+    }
+}
+
+void WriteMarkerSegment(FILE* file, unsigned char marker, const std::vector<unsigned char>& payload) {
+    unsigned char header[4] = { 0xff, marker, (unsigned char)((payload.size() + 2) >> 8), (unsigned char)(payload.size() + 2) };
+    fwrite(header, 1, 4, file);
+    fwrite(payload.data(), 1, payload.size(), file);
+}
+
+void AppendHuffmanTable(std::vector<unsigned char>& payload, unsigned char id, const unsigned char* bits, const unsigned char* values, int count) {
+    payload.push_back(id);
+    payload.insert(payload.end(), bits, bits + 16);
+    payload.insert(payload.end(), values, values + count);
+}
+
+//Baseline 4:4:4 JPEG, written 8 rows at a time
+bool WriteJpeg(const char* path, int width, int height) {
+    if (width > 65535 || height > 65535)
+        return false;
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    HuffmanTable dcLuminance{}, acLuminance{}, dcChrominance{}, acChrominance{};
+    BuildHuffmanTable(DC_LUMINANCE_BITS, DC_VALUES, dcLuminance);
+    BuildHuffmanTable(AC_LUMINANCE_BITS, AC_LUMINANCE_VALUES, acLuminance);
+    BuildHuffmanTable(DC_CHROMINANCE_BITS, DC_VALUES, dcChrominance);
+    BuildHuffmanTable(AC_CHROMINANCE_BITS, AC_CHROMINANCE_VALUES, acChrominance);
+
+    JpegComponent components[3]{};
+    unsigned char luminanceTable[64]{}, chrominanceTable[64]{};
+    BuildQuantization(LUMINANCE_QUANTIZATION, luminanceTable, components[0].divisors);
+    BuildQuantization(CHROMINANCE_QUANTIZATION, chrominanceTable, components[1].divisors);
+    std::copy(components[1].divisors, components[1].divisors + 64, components[2].divisors);
+    components[0].dc = &dcLuminance;
+    components[0].ac = &acLuminance;
+    for (int i = 1; i < 3; ++i) {
+        components[i].dc = &dcChrominance;
+        components[i].ac = &acChrominance;
+    }
+
+    const unsigned char startOfImage[2] = { 0xff, 0xd8 };
+    fwrite(startOfImage, 1, 2, file);
+    WriteMarkerSegment(file, 0xe0, { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 });
+
+    std::vector<unsigned char> payload{ 0 };
+    for (int i = 0; i < 64; ++i)
+        payload.push_back(luminanceTable[ZIGZAG[i]]);
+    payload.push_back(1);
+    for (int i = 0; i < 64; ++i)
+        payload.push_back(chrominanceTable[ZIGZAG[i]]);
+    WriteMarkerSegment(file, 0xdb, payload);
+
+    WriteMarkerSegment(file, 0xc0, { 8, (unsigned char)(height >> 8), (unsigned char)height, (unsigned char)(width >> 8), (unsigned char)width,
+        3, 1, 0x11, 0, 2, 0x11, 1, 3, 0x11, 1 });
+
+    payload.clear();
+    AppendHuffmanTable(payload, 0x00, DC_LUMINANCE_BITS, DC_VALUES, 12);
+    AppendHuffmanTable(payload, 0x10, AC_LUMINANCE_BITS, AC_LUMINANCE_VALUES, 162);
+    AppendHuffmanTable(payload, 0x01, DC_CHROMINANCE_BITS, DC_VALUES, 12);
+    AppendHuffmanTable(payload, 0x11, AC_CHROMINANCE_BITS, AC_CHROMINANCE_VALUES, 162);
+    WriteMarkerSegment(file, 0xc4, payload);
+
+    WriteMarkerSegment(file, 0xda, { 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0 });
+
+    JpegBitWriter writer{};
+    writer.file = file;
+    std::vector<unsigned char> rows((size_t)width * 3 * 8);
+    for (int top = 0; top < height; top += 8) {
+        int rowCount = std::min(8, height - top);
+        for (int y = 0; y < rowCount; ++y)
+            GenerateRow(width, height, top + y, &rows[(size_t)y * width * 3]);
+
+        for (int left = 0; left < width; left += 8) {
+            float blocks[3][64];
+            for (int i = 0; i < 64; ++i) {
+                //Partial blocks repeat the last row and column
+                int x = std::min(left + i % 8, width - 1);
+                int y = std::min(i / 8, rowCount - 1);
+                const unsigned char* pixel = &rows[((size_t)y * width + x) * 3];
+                float r = pixel[0], g = pixel[1], b = pixel[2];
+                blocks[0][i] = 0.299f * r + 0.587f * g + 0.114f * b - 128.0f;
+                blocks[1][i] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+                blocks[2][i] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+            }
+            for (int c = 0; c < 3; ++c)
+                EncodeBlock(writer, components[c], blocks[c]);
+        }
+    }
+
+    WriteBits(writer, 0x7f, 7); //Pads the last byte with ones
+    writer.count = 0;
+    fwrite(writer.bytes.data(), 1, writer.bytes.size(), file);
+    const unsigned char endOfImage[2] = { 0xff, 0xd9 };
+    fwrite(endOfImage, 1, 2, file);
+    return fclose(file) == 0;
+}
+
+//4:3 images of about the requested size
+void GetSyntheticSize(int megapixels, int& width, int& height) {
+    width = (int)std::lround(std::sqrt(megapixels * 1000000.0 * 4.0 / 3.0));
+    height = (int)std::lround(megapixels * 1000000.0 / width);
+}
+
+//Generated once per work directory, the pattern is deterministic so existing files are reused
+bool PrepareImage(const ThroughputOptions& options, int megapixels, const std::string& format, std::string& path) {
+    path = std::string{ options.workDirectory } + "/synthetic-" + std::to_string(megapixels) + "mp." + format;
+    if (std::filesystem::exists(path))
+        return true;
+
+    int width{}, height{};
+    GetSyntheticSize(megapixels, width, height);
+    std::cout << "Generating \"" << path << "\" (" << width << "x" << height << ")..." << std::endl;
+
+    std::string partialPath = path + ".partial";
+    bool written = false;
+    if (format == "jpeg")
+        written = WriteJpeg(partialPath.c_str(), width, height);
+    else if (format == "png")
+        written = WritePng(partialPath.c_str(), width, height);
+    else
+        written = WritePpm(partialPath.c_str(), width, height);
+
+    std::error_code error{};
+    if (written)
+        std::filesystem::rename(partialPath, path, error);
+    return written && !error;
+}
+
+//Runs in the forked child, stdout is silenced so only the timing goes back through the pipe
+double RunConfiguration(const char* path, const ExtractionSettings& settings, int runs) {
+    PaletteExtractor extractor{ settings };
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; ++i) {
+        ImageView image{};
+        if (!LoadImageFile(path, image))
+            return -1.0;
+        Base16Palette palette{};
+        extractor.extract(image, palette);
+        FreeImage(image);
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool MeasureConfiguration(const char* path, const ExtractionSettings& settings, int runs, ThroughputResult& result) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    if (pid == 0) {
+        close(fds[0]);
+        if (!freopen("/dev/null", "w", stdout))
+            _exit(1);
+        double seconds = RunConfiguration(path, settings, runs);
+        ssize_t written = write(fds[1], &seconds, sizeof(seconds));
+        _exit(written == sizeof(seconds) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    double seconds = -1.0;
+    ssize_t received = read(fds[0], &seconds, sizeof(seconds));
+    close(fds[0]);
+
+    int status{};
+    struct rusage usage{};
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return false;
+    if (received != sizeof(seconds) || seconds < 0.0)
+        return false;
+
+    result.seconds = seconds;
+    result.peakRssKb = usage.ru_maxrss; //Kilobytes on Linux
+    return true;
+}
+
+bool ParseIntList(const char* list, std::vector<int>& values) {
+    std::string text{ list };
+    size_t begin = 0;
+    while (begin <= text.size()) {
+        size_t end = std::min(text.find(',', begin), text.size());
+        int value = atoi(text.substr(begin, end - begin).c_str());
+        if (value < 1)
+            return false;
+        values.push_back(value);
+        begin = end + 1;
+    }
+    return true;
+}
+
+bool WriteThroughputJson(const std::vector<ThroughputResult>& results, const ThroughputOptions& options, const char* engine, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "{\n    \"engine\": \"%s\",\n    \"runs\": %d,\n    \"results\": [\n", engine, options.runs);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const ThroughputResult& result = results[i];
+        double megabytes = (double)result.fileBytes * options.runs / 1000000.0;
+        fprintf(file, "        { \"megapixels\": %d, \"format\": \"%s\", \"threads\": %d, \"file_bytes\": %zu, \"images_per_second\": %.4f, "
+            "\"megabytes_per_second\": %.3f, \"megapixels_per_second\": %.3f, \"peak_rss_kb\": %ld }%s\n",
+            result.megapixels, result.format, result.threads, result.fileBytes, options.runs / result.seconds, megabytes / result.seconds,
+            (double)result.megapixels * options.runs / result.seconds, result.peakRssKb, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "    ]\n}\n");
+    fclose(file);
+    return true;
+}
+
+void GetOptions(int argc, char* argv[], ThroughputOptions& options) {
+    int i = 1;
+    while (i < argc) {
+        if (strcmp(argv[i], "--sizes") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.sizes = argv[i];
+        }
+        if (strcmp(argv[i], "--formats") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.formats = argv[i];
+        }
+        if (strcmp(argv[i], "--work-dir") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.workDirectory = argv[i];
+        }
+        if (strcmp(argv[i], "--json") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.outputJson = argv[i];
+        }
+        if (strcmp(argv[i], "--engine") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.engine = argv[i];
+        }
+        if (strcmp(argv[i], "--max-threads") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.maxThreads = atoi(argv[i]);
+        }
+        if (strcmp(argv[i], "--runs") == 0) {
+            ++i;
+            if (i >= argc)
+                break;
+            options.runs = atoi(argv[i]);
+        }
+        ++i;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    ThroughputOptions options{};
+    GetOptions(argc, argv, options);
+
+    ExtractionSettings settings{};
+    if (options.engine && !ParseEngine(options.engine, settings.engine)) {
+        std::cerr << "Unknown engine \"" << options.engine << "\". use --engine <histogram|octree|kmeans>." << std::endl;
+        return -1;
+    }
+    if (options.maxThreads < 1)
+        options.maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    if (options.runs < 1) {
+        std::cerr << "Run count must be at least 1." << std::endl;
+        return -1;
+    }
+
+    std::vector<int> sizes{};
+    if (!ParseIntList(options.sizes, sizes)) {
+        std::cerr << "Invalid sizes \"" << options.sizes << "\". use --sizes <megapixels,...>." << std::endl;
+        return -1;
+    }
+
+    std::vector<std::string> formats{};
+    std::string formatList{ options.formats };
+    for (size_t begin = 0; begin <= formatList.size();) {
+        size_t end = std::min(formatList.find(',', begin), formatList.size());
+        std::string format = formatList.substr(begin, end - begin);
+        if (format != "jpeg" && format != "png" && format != "ppm") {
+            std::cerr << "Unknown format \"" << format << "\". use --formats <jpeg,png,ppm>." << std::endl;
+            return -1;
+        }
+        formats.push_back(format);
+        begin = end + 1;
+    }
+
+    std::error_code error{};
+    std::filesystem::create_directories(options.workDirectory, error);
+    if (error) {
+        std::cerr << "Couldn't create \"" << options.workDirectory << "\"." << std::endl;
+        return -1;
+    }
+
+    printf("%6s %-5s %7s %10s %10s %10s %12s\n", "MP", "fmt", "threads", "images/s", "MB/s", "MP/s", "peak RSS MB");
+    std::vector<ThroughputResult> results{};
+    for (int megapixels : sizes) {
+        for (const auto& format : formats) {
+            std::string path{};
+            if (!PrepareImage(options, megapixels, format, path)) {
+                std::cerr << "Couldn't generate \"" << path << "\"." << std::endl;
+                return -1;
+            }
+
+            for (int threads = 1; threads <= options.maxThreads; ++threads) {
+                ThroughputResult result{};
+                result.megapixels = megapixels;
+                result.format = format == "jpeg" ? "jpeg" : format == "png" ? "png" : "ppm";
+                result.threads = threads;
+                result.fileBytes = std::filesystem::file_size(path, error);
+
+                settings.threadCount = threads;
+                if (!MeasureConfiguration(path.c_str(), settings, options.runs, result)) {
+                    std::cerr << "Couldn't run \"" << path << "\" with " << threads << " threads." << std::endl;
+                    return -1;
+                }
+
+                printf("%6d %-5s %7d %10.3f %10.1f %10.1f %12.1f\n", megapixels, result.format, threads, options.runs / result.seconds,
+                    (double)result.fileBytes * options.runs / 1000000.0 / result.seconds, (double)megapixels * options.runs / result.seconds,
+                    result.peakRssKb / 1024.0);
+                results.push_back(result);
+            }
+        }
+    }
+
+    if (options.outputJson) {
+        if (!WriteThroughputJson(results, options, GetEngineName(settings.engine), options.outputJson)) {
+            std::cerr << "Couldn't write \"" << options.outputJson << "\"." << std::endl;
+            return -1;
+        }
+        std::cout << "Writing throughput results to \"" << options.outputJson << "\"." << std::endl;
+    }
+
+    return 0;
+}